@@ -769,8 +769,19 @@ const char* drflac_next_vorbis_comment(drflac_vorbis_comment_iterator* pIter, dr
             #include <intrin.h>
             static void drflac__cpuid(int info[4], int fid)
             {
+            #if _MSC_VER >= 1500
+                __cpuidex(info, fid, 0);
+            #else
                 __cpuid(info, fid);
+            #endif
             }
+            #if defined(_MSC_FULL_VER) && _MSC_FULL_VER >= 160040219
+            #define DRFLAC_HAS_XGETBV
+            static drflac_uint64 drflac__xgetbv(int reg)
+            {
+                return _xgetbv(reg);
+            }
+            #endif
         #else
         #define DRFLAC_NO_CPUID
         #endif
@@ -780,6 +791,7 @@ const char* drflac_next_vorbis_comment(drflac_vorbis_comment_iterator* pIter, dr
             {
                 asm (
                     "movl %[fid], %%eax\n\t"
+                    "xorl %%ecx, %%ecx\n\t"
                     "cpuid\n\t"
                     "movl %%eax, %[info0]\n\t"
                     "movl %%ebx, %[info1]\n\t"
@@ -793,6 +805,13 @@ const char* drflac_next_vorbis_comment(drflac_vorbis_comment_iterator* pIter, dr
                     : "eax", "ebx", "ecx", "edx"
                 );
             }
+            #define DRFLAC_HAS_XGETBV
+            static drflac_uint64 drflac__xgetbv(int reg)
+            {
+                drflac_uint32 lo, hi;
+                asm ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(reg));
+                return ((drflac_uint64)hi << 32) | lo;
+            }
         #else
         #define DRFLAC_NO_CPUID
         #endif
@@ -801,6 +820,26 @@ const char* drflac_next_vorbis_comment(drflac_vorbis_comment_iterator* pIter, dr
 #define DRFLAC_NO_CPUID
 #endif
 
+// SSE4.1 and AVX2 LPC kernels, picked at run time from the CPU caps. GCC and Clang compile them through target attributes
+// so the rest of the library does not need -msse4.1/-mavx2.
+#if !defined(DR_FLAC_NO_SIMD) && !defined(DRFLAC_NO_CPUID)
+    #if defined(_MSC_VER) && _MSC_VER >= 1800 && defined(DRFLAC_HAS_XGETBV)
+        #define DRFLAC_SUPPORT_SSE41
+        #define DRFLAC_SUPPORT_AVX2
+        #define DRFLAC_TARGET_SSE41
+        #define DRFLAC_TARGET_AVX2
+    #elif (defined(__GNUC__) && !defined(__clang__) && ((__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))) || \
+          (defined(__clang__) && ((__clang_major__ > 3) || (__clang_major__ == 3 && __clang_minor__ >= 8)))
+        #define DRFLAC_SUPPORT_SSE41
+        #define DRFLAC_SUPPORT_AVX2
+        #define DRFLAC_TARGET_SSE41 __attribute__((target("sse4.1")))
+        #define DRFLAC_TARGET_AVX2  __attribute__((target("avx2")))
+    #endif
+    #ifdef DRFLAC_SUPPORT_SSE41
+        #include <immintrin.h>
+    #endif
+#endif
+
 
 #ifdef __linux__
 #define _BSD_SOURCE
@@ -892,7 +931,9 @@ typedef drflac_int32 drflac_result;
 // CPU caps.
 static drflac_bool32 drflac__gIsLZCNTSupported = DRFLAC_FALSE;
 #ifndef DRFLAC_NO_CPUID
+static drflac_bool32 drflac__gIsSSE41Supported = DRFLAC_FALSE;
 static drflac_bool32 drflac__gIsSSE42Supported = DRFLAC_FALSE;
+static drflac_bool32 drflac__gIsAVX2Supported = DRFLAC_FALSE;
 static void drflac__init_cpu_caps()
 {
     int info[4] = {0};
@@ -901,9 +942,22 @@ static void drflac__init_cpu_caps()
     drflac__cpuid(info, 0x80000001);
     drflac__gIsLZCNTSupported = (info[2] & (1 <<  5)) != 0;
 
-    // SSE4.2
+    // SSE4.1 and SSE4.2
     drflac__cpuid(info, 1);
-    drflac__gIsSSE42Supported = (info[2] & (1 << 19)) != 0;
+    drflac__gIsSSE41Supported = (info[2] & (1 << 19)) != 0;
+    drflac__gIsSSE42Supported = (info[2] & (1 << 20)) != 0;
+
+    // AVX2 also needs the OS to save the YMM registers (OSXSAVE, then XMM and YMM state enabled in XCR0).
+    drflac__gIsAVX2Supported = DRFLAC_FALSE;
+#ifdef DRFLAC_HAS_XGETBV
+    if ((info[2] & (1 << 27)) != 0 && (drflac__xgetbv(0) & 6) == 6) {
+        drflac__cpuid(info, 0);
+        if (info[0] >= 7) {
+            drflac__cpuid(info, 7);
+            drflac__gIsAVX2Supported = (info[1] & (1 << 5)) != 0;
+        }
+    }
+#endif
 }
 #endif
 
@@ -2143,6 +2197,306 @@ static DRFLAC_INLINE drflac_int32 drflac__calculate_prediction_64(drflac_uint32
     return (drflac_int32)(prediction >> shift);
 }
 
+
+// SIMD restoration of LPC subframes. The residual of the whole subframe is decoded first, then the prediction is added 4
+// samples at a time. For those 4 samples, the terms that reach back further than the 4 samples before them do not depend
+// on anything being decoded right now, so they are summed in vector registers for all 4 at once. The remaining terms (the
+// previous 4 samples and the current ones) run on scalar registers, which keeps the chain from one sample to the next at
+// a single multiply-add. The results are bit-identical to drflac__calculate_prediction_32/_64.
+//
+// The kernels need an order of at least DRFLAC_SIMD_LPC_MIN_ORDER and 12 restored samples before pSamples. Below order 8
+// the scalar code is as fast.
+#define DRFLAC_SIMD_LPC_MIN_ORDER   8
+#define DRFLAC_SIMD_LPC_HISTORY     12
+
+#ifdef DRFLAC_SUPPORT_SSE41
+// The scalar side of 4 predictions. <a0..a3> hold the vector side of each sum, <c> the first 7 coefficients (zero past the
+// order) and <p> the 4 samples before pSamples, which are replaced with the 4 new ones.
+static DRFLAC_INLINE void drflac__lpc_finish_4_32(const drflac_int32* c, drflac_int32 shift, drflac_int32 a0, drflac_int32 a1, drflac_int32 a2, drflac_int32 a3, drflac_int32* p, drflac_int32* pSamples)
+{
+    drflac_int32 t0 = a0 + c[1]*p[2] + c[2]*p[1] + c[3]*p[0];
+    drflac_int32 t1 = a1 + c[1]*p[3] + c[2]*p[2] + c[3]*p[1] + c[4]*p[0];
+    drflac_int32 t2 = a2 + c[2]*p[3] + c[3]*p[2] + c[4]*p[1] + c[5]*p[0];
+    drflac_int32 t3 = a3 + c[3]*p[3] + c[4]*p[2] + c[5]*p[1] + c[6]*p[0];
+
+    // The newest sample goes in last.
+    drflac_int32 y0 = pSamples[0] + ((t0 + c[0]*p[3]) >> shift);
+    t2 += c[1]*y0;
+    t3 += c[2]*y0;
+    drflac_int32 y1 = pSamples[1] + ((t1 + c[0]*y0) >> shift);
+    t3 += c[1]*y1;
+    drflac_int32 y2 = pSamples[2] + ((t2 + c[0]*y1) >> shift);
+    drflac_int32 y3 = pSamples[3] + ((t3 + c[0]*y2) >> shift);
+
+    pSamples[0] = p[0] = y0;
+    pSamples[1] = p[1] = y1;
+    pSamples[2] = p[2] = y2;
+    pSamples[3] = p[3] = y3;
+}
+
+static DRFLAC_INLINE void drflac__lpc_finish_4_64(const drflac_int64* c, drflac_int32 shift, drflac_int64 a0, drflac_int64 a1, drflac_int64 a2, drflac_int64 a3, drflac_int64* p, drflac_int32* pSamples)
+{
+    drflac_int64 t0 = a0 + c[1]*p[2] + c[2]*p[1] + c[3]*p[0];
+    drflac_int64 t1 = a1 + c[1]*p[3] + c[2]*p[2] + c[3]*p[1] + c[4]*p[0];
+    drflac_int64 t2 = a2 + c[2]*p[3] + c[3]*p[2] + c[4]*p[1] + c[5]*p[0];
+    drflac_int64 t3 = a3 + c[3]*p[3] + c[4]*p[2] + c[5]*p[1] + c[6]*p[0];
+
+    drflac_int32 y0 = pSamples[0] + (drflac_int32)((t0 + c[0]*p[3]) >> shift);
+    t2 += c[1]*y0;
+    t3 += c[2]*y0;
+    drflac_int32 y1 = pSamples[1] + (drflac_int32)((t1 + c[0]*y0) >> shift);
+    t3 += c[1]*y1;
+    drflac_int32 y2 = pSamples[2] + (drflac_int32)((t2 + c[0]*y1) >> shift);
+    drflac_int32 y3 = pSamples[3] + (drflac_int32)((t3 + c[0]*y2) >> shift);
+
+    pSamples[0] = y0; p[0] = y0;
+    pSamples[1] = y1; p[1] = y1;
+    pSamples[2] = y2; p[2] = y2;
+    pSamples[3] = y3; p[3] = y3;
+}
+
+// Terms 5 to 11 come from the two blocks of 4 before the previous one, which are kept in registers (<v2> and the older
+// <v3>). Reading them back from memory would stall on the stores that just wrote them.
+DRFLAC_TARGET_SSE41
+static void drflac__restore_lpc_32__sse41(drflac_uint32 count, drflac_uint32 order, drflac_int32 shift, const drflac_int32* coefficients, drflac_int32* pSamples)
+{
+    __m128i cv[33];
+    drflac_int32 c[7] = {0};
+    drflac_int32 p[4];
+    drflac_uint32 j;
+    for (j = 0; j < 7 && j < order; ++j) {
+        c[j] = coefficients[j];
+    }
+    for (j = 5; j <= order; ++j) {
+        cv[j] = _mm_set1_epi32(coefficients[j-1]);
+    }
+
+    p[0] = pSamples[-4]; p[1] = pSamples[-3]; p[2] = pSamples[-2]; p[3] = pSamples[-1];
+    __m128i v2 = _mm_loadu_si128((const __m128i*)(pSamples - 8));
+    __m128i v3 = _mm_loadu_si128((const __m128i*)(pSamples - 12));
+
+    drflac_uint32 i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i acc =            _mm_mullo_epi32(_mm_srli_si128(v2, 12), cv[5]);
+        acc = _mm_add_epi32(acc, _mm_mullo_epi32(_mm_srli_si128(v2,  8), cv[6]));
+        acc = _mm_add_epi32(acc, _mm_mullo_epi32(_mm_srli_si128(v2,  4), cv[7]));
+        acc = _mm_add_epi32(acc, _mm_mullo_epi32(v2, cv[8]));
+        if (order >=  9) acc = _mm_add_epi32(acc, _mm_mullo_epi32(_mm_alignr_epi8(v2, v3, 12), cv[ 9]));
+        if (order >= 10) acc = _mm_add_epi32(acc, _mm_mullo_epi32(_mm_alignr_epi8(v2, v3,  8), cv[10]));
+        if (order >= 11) acc = _mm_add_epi32(acc, _mm_mullo_epi32(_mm_alignr_epi8(v2, v3,  4), cv[11]));
+        for (j = 12; j <= order; ++j) {
+            acc = _mm_add_epi32(acc, _mm_mullo_epi32(_mm_loadu_si128((const __m128i*)(pSamples + i - j)), cv[j]));
+        }
+
+        v3 = v2;
+        v2 = _mm_setr_epi32(p[0], p[1], p[2], p[3]);
+        drflac__lpc_finish_4_32(c, shift, _mm_cvtsi128_si32(acc), _mm_extract_epi32(acc, 1), _mm_extract_epi32(acc, 2), _mm_extract_epi32(acc, 3), p, pSamples + i);
+    }
+
+    for (; i < count; ++i) {
+        pSamples[i] += drflac__calculate_prediction_32(order, shift, coefficients, pSamples + i);
+    }
+}
+
+DRFLAC_TARGET_SSE41
+static void drflac__restore_lpc_64__sse41(drflac_uint32 count, drflac_uint32 order, drflac_int32 shift, const drflac_int32* coefficients, drflac_int32* pSamples)
+{
+    __m128i cv[33];
+    drflac_int64 c[7] = {0};
+    drflac_int64 p[4];
+    drflac_int64 a[4];
+    drflac_uint32 j;
+    for (j = 0; j < 7 && j < order; ++j) {
+        c[j] = coefficients[j];
+    }
+    for (j = 5; j <= order; ++j) {
+        cv[j] = _mm_set1_epi64x(coefficients[j-1]);
+    }
+
+    p[0] = pSamples[-4]; p[1] = pSamples[-3]; p[2] = pSamples[-2]; p[3] = pSamples[-1];
+    __m128i v2 = _mm_loadu_si128((const __m128i*)(pSamples - 8));
+    __m128i v3 = _mm_loadu_si128((const __m128i*)(pSamples - 12));
+
+    // Lanes 0-1 and 2-3 of each term, widened to 64 bits.
+#define DRFLAC__MAC_64_SSE41(w, k) \
+    { __m128i w_ = (w); \
+      lo = _mm_add_epi64(lo, _mm_mul_epi32(_mm_cvtepi32_epi64(w_), cv[k])); \
+      hi = _mm_add_epi64(hi, _mm_mul_epi32(_mm_cvtepi32_epi64(_mm_srli_si128(w_, 8)), cv[k])); }
+
+    drflac_uint32 i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i lo = _mm_setzero_si128();
+        __m128i hi = _mm_setzero_si128();
+        DRFLAC__MAC_64_SSE41(_mm_srli_si128(v2, 12), 5);
+        DRFLAC__MAC_64_SSE41(_mm_srli_si128(v2,  8), 6);
+        DRFLAC__MAC_64_SSE41(_mm_srli_si128(v2,  4), 7);
+        DRFLAC__MAC_64_SSE41(v2, 8);
+        if (order >=  9) DRFLAC__MAC_64_SSE41(_mm_alignr_epi8(v2, v3, 12),  9);
+        if (order >= 10) DRFLAC__MAC_64_SSE41(_mm_alignr_epi8(v2, v3,  8), 10);
+        if (order >= 11) DRFLAC__MAC_64_SSE41(_mm_alignr_epi8(v2, v3,  4), 11);
+        for (j = 12; j <= order; ++j) {
+            DRFLAC__MAC_64_SSE41(_mm_loadu_si128((const __m128i*)(pSamples + i - j)), j);
+        }
+        _mm_storeu_si128((__m128i*)(a + 0), lo);
+        _mm_storeu_si128((__m128i*)(a + 2), hi);
+
+        v3 = v2;
+        v2 = _mm_setr_epi32((drflac_int32)p[0], (drflac_int32)p[1], (drflac_int32)p[2], (drflac_int32)p[3]);
+        drflac__lpc_finish_4_64(c, shift, a[0], a[1], a[2], a[3], p, pSamples + i);
+    }
+#undef DRFLAC__MAC_64_SSE41
+
+    for (; i < count; ++i) {
+        pSamples[i] += drflac__calculate_prediction_64(order, shift, coefficients, pSamples + i);
+    }
+}
+#endif
+
+#ifdef DRFLAC_SUPPORT_AVX2
+// Two terms per multiply: lanes 0-3 take term j, lanes 4-7 term j+1.
+DRFLAC_TARGET_AVX2
+static void drflac__restore_lpc_32__avx2(drflac_uint32 count, drflac_uint32 order, drflac_int32 shift, const drflac_int32* coefficients, drflac_int32* pSamples)
+{
+    __m256i cv[34];
+    drflac_int32 c[7] = {0};
+    drflac_int32 p[4];
+    drflac_uint32 j;
+    for (j = 0; j < 7 && j < order; ++j) {
+        c[j] = coefficients[j];
+    }
+    for (j = 5; j <= order; j += 2) {
+        drflac_int32 next = (j < order) ? coefficients[j] : 0;
+        cv[j] = _mm256_setr_epi32(coefficients[j-1], coefficients[j-1], coefficients[j-1], coefficients[j-1], next, next, next, next);
+    }
+
+    p[0] = pSamples[-4]; p[1] = pSamples[-3]; p[2] = pSamples[-2]; p[3] = pSamples[-1];
+    __m128i v2 = _mm_loadu_si128((const __m128i*)(pSamples - 8));
+    __m128i v3 = _mm_loadu_si128((const __m128i*)(pSamples - 12));
+
+#define DRFLAC__PAIR_AVX2(a, b) _mm256_inserti128_si256(_mm256_castsi128_si256(a), (b), 1)
+
+    drflac_uint32 i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i acc =               _mm256_mullo_epi32(DRFLAC__PAIR_AVX2(_mm_srli_si128(v2, 12), _mm_srli_si128(v2, 8)), cv[5]);
+        acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(DRFLAC__PAIR_AVX2(_mm_srli_si128(v2,  4), v2), cv[7]));
+        if (order >=  9) acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(DRFLAC__PAIR_AVX2(_mm_alignr_epi8(v2, v3, 12), _mm_alignr_epi8(v2, v3, 8)), cv[9]));
+        if (order >= 11) acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(DRFLAC__PAIR_AVX2(_mm_alignr_epi8(v2, v3,  4), _mm_loadu_si128((const __m128i*)(pSamples + i - 12))), cv[11]));
+        for (j = 13; j < order; j += 2) {
+            __m128i w0 = _mm_loadu_si128((const __m128i*)(pSamples + i - j));
+            __m128i w1 = _mm_loadu_si128((const __m128i*)(pSamples + i - j - 1));
+            acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(DRFLAC__PAIR_AVX2(w0, w1), cv[j]));
+        }
+        if (j == order) {
+            acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(DRFLAC__PAIR_AVX2(_mm_loadu_si128((const __m128i*)(pSamples + i - j)), _mm_setzero_si128()), cv[j]));
+        }
+        __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+
+        v3 = v2;
+        v2 = _mm_setr_epi32(p[0], p[1], p[2], p[3]);
+        drflac__lpc_finish_4_32(c, shift, _mm_cvtsi128_si32(sum), _mm_extract_epi32(sum, 1), _mm_extract_epi32(sum, 2), _mm_extract_epi32(sum, 3), p, pSamples + i);
+    }
+#undef DRFLAC__PAIR_AVX2
+
+    for (; i < count; ++i) {
+        pSamples[i] += drflac__calculate_prediction_32(order, shift, coefficients, pSamples + i);
+    }
+}
+
+DRFLAC_TARGET_AVX2
+static void drflac__restore_lpc_64__avx2(drflac_uint32 count, drflac_uint32 order, drflac_int32 shift, const drflac_int32* coefficients, drflac_int32* pSamples)
+{
+    __m256i cv[33];
+    drflac_int64 c[7] = {0};
+    drflac_int64 p[4];
+    drflac_int64 a[4];
+    drflac_uint32 j;
+    for (j = 0; j < 7 && j < order; ++j) {
+        c[j] = coefficients[j];
+    }
+    for (j = 5; j <= order; ++j) {
+        cv[j] = _mm256_set1_epi64x(coefficients[j-1]);
+    }
+
+    p[0] = pSamples[-4]; p[1] = pSamples[-3]; p[2] = pSamples[-2]; p[3] = pSamples[-1];
+    __m128i v2 = _mm_loadu_si128((const __m128i*)(pSamples - 8));
+    __m128i v3 = _mm_loadu_si128((const __m128i*)(pSamples - 12));
+
+#define DRFLAC__MAC_64_AVX2(w, k) acc = _mm256_add_epi64(acc, _mm256_mul_epi32(_mm256_cvtepi32_epi64(w), cv[k]))
+
+    drflac_uint32 i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i acc = _mm256_setzero_si256();
+        DRFLAC__MAC_64_AVX2(_mm_srli_si128(v2, 12), 5);
+        DRFLAC__MAC_64_AVX2(_mm_srli_si128(v2,  8), 6);
+        DRFLAC__MAC_64_AVX2(_mm_srli_si128(v2,  4), 7);
+        DRFLAC__MAC_64_AVX2(v2, 8);
+        if (order >=  9) DRFLAC__MAC_64_AVX2(_mm_alignr_epi8(v2, v3, 12),  9);
+        if (order >= 10) DRFLAC__MAC_64_AVX2(_mm_alignr_epi8(v2, v3,  8), 10);
+        if (order >= 11) DRFLAC__MAC_64_AVX2(_mm_alignr_epi8(v2, v3,  4), 11);
+        for (j = 12; j <= order; ++j) {
+            DRFLAC__MAC_64_AVX2(_mm_loadu_si128((const __m128i*)(pSamples + i - j)), j);
+        }
+        _mm256_storeu_si256((__m256i*)a, acc);
+
+        v3 = v2;
+        v2 = _mm_setr_epi32((drflac_int32)p[0], (drflac_int32)p[1], (drflac_int32)p[2], (drflac_int32)p[3]);
+        drflac__lpc_finish_4_64(c, shift, a[0], a[1], a[2], a[3], p, pSamples + i);
+    }
+#undef DRFLAC__MAC_64_AVX2
+
+    for (; i < count; ++i) {
+        pSamples[i] += drflac__calculate_prediction_64(order, shift, coefficients, pSamples + i);
+    }
+}
+#endif
+
+// Whether drflac__restore_lpc__simd() can take a subframe of this order on this CPU.
+static DRFLAC_INLINE drflac_bool32 drflac__can_restore_lpc__simd(drflac_uint32 order, drflac_int32 shift)
+{
+#ifdef DRFLAC_SUPPORT_SSE41
+    return order >= DRFLAC_SIMD_LPC_MIN_ORDER && shift >= 0 && drflac__gIsSSE41Supported;
+#else
+    (void)order;
+    (void)shift;
+    return DRFLAC_FALSE;
+#endif
+}
+
+// Adds the prediction to a subframe that holds the warm up samples followed by the raw residual.
+static void drflac__restore_lpc__simd(drflac_uint32 bitsPerSample, drflac_uint32 blockSize, drflac_uint32 order, drflac_int32 shift, const drflac_int32* coefficients, drflac_int32* pDecodedSamples)
+{
+    // The first samples after the warm up are restored one by one until the kernels have their history.
+    drflac_uint32 i = order;
+    for (; i < DRFLAC_SIMD_LPC_HISTORY && i < blockSize; ++i) {
+        if (bitsPerSample > 16) {
+            pDecodedSamples[i] += drflac__calculate_prediction_64(order, shift, coefficients, pDecodedSamples + i);
+        } else {
+            pDecodedSamples[i] += drflac__calculate_prediction_32(order, shift, coefficients, pDecodedSamples + i);
+        }
+    }
+    if (i >= blockSize) {
+        return;
+    }
+
+#ifdef DRFLAC_SUPPORT_AVX2
+    if (drflac__gIsAVX2Supported) {
+        if (bitsPerSample > 16) {
+            drflac__restore_lpc_64__avx2(blockSize - i, order, shift, coefficients, pDecodedSamples + i);
+        } else {
+            drflac__restore_lpc_32__avx2(blockSize - i, order, shift, coefficients, pDecodedSamples + i);
+        }
+        return;
+    }
+#endif
+#ifdef DRFLAC_SUPPORT_SSE41
+    if (bitsPerSample > 16) {
+        drflac__restore_lpc_64__sse41(blockSize - i, order, shift, coefficients, pDecodedSamples + i);
+    } else {
+        drflac__restore_lpc_32__sse41(blockSize - i, order, shift, coefficients, pDecodedSamples + i);
+    }
+#endif
+}
+
 #if 0
 // Reference implementation for reading and decoding samples with residual. This is intentionally left unoptimized for the
 // sake of readability and should only be used as a reference.
@@ -2291,48 +2645,200 @@ static DRFLAC_INLINE drflac_bool32 drflac__read_rice_parts(drflac_bs* bs, drflac
 }
 
 
-static drflac_bool32 drflac__decode_samples_with_residual__rice__simple(drflac_bs* bs, drflac_uint32 bitsPerSample, drflac_uint32 count, drflac_uint8 riceParam, drflac_uint32 order, drflac_int32 shift, const drflac_int32* coefficients, drflac_int32* pSamplesOut)
+// Rice codes with a small parameter are decoded through lookup tables indexed by the next DRFLAC_RICE_TABLE_BITS bits of the
+// L1 cache. Each entry holds every code that fits entirely inside those bits, up to 4 of them:
+//   bits  0-3:  the number of bits taken by the codes (0 when not even the first code fits)
+//   bits  4-6:  the number of codes
+//   bits 16-63: the decoded residuals, 12 bits each, first code lowest
+// From a parameter of 4 up the index rarely holds more than one code, which is no better than the clz path, so those
+// parameters have no table.
+#define DRFLAC_RICE_TABLE_BITS          10
+#define DRFLAC_RICE_TABLE_MAX_PARAM     3
+#define DRFLAC_RICE_TABLE_MAX_CODES     4
+
+static drflac_uint64 drflac__gRiceTables[DRFLAC_RICE_TABLE_MAX_PARAM + 1][1 << DRFLAC_RICE_TABLE_BITS];
+
+// Decoders can be opened from several threads at once, so the tables are built by whichever gets to move the state from
+// 0 to 1 and the others wait for 2, which is stored with release semantics once the tables are complete.
+#define DRFLAC_RICE_TABLES_UNBUILT      0
+#define DRFLAC_RICE_TABLES_BUILDING     1
+#define DRFLAC_RICE_TABLES_BUILT        2
+static volatile drflac_int32 drflac__gRiceTablesState = DRFLAC_RICE_TABLES_UNBUILT;
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define drflac__rice_tables_state_load()                (drflac_int32)_InterlockedCompareExchange((volatile long*)&drflac__gRiceTablesState, 0, 0)
+#define drflac__rice_tables_state_claim()               (_InterlockedCompareExchange((volatile long*)&drflac__gRiceTablesState, DRFLAC_RICE_TABLES_BUILDING, DRFLAC_RICE_TABLES_UNBUILT) == DRFLAC_RICE_TABLES_UNBUILT)
+#define drflac__rice_tables_state_store(state)          _InterlockedExchange((volatile long*)&drflac__gRiceTablesState, (state))
+#elif defined(__GNUC__) || defined(__clang__)
+#define drflac__rice_tables_state_load()                __atomic_load_n(&drflac__gRiceTablesState, __ATOMIC_ACQUIRE)
+#define drflac__rice_tables_state_claim()               __sync_bool_compare_and_swap(&drflac__gRiceTablesState, DRFLAC_RICE_TABLES_UNBUILT, DRFLAC_RICE_TABLES_BUILDING)
+#define drflac__rice_tables_state_store(state)          __atomic_store_n(&drflac__gRiceTablesState, (state), __ATOMIC_RELEASE)
+#else
+// No atomics known for this compiler. Open the first decoder before starting any others.
+#define drflac__rice_tables_state_load()                drflac__gRiceTablesState
+#define drflac__rice_tables_state_claim()               (drflac__gRiceTablesState == DRFLAC_RICE_TABLES_UNBUILT ? (drflac__gRiceTablesState = DRFLAC_RICE_TABLES_BUILDING, 1) : 0)
+#define drflac__rice_tables_state_store(state)          (drflac__gRiceTablesState = (state))
+#endif
+
+static void drflac__init_rice_tables()
+{
+    if (drflac__rice_tables_state_load() == DRFLAC_RICE_TABLES_BUILT) {
+        return;
+    }
+    if (!drflac__rice_tables_state_claim()) {
+        // Another thread is building them, which takes a few microseconds.
+        while (drflac__rice_tables_state_load() != DRFLAC_RICE_TABLES_BUILT) {
+        }
+        return;
+    }
+
+    for (drflac_uint32 riceParam = 0; riceParam <= DRFLAC_RICE_TABLE_MAX_PARAM; ++riceParam) {
+        for (drflac_uint32 index = 0; index < (1 << DRFLAC_RICE_TABLE_BITS); ++index) {
+            drflac_uint64 entry = 0;
+            drflac_uint32 bitsUsed = 0;
+            drflac_uint32 codeCount = 0;
+            while (codeCount < DRFLAC_RICE_TABLE_MAX_CODES) {
+                drflac_uint32 zeroCount = 0;
+                while (bitsUsed + zeroCount < DRFLAC_RICE_TABLE_BITS && ((index >> (DRFLAC_RICE_TABLE_BITS - 1 - bitsUsed - zeroCount)) & 1) == 0) {
+                    zeroCount += 1;
+                }
+
+                drflac_uint32 codeLength = zeroCount + 1 + riceParam;
+                if (bitsUsed + codeLength > DRFLAC_RICE_TABLE_BITS) {
+                    break;
+                }
+
+                drflac_uint32 riceParamPart = (index >> (DRFLAC_RICE_TABLE_BITS - bitsUsed - codeLength)) & ((1 << riceParam) - 1);
+                drflac_uint32 decoded = (zeroCount << riceParam) | riceParamPart;
+                drflac_int32 residual = (drflac_int32)((decoded >> 1) ^ (~(decoded & 0x01) + 1));
+
+                entry |= (drflac_uint64)(residual & 0xFFF) << (16 + 12*codeCount);
+                bitsUsed  += codeLength;
+                codeCount += 1;
+            }
+
+            drflac__gRiceTables[riceParam][index] = entry | (codeCount << 4) | bitsUsed;
+        }
+    }
+
+    drflac__rice_tables_state_store(DRFLAC_RICE_TABLES_BUILT);
+}
+
+// Takes the next Rice code with clz when it lies entirely within the L1 cache. The cache is passed in by the caller's locals.
+static DRFLAC_INLINE drflac_bool32 drflac__decode_rice__clz(drflac_cache_t* pCache, drflac_uint32* pBitsRemaining, drflac_uint8 riceParam, drflac_int32* pResidualOut)
+{
+    // With an empty cache the "| 1" makes the code longer than what remains, which is what sends it to the slow path.
+    drflac_uint32 zeroCount = drflac__clz(*pCache | 1);
+    drflac_uint32 codeLength = zeroCount + 1 + riceParam;
+    if (codeLength >= *pBitsRemaining) {
+        return DRFLAC_FALSE;
+    }
+
+    // The top <codeLength> bits are the terminating 1 followed by the Rice parameter part.
+    drflac_uint32 riceParamPart = (drflac_uint32)(*pCache >> (sizeof(drflac_cache_t)*8 - codeLength)) ^ ((drflac_uint32)1 << riceParam);
+    drflac_uint32 decoded = (zeroCount << riceParam) | riceParamPart;
+    *pResidualOut = (drflac_int32)((decoded >> 1) ^ (~(decoded & 0x01) + 1));
+
+    *pCache <<= codeLength;
+    *pBitsRemaining -= codeLength;
+    return DRFLAC_TRUE;
+}
+
+// Decodes <count> Rice codes. The bit cache is worked on from locals so it stays in registers while the residual is stored,
+// and is written back whenever a code runs into the next cache line or is too long for the fast paths, in which case
+// drflac__read_rice_parts() takes that one code.
+static drflac_bool32 drflac__decode_residual__rice(drflac_bs* bs, drflac_uint32 count, drflac_uint8 riceParam, drflac_int32* pResidualOut)
 {
     drflac_assert(bs != NULL);
     drflac_assert(count > 0);
-    drflac_assert(pSamplesOut != NULL);
+    drflac_assert(pResidualOut != NULL);
 
-    drflac_uint32 zeroCountPart;
-    drflac_uint32 riceParamPart;
+    const drflac_uint64* pTable = (riceParam <= DRFLAC_RICE_TABLE_MAX_PARAM) ? drflac__gRiceTables[riceParam] : NULL;
 
     drflac_uint32 i = 0;
-    while (i < count) {
-        // Rice extraction.
-        if (!drflac__read_rice_parts(bs, riceParam, &zeroCountPart, &riceParamPart)) {
-            return DRFLAC_FALSE;
-        }
-
-        // Rice reconstruction.
-        static drflac_uint32 t[2] = {0x00000000, 0xFFFFFFFF};
+    for (;;) {
+        drflac_cache_t cache = bs->cache;
+        drflac_uint32 bitsRemaining = (drflac_uint32)DRFLAC_CACHE_L1_BITS_REMAINING(bs);
+
+        if (pTable != NULL) {
+            for (;;) {
+                // All 4 slots are written so the store does not depend on the code count. The ones past it get overwritten.
+                while (i + DRFLAC_RICE_TABLE_MAX_CODES <= count) {
+                    drflac_uint64 entry = pTable[cache >> (DRFLAC_CACHE_L1_SIZE_BITS(bs) - DRFLAC_RICE_TABLE_BITS)];
+                    drflac_uint32 bitsUsed = (drflac_uint32)(entry & 0x0F);
+                    if (bitsUsed == 0 || bitsUsed > bitsRemaining) {
+                        break;
+                    }
 
-        riceParamPart |= (zeroCountPart << riceParam);
-        riceParamPart  = (riceParamPart >> 1) ^ t[riceParamPart & 0x01];
-        //riceParamPart  = (riceParamPart >> 1) ^ (~(riceParamPart & 0x01) + 1);
+                    pResidualOut[i+0] = (drflac_int32)((drflac_int64)(entry << 36) >> 52);
+                    pResidualOut[i+1] = (drflac_int32)((drflac_int64)(entry << 24) >> 52);
+                    pResidualOut[i+2] = (drflac_int32)((drflac_int64)(entry << 12) >> 52);
+                    pResidualOut[i+3] = (drflac_int32)((drflac_int64)(entry      ) >> 52);
+                    i += (drflac_uint32)(entry >> 4) & 0x07;
+                    cache <<= bitsUsed;
+                    bitsRemaining -= bitsUsed;
+                }
 
-        // Sample reconstruction.
-        if (bitsPerSample > 16) {
-            pSamplesOut[i] = riceParamPart + drflac__calculate_prediction_64(order, shift, coefficients, pSamplesOut + i);
+                // A code longer than the index, or one of the last few.
+                if (i == count || !drflac__decode_rice__clz(&cache, &bitsRemaining, riceParam, pResidualOut + i)) {
+                    break;
+                }
+                i += 1;
+            }
         } else {
-            pSamplesOut[i] = riceParamPart + drflac__calculate_prediction_32(order, shift, coefficients, pSamplesOut + i);
+            while (i < count && drflac__decode_rice__clz(&cache, &bitsRemaining, riceParam, pResidualOut + i)) {
+                i += 1;
+            }
+        }
+
+        bs->cache = cache;
+        bs->consumedBits = (drflac_uint32)DRFLAC_CACHE_L1_SIZE_BITS(bs) - bitsRemaining;
+        if (i == count) {
+            return DRFLAC_TRUE;
+        }
+
+        drflac_uint32 zeroCountPart;
+        drflac_uint32 riceParamPart;
+        if (!drflac__read_rice_parts(bs, riceParam, &zeroCountPart, &riceParamPart)) {
+            return DRFLAC_FALSE;
         }
 
+        riceParamPart |= (zeroCountPart << riceParam);
+        pResidualOut[i] = (drflac_int32)((riceParamPart >> 1) ^ (~(riceParamPart & 0x01) + 1));
         i += 1;
+        if (i == count) {
+            return DRFLAC_TRUE;
+        }
     }
-
-    return DRFLAC_TRUE;
 }
 
+// With <coefficients> set to NULL only the residual is decoded.
 static drflac_bool32 drflac__decode_samples_with_residual__rice(drflac_bs* bs, drflac_uint32 bitsPerSample, drflac_uint32 count, drflac_uint8 riceParam, drflac_uint32 order, drflac_int32 shift, const drflac_int32* coefficients, drflac_int32* pSamplesOut)
 {
 #if 0
     return drflac__decode_samples_with_residual__rice__reference(bs, bitsPerSample, count, riceParam, order, shift, coefficients, pSamplesOut);
 #else
-    return drflac__decode_samples_with_residual__rice__simple(bs, bitsPerSample, count, riceParam, order, shift, coefficients, pSamplesOut);
+    if (!drflac__decode_residual__rice(bs, count, riceParam, pSamplesOut)) {
+        return DRFLAC_FALSE;
+    }
+
+    if (coefficients == NULL) {
+        return DRFLAC_TRUE;
+    }
+
+    // The residual is in place, so the prediction can be added in a tight loop of its own.
+    if (bitsPerSample > 16) {
+        for (drflac_uint32 i = 0; i < count; ++i) {
+            pSamplesOut[i] += drflac__calculate_prediction_64(order, shift, coefficients, pSamplesOut + i);
+        }
+    } else {
+        for (drflac_uint32 i = 0; i < count; ++i) {
+            pSamplesOut[i] += drflac__calculate_prediction_32(order, shift, coefficients, pSamplesOut + i);
+        }
+    }
+
+    return DRFLAC_TRUE;
 #endif
 }
 
@@ -2357,14 +2863,20 @@ static drflac_bool32 drflac__decode_samples_with_residual__unencoded(drflac_bs*
 {
     drflac_assert(bs != NULL);
     drflac_assert(count > 0);
-    drflac_assert(unencodedBitsPerSample > 0 && unencodedBitsPerSample <= 32);
+    drflac_assert(unencodedBitsPerSample <= 32);
     drflac_assert(pSamplesOut != NULL);
 
     for (unsigned int i = 0; i < count; ++i) {
-        if (!drflac__read_int32(bs, unencodedBitsPerSample, pSamplesOut + i)) {
+        if (unencodedBitsPerSample == 0) {
+            pSamplesOut[i] = 0;
+        } else if (!drflac__read_int32(bs, unencodedBitsPerSample, pSamplesOut + i)) {
             return DRFLAC_FALSE;
         }
 
+        if (coefficients == NULL) {
+            continue;   // Residual only, see drflac__decode_samples_with_residual__rice().
+        }
+
         if (bitsPerSample > 16) {
             pSamplesOut[i] += drflac__calculate_prediction_64(order, shift, coefficients, pSamplesOut + i);
         } else {
@@ -2422,14 +2934,14 @@ static drflac_bool32 drflac__decode_samples_with_residual(drflac_bs* bs, drflac_
             if (!drflac__read_uint8(bs, 4, &riceParam)) {
                 return DRFLAC_FALSE;
             }
-            if (riceParam == 16) {
+            if (riceParam == 15) {
                 riceParam = 0xFF;
             }
         } else if (residualMethod == DRFLAC_RESIDUAL_CODING_METHOD_PARTITIONED_RICE2) {
             if (!drflac__read_uint8(bs, 5, &riceParam)) {
                 return DRFLAC_FALSE;
             }
-            if (riceParam == 32) {
+            if (riceParam == 31) {
                 riceParam = 0xFF;
             }
         }
@@ -2497,14 +3009,14 @@ static drflac_bool32 drflac__read_and_seek_residual(drflac_bs* bs, drflac_uint32
             if (!drflac__read_uint8(bs, 4, &riceParam)) {
                 return DRFLAC_FALSE;
             }
-            if (riceParam == 16) {
+            if (riceParam == 15) {
                 riceParam = 0xFF;
             }
         } else if (residualMethod == DRFLAC_RESIDUAL_CODING_METHOD_PARTITIONED_RICE2) {
             if (!drflac__read_uint8(bs, 5, &riceParam)) {
                 return DRFLAC_FALSE;
             }
-            if (riceParam == 32) {
+            if (riceParam == 31) {
                 riceParam = 0xFF;
             }
         }
@@ -2633,6 +3145,15 @@ static drflac_bool32 drflac__decode_samples__lpc(drflac_bs* bs, drflac_uint32 bl
         }
     }
 
+    if (drflac__can_restore_lpc__simd(lpcOrder, lpcShift)) {
+        if (!drflac__decode_samples_with_residual(bs, bitsPerSample, blockSize, lpcOrder, lpcShift, NULL, pDecodedSamples)) {
+            return DRFLAC_FALSE;
+        }
+
+        drflac__restore_lpc__simd(bitsPerSample, blockSize, lpcOrder, lpcShift, coefficients, pDecodedSamples);
+        return DRFLAC_TRUE;
+    }
+
     if (!drflac__decode_samples_with_residual(bs, bitsPerSample, blockSize, lpcOrder, lpcShift, coefficients, pDecodedSamples)) {
         return DRFLAC_FALSE;
     }
@@ -4571,6 +5092,7 @@ drflac* drflac_open_with_metadata_private(drflac_read_proc onRead, drflac_seek_p
     // CPU support first.
     drflac__init_cpu_caps();
 #endif
+    drflac__init_rice_tables();
 
     drflac_init_info init;
     if (!drflac__init_private(&init, onRead, onSeek, onMeta, container, pUserData, pUserDataMD)) {
@@ -4637,6 +5159,9 @@ drflac* drflac_open_with_metadata_private(drflac_read_proc onRead, drflac_seek_p
             DRFLAC_FREE(pFlac);
             return NULL;
         }
+    } else if (init.container == drflac_container_native && init.hasStreamInfoBlock) {
+        // STREAMINFO was the only block, so the first frame directly follows it. Without this seeking is disabled.
+        pFlac->firstFramePos = 42;
     }
 
     // If we get here, but don't have a STREAMINFO block, it means we've opened the stream in relaxed mode and need to decode
@@ -5031,17 +5556,244 @@ drflac_uint64 drflac__seek_forward_by_samples(drflac* pFlac, drflac_uint64 sampl
     return samplesRead;
 }
 
-drflac_uint64 drflac_read_s32(drflac* pFlac, drflac_uint64 samplesToRead, drflac_int32* bufferOut)
+// Output formats of drflac__read_pcm().
+#define DRFLAC_PCM_S32  0
+#define DRFLAC_PCM_S16  1
+#define DRFLAC_PCM_F32  2
+
+static DRFLAC_INLINE void drflac__store_pcm(drflac_int32 sample, drflac_uint32 format, void* pBufferOut, drflac_uint64 index)
+{
+    if (format == DRFLAC_PCM_S16) {
+        ((drflac_int16*)pBufferOut)[index] = (drflac_int16)(sample >> 16);
+    } else if (format == DRFLAC_PCM_F32) {
+        ((float*)pBufferOut)[index] = (float)(sample / 2147483648.0);
+    } else {
+        ((drflac_int32*)pBufferOut)[index] = sample;
+    }
+}
+
+static DRFLAC_INLINE drflac_uint32 drflac__get_pcm_sample_size(drflac_uint32 format)
 {
-    // Note that <bufferOut> is allowed to be null, in which case this will be treated as something like a seek.
+    return (format == DRFLAC_PCM_S16) ? 2 : 4;
+}
+
+// Stereo frames are decorrelated, shifted to the top of 32 bits, converted and interleaved in a single pass over the two
+// planar subframes, straight into the caller's buffer. <shift0> and <shift1> move each channel to the top of 32 bits.
+static void drflac__interleave_stereo__scalar(drflac_uint8 channelAssignment, const drflac_int32* pDecodedSamples0, const drflac_int32* pDecodedSamples1, drflac_uint32 shift0, drflac_uint32 shift1, drflac_uint64 count, drflac_uint32 format, void* pBufferOut)
+{
+    for (drflac_uint64 i = 0; i < count; ++i) {
+        int left;
+        int right;
+        switch (channelAssignment)
+        {
+            case DRFLAC_CHANNEL_ASSIGNMENT_LEFT_SIDE:
+            {
+                left  = pDecodedSamples0[i];
+                right = left - pDecodedSamples1[i];
+            } break;
+
+            case DRFLAC_CHANNEL_ASSIGNMENT_RIGHT_SIDE:
+            {
+                right = pDecodedSamples1[i];
+                left  = right + pDecodedSamples0[i];
+            } break;
+
+            case DRFLAC_CHANNEL_ASSIGNMENT_MID_SIDE:
+            {
+                int side = pDecodedSamples1[i];
+                int mid  = (((drflac_uint32)pDecodedSamples0[i]) << 1) | (side & 0x01);
+                left  = (mid + side) >> 1;
+                right = (mid - side) >> 1;
+            } break;
+
+            default:
+            {
+                left  = pDecodedSamples0[i];
+                right = pDecodedSamples1[i];
+            } break;
+        }
+
+        drflac__store_pcm(left  << shift0, format, pBufferOut, i*2+0);
+        drflac__store_pcm(right << shift1, format, pBufferOut, i*2+1);
+    }
+}
+
+#ifdef DRFLAC_SUPPORT_SSE41
+// Only needs SSE2, but shares the SSE4.1 gate so it comes with the same run time check.
+DRFLAC_TARGET_SSE41
+static DRFLAC_INLINE void drflac__decorrelate_4__sse(drflac_uint8 channelAssignment, __m128i s0, __m128i s1, __m128i* pLeft, __m128i* pRight)
+{
+    switch (channelAssignment)
+    {
+        case DRFLAC_CHANNEL_ASSIGNMENT_LEFT_SIDE:
+        {
+            *pLeft  = s0;
+            *pRight = _mm_sub_epi32(s0, s1);
+        } break;
+
+        case DRFLAC_CHANNEL_ASSIGNMENT_RIGHT_SIDE:
+        {
+            *pLeft  = _mm_add_epi32(s1, s0);
+            *pRight = s1;
+        } break;
+
+        case DRFLAC_CHANNEL_ASSIGNMENT_MID_SIDE:
+        {
+            __m128i mid = _mm_or_si128(_mm_slli_epi32(s0, 1), _mm_and_si128(s1, _mm_set1_epi32(0x01)));
+            *pLeft  = _mm_srai_epi32(_mm_add_epi32(mid, s1), 1);
+            *pRight = _mm_srai_epi32(_mm_sub_epi32(mid, s1), 1);
+        } break;
+
+        default:
+        {
+            *pLeft  = s0;
+            *pRight = s1;
+        } break;
+    }
+}
+
+DRFLAC_TARGET_SSE41
+static drflac_uint64 drflac__interleave_stereo__sse41(drflac_uint8 channelAssignment, const drflac_int32* pDecodedSamples0, const drflac_int32* pDecodedSamples1, drflac_uint32 shift0, drflac_uint32 shift1, drflac_uint64 count, drflac_uint32 format, void* pBufferOut)
+{
+    const __m128i sh0 = _mm_cvtsi32_si128((int)shift0);
+    const __m128i sh1 = _mm_cvtsi32_si128((int)shift1);
+    const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+
+    drflac_uint64 i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i left;
+        __m128i right;
+        drflac__decorrelate_4__sse(channelAssignment, _mm_loadu_si128((const __m128i*)(pDecodedSamples0 + i)), _mm_loadu_si128((const __m128i*)(pDecodedSamples1 + i)), &left, &right);
+        left  = _mm_sll_epi32(left,  sh0);
+        right = _mm_sll_epi32(right, sh1);
+
+        if (format == DRFLAC_PCM_S16) {
+            // The values fit after the shift, so the saturation of the pack never kicks in.
+            __m128i lo = _mm_unpacklo_epi32(_mm_srai_epi32(left, 16), _mm_srai_epi32(right, 16));
+            __m128i hi = _mm_unpackhi_epi32(_mm_srai_epi32(left, 16), _mm_srai_epi32(right, 16));
+            _mm_storeu_si128((__m128i*)((drflac_int16*)pBufferOut + i*2), _mm_packs_epi32(lo, hi));
+        } else if (format == DRFLAC_PCM_F32) {
+            __m128 l = _mm_mul_ps(_mm_cvtepi32_ps(left),  scale);
+            __m128 r = _mm_mul_ps(_mm_cvtepi32_ps(right), scale);
+            _mm_storeu_ps((float*)pBufferOut + i*2 + 0, _mm_unpacklo_ps(l, r));
+            _mm_storeu_ps((float*)pBufferOut + i*2 + 4, _mm_unpackhi_ps(l, r));
+        } else {
+            _mm_storeu_si128((__m128i*)((drflac_int32*)pBufferOut + i*2 + 0), _mm_unpacklo_epi32(left, right));
+            _mm_storeu_si128((__m128i*)((drflac_int32*)pBufferOut + i*2 + 4), _mm_unpackhi_epi32(left, right));
+        }
+    }
+
+    return i;
+}
+#endif
+
+#ifdef DRFLAC_SUPPORT_AVX2
+DRFLAC_TARGET_AVX2
+static DRFLAC_INLINE void drflac__decorrelate_8__avx2(drflac_uint8 channelAssignment, __m256i s0, __m256i s1, __m256i* pLeft, __m256i* pRight)
+{
+    switch (channelAssignment)
+    {
+        case DRFLAC_CHANNEL_ASSIGNMENT_LEFT_SIDE:
+        {
+            *pLeft  = s0;
+            *pRight = _mm256_sub_epi32(s0, s1);
+        } break;
+
+        case DRFLAC_CHANNEL_ASSIGNMENT_RIGHT_SIDE:
+        {
+            *pLeft  = _mm256_add_epi32(s1, s0);
+            *pRight = s1;
+        } break;
+
+        case DRFLAC_CHANNEL_ASSIGNMENT_MID_SIDE:
+        {
+            __m256i mid = _mm256_or_si256(_mm256_slli_epi32(s0, 1), _mm256_and_si256(s1, _mm256_set1_epi32(0x01)));
+            *pLeft  = _mm256_srai_epi32(_mm256_add_epi32(mid, s1), 1);
+            *pRight = _mm256_srai_epi32(_mm256_sub_epi32(mid, s1), 1);
+        } break;
+
+        default:
+        {
+            *pLeft  = s0;
+            *pRight = s1;
+        } break;
+    }
+}
+
+// The unpacks work within each 128-bit lane, so the two halves are put back in order with a permute before storing.
+DRFLAC_TARGET_AVX2
+static drflac_uint64 drflac__interleave_stereo__avx2(drflac_uint8 channelAssignment, const drflac_int32* pDecodedSamples0, const drflac_int32* pDecodedSamples1, drflac_uint32 shift0, drflac_uint32 shift1, drflac_uint64 count, drflac_uint32 format, void* pBufferOut)
+{
+    const __m128i sh0 = _mm_cvtsi32_si128((int)shift0);
+    const __m128i sh1 = _mm_cvtsi32_si128((int)shift1);
+    const __m256 scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+
+    drflac_uint64 i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i left;
+        __m256i right;
+        drflac__decorrelate_8__avx2(channelAssignment, _mm256_loadu_si256((const __m256i*)(pDecodedSamples0 + i)), _mm256_loadu_si256((const __m256i*)(pDecodedSamples1 + i)), &left, &right);
+        left  = _mm256_sll_epi32(left,  sh0);
+        right = _mm256_sll_epi32(right, sh1);
+
+        if (format == DRFLAC_PCM_S16) {
+            __m256i lo = _mm256_unpacklo_epi32(_mm256_srai_epi32(left, 16), _mm256_srai_epi32(right, 16));
+            __m256i hi = _mm256_unpackhi_epi32(_mm256_srai_epi32(left, 16), _mm256_srai_epi32(right, 16));
+            _mm256_storeu_si256((__m256i*)((drflac_int16*)pBufferOut + i*2), _mm256_packs_epi32(lo, hi));   // Packs per lane, which undoes the unpack order.
+        } else if (format == DRFLAC_PCM_F32) {
+            __m256 l  = _mm256_mul_ps(_mm256_cvtepi32_ps(left),  scale);
+            __m256 r  = _mm256_mul_ps(_mm256_cvtepi32_ps(right), scale);
+            __m256 lo = _mm256_unpacklo_ps(l, r);
+            __m256 hi = _mm256_unpackhi_ps(l, r);
+            _mm256_storeu_ps((float*)pBufferOut + i*2 + 0, _mm256_permute2f128_ps(lo, hi, 0x20));
+            _mm256_storeu_ps((float*)pBufferOut + i*2 + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+        } else {
+            __m256i lo = _mm256_unpacklo_epi32(left, right);
+            __m256i hi = _mm256_unpackhi_epi32(left, right);
+            _mm256_storeu_si256((__m256i*)((drflac_int32*)pBufferOut + i*2 + 0), _mm256_permute2x128_si256(lo, hi, 0x20));
+            _mm256_storeu_si256((__m256i*)((drflac_int32*)pBufferOut + i*2 + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+        }
+    }
+
+    return i;
+}
+#endif
+
+static void drflac__interleave_stereo(drflac_uint8 channelAssignment, const drflac_int32* pDecodedSamples0, const drflac_int32* pDecodedSamples1, drflac_uint32 shift0, drflac_uint32 shift1, drflac_uint64 count, drflac_uint32 format, void* pBufferOut)
+{
+    drflac_uint64 done = 0;
+#ifdef DRFLAC_SUPPORT_AVX2
+    if (drflac__gIsAVX2Supported) {
+        done = drflac__interleave_stereo__avx2(channelAssignment, pDecodedSamples0, pDecodedSamples1, shift0, shift1, count, format, pBufferOut);
+    } else
+#endif
+#ifdef DRFLAC_SUPPORT_SSE41
+    if (drflac__gIsSSE41Supported) {
+        done = drflac__interleave_stereo__sse41(channelAssignment, pDecodedSamples0, pDecodedSamples1, shift0, shift1, count, format, pBufferOut);
+    }
+#endif
+
+    if (done < count) {
+        pBufferOut = (char*)pBufferOut + done*2*drflac__get_pcm_sample_size(format);
+        drflac__interleave_stereo__scalar(channelAssignment, pDecodedSamples0 + done, pDecodedSamples1 + done, shift0, shift1, count - done, format, pBufferOut);
+    }
+}
+
+// Reads interleaved samples in the given output format. Whole frames come straight from the subframes, the partial frames at
+// either end go through drflac__read_s32__misaligned().
+static drflac_uint64 drflac__read_pcm(drflac* pFlac, drflac_uint64 samplesToRead, drflac_uint32 format, void* pBufferOut)
+{
+    // Note that <pBufferOut> is allowed to be null, in which case this will be treated as something like a seek.
     if (pFlac == NULL || samplesToRead == 0) {
         return 0;
     }
 
-    if (bufferOut == NULL) {
+    if (pBufferOut == NULL) {
         return drflac__seek_forward_by_samples(pFlac, samplesToRead);
     }
 
+    drflac_uint32 sampleSize = drflac__get_pcm_sample_size(format);
+    drflac_int32 misaligned[8];
 
     drflac_uint64 samplesRead = 0;
     while (samplesToRead > 0) {
@@ -5057,12 +5809,19 @@ drflac_uint64 drflac_read_s32(drflac* pFlac, drflac_uint64 samplesToRead, drflac
             drflac_uint64 totalSamplesInFrame = pFlac->currentFrame.header.blockSize * channelCount;
             drflac_uint64 samplesReadFromFrameSoFar = totalSamplesInFrame - pFlac->currentFrame.samplesRemaining;
 
-            drflac_uint64 misalignedSampleCount = samplesReadFromFrameSoFar % channelCount;
+            // Finish the frame a previous read stopped in the middle of.
+            drflac_uint64 misalignedSampleCount = (channelCount - (samplesReadFromFrameSoFar % channelCount)) % channelCount;
+            if (misalignedSampleCount > samplesToRead) {
+                misalignedSampleCount = samplesToRead;
+            }
             if (misalignedSampleCount > 0) {
-                drflac_uint64 misalignedSamplesRead = drflac__read_s32__misaligned(pFlac, misalignedSampleCount, bufferOut);
+                drflac_uint64 misalignedSamplesRead = drflac__read_s32__misaligned(pFlac, misalignedSampleCount, misaligned);
+                for (drflac_uint64 i = 0; i < misalignedSamplesRead; ++i) {
+                    drflac__store_pcm(misaligned[i], format, pBufferOut, i);
+                }
                 samplesRead   += misalignedSamplesRead;
                 samplesReadFromFrameSoFar += misalignedSamplesRead;
-                bufferOut     += misalignedSamplesRead;
+                pBufferOut     = (char*)pBufferOut + misalignedSamplesRead*sampleSize;
                 samplesToRead -= misalignedSamplesRead;
             }
 
@@ -5075,82 +5834,26 @@ drflac_uint64 drflac_read_s32(drflac* pFlac, drflac_uint64 samplesToRead, drflac
             drflac_uint64 firstAlignedSampleInFrame = samplesReadFromFrameSoFar / channelCount;
             unsigned int unusedBitsPerSample = 32 - pFlac->bitsPerSample;
 
-            switch (pFlac->currentFrame.header.channelAssignment)
-            {
-                case DRFLAC_CHANNEL_ASSIGNMENT_LEFT_SIDE:
-                {
-                    const drflac_int32* pDecodedSamples0 = pFlac->currentFrame.subframes[0].pDecodedSamples + firstAlignedSampleInFrame;
-                    const drflac_int32* pDecodedSamples1 = pFlac->currentFrame.subframes[1].pDecodedSamples + firstAlignedSampleInFrame;
-
-                    for (drflac_uint64 i = 0; i < alignedSampleCountPerChannel; ++i) {
-                        int left  = pDecodedSamples0[i];
-                        int side  = pDecodedSamples1[i];
-                        int right = left - side;
-
-                        bufferOut[i*2+0] = left  << (unusedBitsPerSample + pFlac->currentFrame.subframes[0].wastedBitsPerSample);
-                        bufferOut[i*2+1] = right << (unusedBitsPerSample + pFlac->currentFrame.subframes[1].wastedBitsPerSample);
-                    }
-                } break;
-
-                case DRFLAC_CHANNEL_ASSIGNMENT_RIGHT_SIDE:
-                {
-                    const drflac_int32* pDecodedSamples0 = pFlac->currentFrame.subframes[0].pDecodedSamples + firstAlignedSampleInFrame;
-                    const drflac_int32* pDecodedSamples1 = pFlac->currentFrame.subframes[1].pDecodedSamples + firstAlignedSampleInFrame;
-
-                    for (drflac_uint64 i = 0; i < alignedSampleCountPerChannel; ++i) {
-                        int side  = pDecodedSamples0[i];
-                        int right = pDecodedSamples1[i];
-                        int left  = right + side;
-
-                        bufferOut[i*2+0] = left  << (unusedBitsPerSample + pFlac->currentFrame.subframes[0].wastedBitsPerSample);
-                        bufferOut[i*2+1] = right << (unusedBitsPerSample + pFlac->currentFrame.subframes[1].wastedBitsPerSample);
-                    }
-                } break;
-
-                case DRFLAC_CHANNEL_ASSIGNMENT_MID_SIDE:
-                {
-                    const drflac_int32* pDecodedSamples0 = pFlac->currentFrame.subframes[0].pDecodedSamples + firstAlignedSampleInFrame;
-                    const drflac_int32* pDecodedSamples1 = pFlac->currentFrame.subframes[1].pDecodedSamples + firstAlignedSampleInFrame;
-
-                    for (drflac_uint64 i = 0; i < alignedSampleCountPerChannel; ++i) {
-                        int side = pDecodedSamples1[i];
-                        int mid  = (((drflac_uint32)pDecodedSamples0[i]) << 1) | (side & 0x01);
-
-                        bufferOut[i*2+0] = ((mid + side) >> 1) << (unusedBitsPerSample + pFlac->currentFrame.subframes[0].wastedBitsPerSample);
-                        bufferOut[i*2+1] = ((mid - side) >> 1) << (unusedBitsPerSample + pFlac->currentFrame.subframes[1].wastedBitsPerSample);
-                    }
-                } break;
-
-                case DRFLAC_CHANNEL_ASSIGNMENT_INDEPENDENT:
-                default:
-                {
-                    if (pFlac->currentFrame.header.channelAssignment == 1) // 1 = Stereo
-                    {
-                        // Stereo optimized inner loop unroll.
-                        const drflac_int32* pDecodedSamples0 = pFlac->currentFrame.subframes[0].pDecodedSamples + firstAlignedSampleInFrame;
-                        const drflac_int32* pDecodedSamples1 = pFlac->currentFrame.subframes[1].pDecodedSamples + firstAlignedSampleInFrame;
-
-                        for (drflac_uint64 i = 0; i < alignedSampleCountPerChannel; ++i) {
-                            bufferOut[i*2+0] = pDecodedSamples0[i] << (unusedBitsPerSample + pFlac->currentFrame.subframes[0].wastedBitsPerSample);
-                            bufferOut[i*2+1] = pDecodedSamples1[i] << (unusedBitsPerSample + pFlac->currentFrame.subframes[1].wastedBitsPerSample);
-                        }
-                    }
-                    else
-                    {
-                        // Generic interleaving.
-                        for (drflac_uint64 i = 0; i < alignedSampleCountPerChannel; ++i) {
-                            for (unsigned int j = 0; j < channelCount; ++j) {
-                                bufferOut[(i*channelCount)+j] = (pFlac->currentFrame.subframes[j].pDecodedSamples[firstAlignedSampleInFrame + i]) << (unusedBitsPerSample + pFlac->currentFrame.subframes[j].wastedBitsPerSample);
-                            }
-                        }
+            if (channelCount == 2) {
+                drflac__interleave_stereo(pFlac->currentFrame.header.channelAssignment,
+                    pFlac->currentFrame.subframes[0].pDecodedSamples + firstAlignedSampleInFrame,
+                    pFlac->currentFrame.subframes[1].pDecodedSamples + firstAlignedSampleInFrame,
+                    unusedBitsPerSample + pFlac->currentFrame.subframes[0].wastedBitsPerSample,
+                    unusedBitsPerSample + pFlac->currentFrame.subframes[1].wastedBitsPerSample,
+                    alignedSampleCountPerChannel, format, pBufferOut);
+            } else {
+                // Generic interleaving.
+                for (drflac_uint64 i = 0; i < alignedSampleCountPerChannel; ++i) {
+                    for (unsigned int j = 0; j < channelCount; ++j) {
+                        drflac__store_pcm((pFlac->currentFrame.subframes[j].pDecodedSamples[firstAlignedSampleInFrame + i]) << (unusedBitsPerSample + pFlac->currentFrame.subframes[j].wastedBitsPerSample), format, pBufferOut, (i*channelCount)+j);
                     }
-                } break;
+                }
             }
 
             drflac_uint64 alignedSamplesRead = alignedSampleCountPerChannel * channelCount;
             samplesRead   += alignedSamplesRead;
             samplesReadFromFrameSoFar += alignedSamplesRead;
-            bufferOut     += alignedSamplesRead;
+            pBufferOut     = (char*)pBufferOut + alignedSamplesRead*sampleSize;
             samplesToRead -= alignedSamplesRead;
             pFlac->currentFrame.samplesRemaining -= (unsigned int)alignedSamplesRead;
 
@@ -5160,14 +5863,17 @@ drflac_uint64 drflac_read_s32(drflac* pFlac, drflac_uint64 samplesToRead, drflac
             if (samplesToRead > 0 && pFlac->currentFrame.samplesRemaining > 0) {
                 drflac_uint64 excessSamplesRead = 0;
                 if (samplesToRead < pFlac->currentFrame.samplesRemaining) {
-                    excessSamplesRead = drflac__read_s32__misaligned(pFlac, samplesToRead, bufferOut);
+                    excessSamplesRead = drflac__read_s32__misaligned(pFlac, samplesToRead, misaligned);
                 } else {
-                    excessSamplesRead = drflac__read_s32__misaligned(pFlac, pFlac->currentFrame.samplesRemaining, bufferOut);
+                    excessSamplesRead = drflac__read_s32__misaligned(pFlac, pFlac->currentFrame.samplesRemaining, misaligned);
+                }
+                for (drflac_uint64 i = 0; i < excessSamplesRead; ++i) {
+                    drflac__store_pcm(misaligned[i], format, pBufferOut, i);
                 }
 
                 samplesRead   += excessSamplesRead;
                 samplesReadFromFrameSoFar += excessSamplesRead;
-                bufferOut     += excessSamplesRead;
+                pBufferOut     = (char*)pBufferOut + excessSamplesRead*sampleSize;
                 samplesToRead -= excessSamplesRead;
             }
         }
@@ -5176,54 +5882,19 @@ drflac_uint64 drflac_read_s32(drflac* pFlac, drflac_uint64 samplesToRead, drflac
     return samplesRead;
 }
 
-drflac_uint64 drflac_read_s16(drflac* pFlac, drflac_uint64 samplesToRead, drflac_int16* pBufferOut)
+drflac_uint64 drflac_read_s32(drflac* pFlac, drflac_uint64 samplesToRead, drflac_int32* pBufferOut)
 {
-    // This reads samples in 2 passes and can probably be optimized.
-    drflac_uint64 totalSamplesRead = 0;
-
-    while (samplesToRead > 0) {
-        drflac_int32 samples32[4096];
-        drflac_uint64 samplesJustRead = drflac_read_s32(pFlac, (samplesToRead > 4096) ? 4096 : samplesToRead, samples32);
-        if (samplesJustRead == 0) {
-            break;  // Reached the end.
-        }
-
-        // s32 -> s16
-        for (drflac_uint64 i = 0; i < samplesJustRead; ++i) {
-            pBufferOut[i] = (drflac_int16)(samples32[i] >> 16);
-        }
-
-        totalSamplesRead += samplesJustRead;
-        samplesToRead -= samplesJustRead;
-        pBufferOut += samplesJustRead;
-    }
+    return drflac__read_pcm(pFlac, samplesToRead, DRFLAC_PCM_S32, pBufferOut);
+}
 
-    return totalSamplesRead;
+drflac_uint64 drflac_read_s16(drflac* pFlac, drflac_uint64 samplesToRead, drflac_int16* pBufferOut)
+{
+    return drflac__read_pcm(pFlac, samplesToRead, DRFLAC_PCM_S16, pBufferOut);
 }
 
 drflac_uint64 drflac_read_f32(drflac* pFlac, drflac_uint64 samplesToRead, float* pBufferOut)
 {
-    // This reads samples in 2 passes and can probably be optimized.
-    drflac_uint64 totalSamplesRead = 0;
-
-    while (samplesToRead > 0) {
-        drflac_int32 samples32[4096];
-        drflac_uint64 samplesJustRead = drflac_read_s32(pFlac, (samplesToRead > 4096) ? 4096 : samplesToRead, samples32);
-        if (samplesJustRead == 0) {
-            break;  // Reached the end.
-        }
-
-        // s32 -> f32
-        for (drflac_uint64 i = 0; i < samplesJustRead; ++i) {
-            pBufferOut[i] = (float)(samples32[i] / 2147483648.0);
-        }
-
-        totalSamplesRead += samplesJustRead;
-        samplesToRead -= samplesJustRead;
-        pBufferOut += samplesJustRead;
-    }
-
-    return totalSamplesRead;
+    return drflac__read_pcm(pFlac, samplesToRead, DRFLAC_PCM_F32, pBufferOut);
 }
 
 drflac_bool32 drflac_seek_to_sample(drflac* pFlac, drflac_uint64 sampleIndex)
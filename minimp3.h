@@ -34,6 +34,9 @@ extern "C" {
 
 void mp3dec_init(mp3dec_t *dec);
 int mp3dec_decode_frame(mp3dec_t *dec, const unsigned char *mp3, int mp3_bytes, short *pcm, mp3dec_frame_info_t *info);
+/* Same as mp3dec_decode_frame, with samples in [-1, 1) straight from the synthesis filter. */
+int mp3dec_decode_frame_float(mp3dec_t *dec, const unsigned char *mp3, int mp3_bytes, float *pcm, mp3dec_frame_info_t *info);
+void mp3dec_f32_to_s16(const float *in, short *out, int num_samples);
 
 #ifdef __cplusplus
 }
@@ -81,6 +84,9 @@ int mp3dec_decode_frame(mp3dec_t *dec, const unsigned char *mp3, int mp3_bytes,
 
 #define MINIMP3_MIN(a, b)           ((a) > (b) ? (b) : (a))
 #define MINIMP3_MAX(a, b)           ((a) < (b) ? (b) : (a))
+/* Only one of the short/float output pointers is set, step just that one. */
+#define MINIMP3_ADVANCE(p, n)       ((p) ? (p) + (n) : (p))
+#define MINIMP3_FLOAT_SCALE         (1.0f/32768.0f)
 
 #if !defined(MINIMP3_NO_SIMD)
 
@@ -1407,7 +1413,7 @@ static short mp3d_scale_pcm(float sample)
     return (short)s;
 }
 
-static void mp3d_synth_pair(short *pcm, int nch, const float *z)
+static void mp3d_synth_pair(short *pcm, float *fpcm, int nch, const float *z)
 {
     float a;
     a  = (z[14*64] - z[    0]) * 29;
@@ -1418,7 +1424,10 @@ static void mp3d_synth_pair(short *pcm, int nch, const float *z)
     a += (z[ 5*64] + z[ 9*64]) * 6574;
     a += (z[ 8*64] - z[ 6*64]) * 37489;
     a +=  z[ 7*64]             * 75038;
-    pcm[0] = mp3d_scale_pcm(a);
+    if (fpcm)
+        fpcm[0] = a*MINIMP3_FLOAT_SCALE;
+    else
+        pcm[0] = mp3d_scale_pcm(a);
 
     z += 2;
     a  = z[14*64] * 104;
@@ -1429,14 +1438,18 @@ static void mp3d_synth_pair(short *pcm, int nch, const float *z)
     a += z[ 4*64] * -45;
     a += z[ 2*64] * 146;
     a += z[ 0*64] * -5;
-    pcm[16*nch] = mp3d_scale_pcm(a);
+    if (fpcm)
+        fpcm[16*nch] = a*MINIMP3_FLOAT_SCALE;
+    else
+        pcm[16*nch] = mp3d_scale_pcm(a);
 }
 
-static void mp3d_synth(float *xl, short *dstl, int nch, float *lins)
+static void mp3d_synth(float *xl, short *dstl, float *fdstl, int nch, float *lins)
 {
     int i;
     float *xr = xl + 576*(nch - 1);
-    short *dstr = dstl + (nch - 1);
+    short *dstr = MINIMP3_ADVANCE(dstl, nch - 1);
+    float *fdstr = MINIMP3_ADVANCE(fdstl, nch - 1);
 
     static const float g_win[] = {
         -1,26,-31,208,218,401,-519,2063,2000,4788,-5517,7134,5959,35640,-39336,74992,
@@ -1468,10 +1481,10 @@ static void mp3d_synth(float *xl, short *dstl, int nch, float *lins)
     zlin[4*31 + 2] = xl[1];
     zlin[4*31 + 3] = xr[1];
 
-    mp3d_synth_pair(dstr, nch, lins + 4*15 + 1);
-    mp3d_synth_pair(dstr + 32*nch, nch, lins + 4*15 + 64 + 1);
-    mp3d_synth_pair(dstl, nch, lins + 4*15);
-    mp3d_synth_pair(dstl + 32*nch, nch, lins + 4*15 + 64);
+    mp3d_synth_pair(dstr, fdstr, nch, lins + 4*15 + 1);
+    mp3d_synth_pair(MINIMP3_ADVANCE(dstr, 32*nch), MINIMP3_ADVANCE(fdstr, 32*nch), nch, lins + 4*15 + 64 + 1);
+    mp3d_synth_pair(dstl, fdstl, nch, lins + 4*15);
+    mp3d_synth_pair(MINIMP3_ADVANCE(dstl, 32*nch), MINIMP3_ADVANCE(fdstl, 32*nch), nch, lins + 4*15 + 64);
 
 #if HAVE_SIMD
     if (have_simd()) for (i = 14; i >= 0; i--)
@@ -1492,6 +1505,20 @@ static void mp3d_synth(float *xl, short *dstl, int nch, float *lins)
 
         V0(0) V2(1) V1(2) V2(3) V1(4) V2(5) V1(6) V2(7)
 
+        if (fdstl)
+        {
+            float t[8];
+            VSTORE(t, VMUL_S(a, MINIMP3_FLOAT_SCALE));
+            VSTORE(t + 4, VMUL_S(b, MINIMP3_FLOAT_SCALE));
+            fdstr[(15 - i)*nch] = t[1];
+            fdstr[(17 + i)*nch] = t[5];
+            fdstl[(15 - i)*nch] = t[0];
+            fdstl[(17 + i)*nch] = t[4];
+            fdstr[(47 - i)*nch] = t[3];
+            fdstr[(49 + i)*nch] = t[7];
+            fdstl[(47 - i)*nch] = t[2];
+            fdstl[(49 + i)*nch] = t[6];
+        } else
         {
 #if HAVE_SSE
             static const f4 g_max = { 32767.0f, 32767.0f, 32767.0f, 32767.0f };
@@ -1546,6 +1573,18 @@ static void mp3d_synth(float *xl, short *dstl, int nch, float *lins)
 
         S0(0) S2(1) S1(2) S2(3) S1(4) S2(5) S1(6) S2(7)
 
+        if (fdstl)
+        {
+            fdstr[(15 - i)*nch] = a[1]*MINIMP3_FLOAT_SCALE;
+            fdstr[(17 + i)*nch] = b[1]*MINIMP3_FLOAT_SCALE;
+            fdstl[(15 - i)*nch] = a[0]*MINIMP3_FLOAT_SCALE;
+            fdstl[(17 + i)*nch] = b[0]*MINIMP3_FLOAT_SCALE;
+            fdstr[(47 - i)*nch] = a[3]*MINIMP3_FLOAT_SCALE;
+            fdstr[(49 + i)*nch] = b[3]*MINIMP3_FLOAT_SCALE;
+            fdstl[(47 - i)*nch] = a[2]*MINIMP3_FLOAT_SCALE;
+            fdstl[(49 + i)*nch] = b[2]*MINIMP3_FLOAT_SCALE;
+            continue;
+        }
         dstr[(15 - i)*nch] = mp3d_scale_pcm(a[1]);
         dstr[(17 + i)*nch] = mp3d_scale_pcm(b[1]);
         dstl[(15 - i)*nch] = mp3d_scale_pcm(a[0]);
@@ -1558,7 +1597,7 @@ static void mp3d_synth(float *xl, short *dstl, int nch, float *lins)
 #endif
 }
 
-static void mp3d_synth_granule(float *qmf_state, float *grbuf, int nbands, int nch, short *pcm, float *lins)
+static void mp3d_synth_granule(float *qmf_state, float *grbuf, int nbands, int nch, short *pcm, float *fpcm, float *lins)
 {
     int i;
     for (i = 0; i < nch; i++)
@@ -1570,7 +1609,7 @@ static void mp3d_synth_granule(float *qmf_state, float *grbuf, int nbands, int n
 
     for (i = 0; i < nbands; i += 2)
     {
-        mp3d_synth(grbuf + i, pcm + 32*nch*i, nch, lins + i*64);
+        mp3d_synth(grbuf + i, MINIMP3_ADVANCE(pcm, 32*nch*i), MINIMP3_ADVANCE(fpcm, 32*nch*i), nch, lins + i*64);
     }
 #ifndef MINIMP3_NONSTANDARD_BUT_LOGICAL
     if (nch == 1)
@@ -1600,11 +1639,58 @@ static int mp3d_match_frame(const uint8_t *hdr, int mp3_bytes, int frame_bytes)
     return 1;
 }
 
+/* Distance to the next byte pair that can start a header (0xFF, then 3 more
+   sync bits), or n. Corrupted regions and embedded pictures are skipped 16
+   bytes at a time; p[n] must be readable. */
+static int mp3d_skip_to_sync(const uint8_t *p, int n)
+{
+    int i = 0;
+#if HAVE_SSE
+#ifndef MINIMP3_ONLY_SIMD
+    if (have_simd())
+#endif
+    {
+        const __m128i ff = _mm_set1_epi8((char)0xFF), sync2 = _mm_set1_epi8((char)0xE0);
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i b0 = _mm_loadu_si128((const __m128i *)(p + i));
+            __m128i b1 = _mm_loadu_si128((const __m128i *)(p + i + 1));
+            __m128i hit = _mm_and_si128(_mm_cmpeq_epi8(b0, ff), _mm_cmpeq_epi8(_mm_and_si128(b1, sync2), sync2));
+            if (_mm_movemask_epi8(hit))
+                break;
+        }
+    }
+#elif HAVE_SIMD
+    {
+        const uint8x16_t ff = vdupq_n_u8(0xFF), sync2 = vdupq_n_u8(0xE0);
+        for (; i + 16 <= n; i += 16)
+        {
+            uint8x16_t b0 = vld1q_u8(p + i), b1 = vld1q_u8(p + i + 1);
+            uint8x16_t hit = vandq_u8(vceqq_u8(b0, ff), vceqq_u8(vandq_u8(b1, sync2), sync2));
+            uint64x2_t any = vreinterpretq_u64_u8(hit);
+            if (vgetq_lane_u64(any, 0) | vgetq_lane_u64(any, 1))
+                break;
+        }
+    }
+#endif /* HAVE_SIMD */
+    for (; i < n; i++)
+    {
+        if (p[i] == 0xFF && (p[i + 1] & 0xE0) == 0xE0)
+            break;
+    }
+    return i;
+}
+
 static int mp3d_find_frame(const uint8_t *mp3, int mp3_bytes, int *free_format_bytes, int *ptr_frame_bytes)
 {
     int i, k;
     for (i = 0; i < mp3_bytes - HDR_SIZE; i++, mp3++)
     {
+        k = mp3d_skip_to_sync(mp3, mp3_bytes - HDR_SIZE - i);
+        i += k;
+        mp3 += k;
+        if (i >= mp3_bytes - HDR_SIZE)
+            break;
         if (hdr_valid(mp3))
         {
             int frame_bytes = hdr_frame_bytes(mp3, *free_format_bytes);
@@ -1642,7 +1728,7 @@ void mp3dec_init(mp3dec_t *dec)
     dec->header[0] = 0;
 }
 
-int mp3dec_decode_frame(mp3dec_t *dec, const uint8_t *mp3, int mp3_bytes, short *pcm, mp3dec_frame_info_t *info)
+static int mp3dec_decode_frame_to(mp3dec_t *dec, const uint8_t *mp3, int mp3_bytes, short *pcm, float *fpcm, mp3dec_frame_info_t *info)
 {
     int i = 0, igr, frame_size = 0, success = 1;
     const uint8_t *hdr;
@@ -1693,11 +1779,13 @@ int mp3dec_decode_frame(mp3dec_t *dec, const uint8_t *mp3, int mp3_bytes, short
         success = L3_restore_reservoir(dec, bs_frame, &scratch, main_data_begin);
         if (success)
         {
-            for (igr = 0; igr < (HDR_TEST_MPEG1(hdr) ? 2 : 1); igr++, pcm += 576*info->channels)
+            for (igr = 0; igr < (HDR_TEST_MPEG1(hdr) ? 2 : 1); igr++)
             {
                 memset(scratch.grbuf[0], 0, 576*2*sizeof(float));
                 L3_decode(dec, &scratch, scratch.gr_info + igr*info->channels, info->channels);
-                mp3d_synth_granule(dec->qmf_state, scratch.grbuf[0], 18, info->channels, pcm, scratch.syn[0]);
+                mp3d_synth_granule(dec->qmf_state, scratch.grbuf[0], 18, info->channels, pcm, fpcm, scratch.syn[0]);
+                pcm = MINIMP3_ADVANCE(pcm, 576*info->channels);
+                fpcm = MINIMP3_ADVANCE(fpcm, 576*info->channels);
             }
         }
         L3_save_reservoir(dec, &scratch);
@@ -1716,9 +1804,10 @@ int mp3dec_decode_frame(mp3dec_t *dec, const uint8_t *mp3, int mp3_bytes, short
             {
                 i = 0;
                 L12_apply_scf_384(sci, sci->scf + igr, scratch.grbuf[0]);
-                mp3d_synth_granule(dec->qmf_state, scratch.grbuf[0], 12, info->channels, pcm, scratch.syn[0]);
+                mp3d_synth_granule(dec->qmf_state, scratch.grbuf[0], 12, info->channels, pcm, fpcm, scratch.syn[0]);
                 memset(scratch.grbuf[0], 0, 576*2*sizeof(float));
-                pcm += 384*info->channels;
+                pcm = MINIMP3_ADVANCE(pcm, 384*info->channels);
+                fpcm = MINIMP3_ADVANCE(fpcm, 384*info->channels);
             }
             if (bs_frame->pos > bs_frame->limit)
             {
@@ -1730,4 +1819,51 @@ int mp3dec_decode_frame(mp3dec_t *dec, const uint8_t *mp3, int mp3_bytes, short
     }
     return success*hdr_frame_samples(dec->header);
 }
+
+int mp3dec_decode_frame(mp3dec_t *dec, const uint8_t *mp3, int mp3_bytes, short *pcm, mp3dec_frame_info_t *info)
+{
+    return mp3dec_decode_frame_to(dec, mp3, mp3_bytes, pcm, NULL, info);
+}
+
+int mp3dec_decode_frame_float(mp3dec_t *dec, const uint8_t *mp3, int mp3_bytes, float *pcm, mp3dec_frame_info_t *info)
+{
+    return mp3dec_decode_frame_to(dec, mp3, mp3_bytes, NULL, pcm, info);
+}
+
+void mp3dec_f32_to_s16(const float *in, short *out, int num_samples)
+{
+    int i = 0;
+#if HAVE_SIMD
+#ifndef MINIMP3_ONLY_SIMD
+    if (have_simd())
+#endif
+    {
+        int aligned_count = num_samples & ~7;
+        for (; i < aligned_count; i += 8)
+        {
+            f4 a = VMUL_S(VLD(&in[i]), 32768.0f);
+            f4 b = VMUL_S(VLD(&in[i + 4]), 32768.0f);
+#if HAVE_SSE
+            static const f4 g_max = { 32767.0f, 32767.0f, 32767.0f, 32767.0f };
+            static const f4 g_min = { -32768.0f, -32768.0f, -32768.0f, -32768.0f };
+            __m128i pcm8 = _mm_packs_epi32(_mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(a, g_max), g_min)),
+                                           _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(b, g_max), g_min)));
+            _mm_storeu_si128((__m128i *)(out + i), pcm8);
+#else
+            int16x4_t pcma, pcmb;
+            a = VADD(a, VSET(0.5f));
+            b = VADD(b, VSET(0.5f));
+            pcma = vqmovn_s32(vqaddq_s32(vcvtq_s32_f32(a), vreinterpretq_s32_u32(vcltq_f32(a, VSET(0)))));
+            pcmb = vqmovn_s32(vqaddq_s32(vcvtq_s32_f32(b), vreinterpretq_s32_u32(vcltq_f32(b, VSET(0)))));
+            vst1_s16(out + i, pcma);
+            vst1_s16(out + i + 4, pcmb);
+#endif
+        }
+    }
+#endif /* HAVE_SIMD */
+    for (; i < num_samples; i++)
+    {
+        out[i] = mp3d_scale_pcm(in[i]*32768.0f);
+    }
+}
 #endif /*MINIMP3_IMPLEMENTATION*/
@@ -6,21 +6,44 @@
 #include <cstdint>
 #include <cstdlib>
 #include <vector>
+#include <map>
+#include <list>
 #include <cmath>
 #include <chrono>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #define MINIMP3_IMPLEMENTATION
 #include "minimp3.h"
+#define DR_FLAC_IMPLEMENTATION
+#include "dr_flac.h"
+#include "stb_vorbis.c"
+// stb_vorbis leaves its channel layout macros defined.
+#undef L
+#undef C
+#undef R
 
 using namespace std;
 
 #define _DEBUG
 #ifndef AL_CHECK
 #ifdef _DEBUG
+    // Whether the call is checked is up to ALErrorCheck's policy at run time.
     #define ALCHECK(func) do{ \
         func; \
-        CheckOpenALError(#func, __FILE__, __LINE__); \
+        static ALErrorSite* alSite = ALErrorCheck::Register(#func, __FILE__, __LINE__); \
+        ALErrorCheck::Check(alSite); \
     }while(0);
 #else
      #define ALCHECK(func) func
@@ -30,6 +53,52 @@ using namespace std;
 
 #define LoadMaxBit    (44100 * 2 * 16)
 
+#ifndef AL_APIENTRY
+#define AL_APIENTRY
+#endif
+
+// AL_SOFT_events is an OpenAL Soft extension, the system headers may not know it.
+#ifndef AL_SOFT_events
+#define AL_SOFT_events 1
+#define AL_EVENT_CALLBACK_FUNCTION_SOFT          0x19A2
+#define AL_EVENT_CALLBACK_USER_PARAM_SOFT        0x19A3
+#define AL_EVENT_TYPE_BUFFER_COMPLETED_SOFT      0x19A4
+#define AL_EVENT_TYPE_SOURCE_STATE_CHANGED_SOFT  0x19A5
+#define AL_EVENT_TYPE_DISCONNECTED_SOFT          0x19A6
+typedef void (AL_APIENTRY*ALEVENTPROCSOFT)(ALenum eventType, ALuint object, ALuint param, ALsizei length, const ALchar* message, void* userParam);
+typedef void (AL_APIENTRY*LPALEVENTCONTROLSOFT)(ALsizei count, const ALenum* types, ALboolean enable);
+typedef void (AL_APIENTRY*LPALEVENTCALLBACKSOFT)(ALEVENTPROCSOFT callback, void* userParam);
+#endif
+
+// AL_SOFT_deferred_updates, also OpenAL Soft only.
+#ifndef AL_SOFT_deferred_updates
+#define AL_SOFT_deferred_updates 1
+#define AL_DEFERRED_UPDATES_SOFT                 0xC002
+typedef void (AL_APIENTRY*LPALDEFERUPDATESSOFT)(void);
+typedef void (AL_APIENTRY*LPALPROCESSUPDATESSOFT)(void);
+#endif
+
+// AL_EXT_FLOAT32 and AL_EXT_MCFORMATS formats, missing from some system headers.
+// The 32 bit multichannel formats hold float samples.
+#ifndef AL_FORMAT_MONO_FLOAT32
+#define AL_FORMAT_MONO_FLOAT32                   0x10010
+#define AL_FORMAT_STEREO_FLOAT32                 0x10011
+#endif
+#ifndef AL_FORMAT_QUAD16
+#define AL_FORMAT_QUAD8                          0x1204
+#define AL_FORMAT_QUAD16                         0x1205
+#define AL_FORMAT_QUAD32                         0x1206
+#define AL_FORMAT_51CHN8                         0x120A
+#define AL_FORMAT_51CHN16                        0x120B
+#define AL_FORMAT_51CHN32                        0x120C
+#define AL_FORMAT_61CHN8                         0x120D
+#define AL_FORMAT_61CHN16                        0x120E
+#define AL_FORMAT_61CHN32                        0x120F
+#define AL_FORMAT_71CHN8                         0x1210
+#define AL_FORMAT_71CHN16                        0x1211
+#define AL_FORMAT_71CHN32                        0x1212
+#endif
+
 const char * GetOpenALErrorString(int errID)
 {   
     if (errID == AL_NO_ERROR) return "";
@@ -41,14 +110,142 @@ const char * GetOpenALErrorString(int errID)
     return " Don't know ";  
 }
 
-inline void CheckOpenALError(const char* func, const char* filename, int line)
+// One ALCHECK in the source and what checking it found. The counters are
+// relaxed atomics, any thread bumps them without a lock.
+struct ALErrorSite
+{
+    const char* func;
+    const char* file;
+    int line;
+    atomic<uint32_t> calls;  // only counted while calls are being checked
+    atomic<uint32_t> checks; // alGetError made for the site
+    atomic<uint32_t> errors;
+    atomic<int> lastError;
+};
+
+// When ALCHECK asks alGetError. OpenAL Soft takes the context lock for each
+// one, too much for every alBufferData of every refill, so the policy is set
+// at run time, from AL_CHECK in the environment or with SetPolicy:
+//   off      never
+//   frame    once per EndFrame (default); after an error, every call for the
+//            next EscalateFrames frames so the site shows up in the table
+//   every    after every call
+//   <N>      after one in N calls of each site
+// AL keeps the first error until it is read, so a sampled check blames its
+// site for what any unchecked call since the last check did.
+class ALErrorCheck
 {
-    ALenum err = alGetError();
-    if(err != AL_NO_ERROR)
+public:
+    enum Policy { Off, PerFrame, Sampled, Every };
+
+    static void SetPolicy(Policy p, int sampleEvery = 64)
     {
-        printf("AL ERROR: %08x, (%s) at %s:%i - for %s\n", err,  GetOpenALErrorString(err), filename, line, func);
+        sampleInterval.store(max(sampleEvery, 1), memory_order_relaxed);
+        escalated.store(0, memory_order_relaxed);
+        policy.store(p, memory_order_relaxed);
     }
-}
+    static void Configure(const char* setting)
+    {
+        if(!setting || !*setting) return;
+        if(!strcmp(setting, "off")) SetPolicy(Off);
+        else if(!strcmp(setting, "frame")) SetPolicy(PerFrame);
+        else if(!strcmp(setting, "every")) SetPolicy(Every);
+        else if(atoi(setting) > 0) SetPolicy(Sampled, atoi(setting));
+        else printf("AL_CHECK=%s: expected off, frame, every or a sample interval\n", setting);
+    }
+    // A slot in the site table, taken once per ALCHECK by its static.
+    static ALErrorSite* Register(const char* func, const char* file, int line)
+    {
+        int i = siteCount.fetch_add(1, memory_order_relaxed);
+        ALErrorSite* site = &sites[min(i, MaxSites - 1)];
+        if(i >= MaxSites - 1)
+        {
+            // Full, the last slot takes the rest.
+            site->func = "(other sites)";
+            site->file = file;
+            site->line = 0;
+            return site;
+        }
+        site->func = func;
+        site->file = file;
+        site->line = line;
+        return site;
+    }
+    static void Check(ALErrorSite* site)
+    {
+        Policy p = (Policy)policy.load(memory_order_relaxed);
+        if(p == Off) return;
+        if(p == PerFrame && !escalated.load(memory_order_relaxed)) return;
+        uint32_t n = site->calls.fetch_add(1, memory_order_relaxed);
+        if(p == Sampled && n % (uint32_t)sampleInterval.load(memory_order_relaxed)) return;
+        site->checks.fetch_add(1, memory_order_relaxed);
+        ALenum err = alGetError();
+        if(err == AL_NO_ERROR) return;
+        site->errors.fetch_add(1, memory_order_relaxed);
+        site->lastError.store(err, memory_order_relaxed);
+        printf("AL ERROR: %08x, (%s) at %s:%i - for %s\n", err, GetOpenALErrorString(err), site->file, site->line, site->func);
+    }
+    // The one alGetError of a frame under PerFrame, e.g. per streaming wakeup.
+    static void EndFrame()
+    {
+        if(policy.load(memory_order_relaxed) != PerFrame) return;
+        int left = escalated.load(memory_order_relaxed);
+        if(left)
+        {
+            // The calls were checked one by one this frame.
+            escalated.compare_exchange_strong(left, left - 1, memory_order_relaxed);
+            return;
+        }
+        frameChecks.fetch_add(1, memory_order_relaxed);
+        ALenum err = alGetError();
+        if(err == AL_NO_ERROR) return;
+        frameErrors.fetch_add(1, memory_order_relaxed);
+        printf("AL ERROR: %08x, (%s) during the last frame, checking every call for %d frames\n", err, GetOpenALErrorString(err), EscalateFrames);
+        escalated.store(EscalateFrames, memory_order_relaxed);
+    }
+    // The sites that were checked, those with errors first.
+    static void PrintSites()
+    {
+        int count = min(siteCount.load(memory_order_relaxed), (int)MaxSites);
+        vector<ALErrorSite*> order;
+        for(int i = 0; i < count; i++)
+        {
+            if(sites[i].checks.load(memory_order_relaxed)) order.push_back(&sites[i]);
+        }
+        stable_sort(order.begin(), order.end(), [](ALErrorSite* a, ALErrorSite* b)
+        {
+            return a->errors.load(memory_order_relaxed) > b->errors.load(memory_order_relaxed);
+        });
+        printf("AL checks: %d sites, %u frame checks with %u errors\n", count,
+            frameChecks.load(memory_order_relaxed), frameErrors.load(memory_order_relaxed));
+        for(ALErrorSite* site : order)
+        {
+            printf("  %s:%d %s: %u calls, %u checks, %u errors", site->file, site->line, site->func,
+                site->calls.load(memory_order_relaxed), site->checks.load(memory_order_relaxed), site->errors.load(memory_order_relaxed));
+            if(site->errors.load(memory_order_relaxed)) printf(", last %08x (%s)", site->lastError.load(memory_order_relaxed), GetOpenALErrorString(site->lastError.load(memory_order_relaxed)));
+            printf("\n");
+        }
+    }
+
+    static const int MaxSites = 256;
+    static const int EscalateFrames = 8;
+
+private:
+    static ALErrorSite sites[MaxSites];
+    static atomic<int> siteCount;
+    static atomic<int> policy;
+    static atomic<int> sampleInterval;
+    static atomic<int> escalated; // frames left of checking every call
+    static atomic<uint32_t> frameChecks;
+    static atomic<uint32_t> frameErrors;
+};
+ALErrorSite ALErrorCheck::sites[ALErrorCheck::MaxSites];
+atomic<int> ALErrorCheck::siteCount(0);
+atomic<int> ALErrorCheck::policy(ALErrorCheck::PerFrame);
+atomic<int> ALErrorCheck::sampleInterval(64);
+atomic<int> ALErrorCheck::escalated(0);
+atomic<uint32_t> ALErrorCheck::frameChecks(0);
+atomic<uint32_t> ALErrorCheck::frameErrors(0);
 
 size_t fileSize(FILE* f)
 {
@@ -58,6 +255,72 @@ size_t fileSize(FILE* f)
     return filesize;
 }
 
+// Read-only mapping of a whole file. Pages come from the page cache,
+// so every process playing the same file shares them.
+class MappedFile
+{
+public:
+    MappedFile() : base(nullptr), size(0), fd(-1) {}
+    MappedFile(const MappedFile&) = delete;
+    bool Open(const char* filename)
+    {
+        Close();
+        fd = open(filename, O_RDONLY);
+        if(fd < 0) return false;
+        struct stat st;
+        if(fstat(fd, &st) != 0 || st.st_size <= 0)
+        {
+            Close();
+            return false;
+        }
+        size = (size_t)st.st_size;
+        void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p == MAP_FAILED)
+        {
+            Close();
+            return false;
+        }
+        base = (const unsigned char*)p;
+        return true;
+    }
+    // madvise wants page aligned ranges, widen [offset, offset + length) to pages.
+    void Advise(size_t offset, size_t length, int advice)
+    {
+        if(!base || offset >= size) return;
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t begin = offset / page * page;
+        size_t end = min(size, offset + length);
+        madvise((void*)(base + begin), end - begin, advice);
+    }
+    // Drop the pages inside [offset, offset + length) from our resident set,
+    // the page cache keeps them.
+    void Release(size_t offset, size_t length)
+    {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t begin = (offset + page - 1) / page * page;
+        size_t end = min(size, offset + length) / page * page;
+        if(base && end > begin) madvise((void*)(base + begin), end - begin, MADV_DONTNEED);
+    }
+    void Close()
+    {
+        if(base) munmap((void*)base, size);
+        if(fd >= 0) close(fd);
+        base = nullptr;
+        size = 0;
+        fd = -1;
+    }
+    ~MappedFile()
+    {
+        Close();
+    }
+
+    const unsigned char* base;
+    size_t size;
+
+private:
+    int fd;
+};
+
 
 // static char *wav_header(int hz, int ch, int bips, int data_bytes)
 // {
@@ -96,6 +359,7 @@ public:
         {
             printf("alcMakeContextCurrent() failed!\n");
         }
+        ALErrorCheck::Configure(getenv("AL_CHECK"));
     }
     void PrintInfo()
     {
@@ -155,6 +419,34 @@ public:
         ALCHECK(alSource3f(sid, AL_POSITION, 0.0f, 0.0f, 0.0f));
         ALCHECK(alSource3f(sid, AL_VELOCITY, 0.0f, 0.0f, 0.0f));
     }
+    // Takes over a source name, e.g. one of a batch from ALSourceSet. A new
+    // source already has the defaults the constructor above sets.
+    explicit ALSource(ALuint name) : sid(name) {}
+    // Owns its AL name, so it moves but never copies: a copy would delete
+    // the name a second time.
+    ALSource(const ALSource&) = delete;
+    ALSource& operator=(const ALSource&) = delete;
+    ALSource(ALSource&& other) noexcept : sid(other.sid)
+    {
+        other.sid = 0;
+    }
+    ALSource& operator=(ALSource&& other) noexcept
+    {
+        if(this != &other)
+        {
+            if(sid) alDeleteSources(1, &sid);
+            sid = other.sid;
+            other.sid = 0;
+        }
+        return *this;
+    }
+    // Gives up the name without deleting it.
+    ALuint Release()
+    {
+        ALuint name = sid;
+        sid = 0;
+        return name;
+    }
 
     void SetVolume(float volume)
     {
@@ -231,6 +523,11 @@ public:
     {
         alSourcePause(sid);
     }
+    // Back to AL_INITIAL, keeping the queue.
+    void Rewind()
+    {
+        alSourceRewind(sid);
+    }
 
 
     float GetProgress()
@@ -239,6 +536,16 @@ public:
         alGetSourcef(sid, AL_BYTE_OFFSET, &p);
         return p;
     }
+    float GetSecOffset()
+    {
+        ALfloat s;
+        alGetSourcef(sid, AL_SEC_OFFSET, &s);
+        return s;
+    }
+    void SetSecOffset(float seconds)
+    {
+        ALCHECK(alSourcef(sid, AL_SEC_OFFSET, seconds));
+    }
 
     int GetBufferCounts()
     {
@@ -257,9 +564,15 @@ public:
         ALuint bid;
         alSourceUnqueueBuffers(sid, n, &bid);
     }
+    ALuint UnQueueBuffer()
+    {
+        ALuint bid = 0;
+        ALCHECK(alSourceUnqueueBuffers(sid, 1, &bid));
+        return bid;
+    }
     ~ALSource()
     {
-        alDeleteSources(1, &sid);
+        if(sid) alDeleteSources(1, &sid);
     }
 
     int indicator;
@@ -273,6 +586,29 @@ public:
     {
         ALCHECK(alGenBuffers(1, &bid));
     }
+    explicit ALBuffer(ALuint name) : bid(name) {}
+    ALBuffer(const ALBuffer&) = delete;
+    ALBuffer& operator=(const ALBuffer&) = delete;
+    ALBuffer(ALBuffer&& other) noexcept : bid(other.bid)
+    {
+        other.bid = 0;
+    }
+    ALBuffer& operator=(ALBuffer&& other) noexcept
+    {
+        if(this != &other)
+        {
+            if(bid) alDeleteBuffers(1, &bid);
+            bid = other.bid;
+            other.bid = 0;
+        }
+        return *this;
+    }
+    ALuint Release()
+    {
+        ALuint name = bid;
+        bid = 0;
+        return name;
+    }
     ALuint loadSound(ALuint audioType, char* data, int size, int samplerate)
     {
         ALCHECK(alBufferData(bid, audioType, data, size, samplerate));
@@ -280,499 +616,4112 @@ public:
     }
     ~ALBuffer()
     {
-        ALCHECK(alDeleteBuffers(1, &bid));
+        if(bid) ALCHECK(alDeleteBuffers(1, &bid));
     }
     ALuint bid;
 };
 
-
-class ALListener
+// N sources made by one alGenSources and deleted by one alDeleteSources,
+// where N ALSources cost N driver round trips each way. Elements are plain
+// ALSources, they just do not delete their own names.
+class ALSourceSet
 {
 public:
-    ALListener()
+    ALSourceSet() {}
+    explicit ALSourceSet(size_t count)
     {
-        alListener3f(AL_POSITION, 0.0f, 0.0f, 0.0f);
-        alListener3f(AL_VELOCITY, 0.0f, 0.0f, 0.0f);
+        Resize(count);
     }
-    void SetPosition(float x, float y, float z)
+    ALSourceSet(const ALSourceSet&) = delete;
+    ~ALSourceSet()
     {
-        alListener3f(AL_POSITION, x, y, z);
+        Resize(0);
     }
-    void SetVelocity(float x, float y, float z)
+    // Grows or shrinks by one call for the names added or removed. Growing
+    // is all or nothing, false leaves the set as it was.
+    bool Resize(size_t count)
     {
-        alListener3f(AL_VELOCITY, x, y, z);
+        if(count > sources.size())
+        {
+            vector<ALuint> names(count - sources.size());
+            // Asked directly, ALCHECK may be compiled out or deferred and the
+            // names must not be kept if the device ran out of sources.
+            alGetError();
+            alGenSources((ALsizei)names.size(), &names[0]);
+            ALenum error = alGetError();
+            if(error != AL_NO_ERROR)
+            {
+                printf("alGenSources(%d): %s\n", (int)names.size(), GetOpenALErrorString(error));
+                return false;
+            }
+            sources.reserve(count);
+            for(ALuint name : names) sources.emplace_back(name);
+        }
+        else if(count < sources.size())
+        {
+            vector<ALuint> names;
+            for(size_t i = count; i < sources.size(); i++) names.push_back(sources[i].Release());
+            ALCHECK(alDeleteSources((ALsizei)names.size(), &names[0]));
+            sources.erase(sources.begin() + count, sources.end());
+        }
+        return true;
+    }
+    size_t size() const
+    {
+        return sources.size();
+    }
+    ALSource& operator[](size_t i)
+    {
+        return sources[i];
     }
+    vector<ALSource>::iterator begin()
+    {
+        return sources.begin();
+    }
+    vector<ALSource>::iterator end()
+    {
+        return sources.end();
+    }
+
+private:
+    vector<ALSource> sources;
 };
 
-class WavFile
+// ALSourceSet for buffers.
+class ALBufferSet
 {
 public:
-    WavFile(){}
-    explicit WavFile(const char* filename)
+    ALBufferSet() {}
+    explicit ALBufferSet(size_t count)
     {
-        Setup(filename);
+        Resize(count);
     }
-    void Setup(const char* filename)
+    ALBufferSet(const ALBufferSet&) = delete;
+    ~ALBufferSet()
     {
-        f = fopen(filename, "r");
-        assert(f);
-        fread(ChunkID, sizeof(char), 4, f);
-        fread(&ChunkSize, sizeof(int32_t), 1, f);
-        fread(format, sizeof(char), 4, f);
-        fread(SubChunk1ID, sizeof(char), 4, f);
-        fread(&SubChunk1Size, sizeof(int32_t), 1, f);
-        fread(&AudioFormat, sizeof(int16_t), 1, f);
-        fread(&NumChannels, sizeof(int16_t), 1, f);
-        fread(&SampleRate, sizeof(int32_t), 1, f);
-        fread(&ByteRate, sizeof(int32_t), 1, f);
-        fread(&BlockAlign, sizeof(int16_t), 1, f);
-        fread(&BitsPerSample, sizeof(int16_t), 1, f);
-        fread(&SubChunk2ID, sizeof(char), 4, f);
-        fread(&SubChunk2Size, sizeof(int32_t), 1, f);
-
-
-        if(ByteRate >= SubChunk2Size) //less than 1 second
-        {
-            isNoMoreData = true;
-            bufferSize = SubChunk2Size;
-        }
-        else
-        {
-            isNoMoreData = false;
-            bufferSize = ByteRate;
-        }
-        data = (char*)malloc(bufferSize * sizeof(char));
-        fread(data, sizeof(char), bufferSize, f);
-        // data = (char*)malloc(SubChunk2Size * sizeof(char));
-        // fread(data, sizeof(char), SubChunk2Size, f);
-
-        duration = (float)SubChunk2Size / (float)ByteRate;
-        cursor = bufferSize;
-        ChunkID[4] = '\0';
-        format[4] = '\0';
-        SubChunk1ID[4] = '\0';
-        SubChunk2ID[4] = '\0';
+        Resize(0);
     }
-    bool ReadMore()
+    void Resize(size_t count)
     {
-        if(cursor >= SubChunk2Size) return false;
-        int leftDataSize = SubChunk2Size - cursor;
-        if(leftDataSize >= bufferSize)
+        if(count > buffers.size())
         {
-            fread(data, sizeof(char), bufferSize, f);
-            cursor += bufferSize;
-            assert(cursor <= SubChunk2Size);
+            vector<ALuint> names(count - buffers.size());
+            ALCHECK(alGenBuffers((ALsizei)names.size(), &names[0]));
+            buffers.reserve(count);
+            for(ALuint name : names) buffers.emplace_back(name);
         }
-        else
+        else if(count < buffers.size())
         {
-            //When leftData's size is less than ByteRate, we have to clear the memory
-            //Otherwise we may hear some starnge sound after the true buffer content is played.
-            
-            //NOTE: the buffer size is not always equal to ByteRate because when the 
-            //wav file's duration is less than 1 seconds, we will allocate the buffer with
-            //data size instead of ByteRate. However we we allocate data size buffer,
-            //the cursor is equal to SubChunk2Size which will never happen here.
-            
-            assert(ByteRate <  SubChunk2Size);
-            std::memset(data, 0x00, bufferSize);
-            fread(data, sizeof(char), leftDataSize, f);
-            isNoMoreData = true;
-            cursor += leftDataSize;
+            vector<ALuint> names;
+            for(size_t i = count; i < buffers.size(); i++) names.push_back(buffers[i].Release());
+            ALCHECK(alDeleteBuffers((ALsizei)names.size(), &names[0]));
+            buffers.erase(buffers.begin() + count, buffers.end());
         }
-        printf("Fill Data --> Total cursor: %d  leftDataSize:%d DataSize:%d\n", cursor, leftDataSize, SubChunk2Size);
-        return true;
     }
-    void SetPos(int Pos)
+    size_t size() const
     {
-        cursor = Pos;
+        return buffers.size();
     }
-    ~WavFile()
+    ALBuffer& operator[](size_t i)
     {
-        if(this->data)
-        {
-            free(this->data);
-            this->data = nullptr;
-        }
-        fclose(f);
+        return buffers[i];
     }
-    void PrintInfo()
-    { 
-        printf("ChunkID = %s \nChunkSize = %d \nformat = %s \nSubChunk1ID = %s \nSubChunk1Size = %d \nAudioFormat = %d \nNumChannels = %d \nSampleRate = %d \nByteRate = %d \nBlockAlign = %d \nBitsPerSample = %d \nSubChunk2ID = %s \nSubChunk2Size = %d \nduration = %.2f \n",
-            ChunkID ,ChunkSize ,format ,SubChunk1ID ,SubChunk1Size ,AudioFormat ,NumChannels ,SampleRate ,ByteRate ,BlockAlign ,BitsPerSample ,SubChunk2ID ,SubChunk2Size, duration
-            );
+    vector<ALBuffer>::iterator begin()
+    {
+        return buffers.begin();
+    }
+    vector<ALBuffer>::iterator end()
+    {
+        return buffers.end();
     }
 
-    // Chunk
-    char ChunkID[5]; // 0 terminate
-    int32_t ChunkSize;
-    char format[5];
-    
-    // Fmt Chunk
-    char SubChunk1ID[5];
-    int16_t SubChunk1Size;
-    int16_t AudioFormat;
-    int16_t NumChannels;
-    int32_t SampleRate;
-    int32_t ByteRate;
-    int16_t BlockAlign;
-    int16_t BitsPerSample;
-    
-    //Data Chunk
-    char SubChunk2ID[5];
-    int32_t SubChunk2Size;
-    char* data;
-    float duration;
-
-    FILE* f;
-    int cursor;
-    bool isNoMoreData;
-    int bufferSize;
+private:
+    vector<ALBuffer> buffers;
 };
 
-// struct AudioFile
-// {
-//     int frame_bytes;
-//     int channels;
-//     int frequence;
-//     int bitrate;
-// };
 
-class MusicPlayer
+class ALListener
 {
 public:
-    MusicPlayer(){}
-    MusicPlayer(const MusicPlayer&) = delete;
-    MusicPlayer(const char* file)
+    ALListener()
     {
-        Setup(file);
+        alListener3f(AL_POSITION, 0.0f, 0.0f, 0.0f);
+        alListener3f(AL_VELOCITY, 0.0f, 0.0f, 0.0f);
     }
-    void Setup(const char* filename)
+    void SetPosition(float x, float y, float z)
     {
-        playCursor = 0;
-        bufferCounts = 3;
-        wavf.Setup(filename);
-        albv.resize(bufferCounts);
-
-        counter = 0;
-
-        total = 0;
+        alListener3f(AL_POSITION, x, y, z);
+    }
+    void SetVelocity(float x, float y, float z)
+    {
+        alListener3f(AL_VELOCITY, x, y, z);
+    }
+};
 
-        int cursor = 0;
-        int oneTime = ceil(wavf.bufferSize / bufferCounts);
-        for(ALBuffer& b : albv)
+// One frame's worth of 3D changes, applied together. The setters only write
+// to staging arrays, one array per component, and Commit hands them all to
+// AL between alDeferUpdatesSOFT and alProcessUpdatesSOFT, so the mixer sees
+// the whole frame at once instead of a thousand changes one by one. Without
+// AL_SOFT_deferred_updates the context is suspended around them instead.
+// AL calls made between Begin and Commit are deferred along with them.
+class ALUpdateBatch
+{
+public:
+    ALUpdateBatch() : commits(0), changes(0), began(false), listenerMoved(false), listenerTurned(false)
+    {
+        alDeferUpdatesSOFT = nullptr;
+        alProcessUpdatesSOFT = nullptr;
+        if(alIsExtensionPresent("AL_SOFT_deferred_updates"))
         {
-            int left = (wavf.bufferSize - cursor);
-            int size = min(left, oneTime);
-            b.loadSound(AL_FORMAT_STEREO16, &wavf.data[cursor], size, wavf.SampleRate);
-            als.SetBuffers(1, b.bid);
-            cursor += size;
-            
-            playCursor += size; 
-            total += size;
-            printf("Normal Play--> Counter: %d, total:%d\n", counter++, total);
+            alDeferUpdatesSOFT = (LPALDEFERUPDATESSOFT)alGetProcAddress("alDeferUpdatesSOFT");
+            alProcessUpdatesSOFT = (LPALPROCESSUPDATESSOFT)alGetProcAddress("alProcessUpdatesSOFT");
         }
+        useDeferred = alDeferUpdatesSOFT && alProcessUpdatesSOFT;
+    }
+    ALUpdateBatch(const ALUpdateBatch&) = delete;
 
-        assert(cursor == wavf.bufferSize);
-        current = 0;
-        isNeedMoreData = true;
-        isEnd = false;
-
-        threeTime = 0;
-
+    void SetPosition(ALuint sid, float x, float y, float z)
+    {
+        positions.Add(sid, x, y, z);
     }
-    bool IsPlaying()
+    void SetVelocity(ALuint sid, float x, float y, float z)
     {
-        return als.IsPlaying();
+        velocities.Add(sid, x, y, z);
     }
-    void Play()
+    void SetListenerPosition(float x, float y, float z)
     {
-        als.Play();
+        listenerMoved = true;
+        listener[0] = x;
+        listener[1] = y;
+        listener[2] = z;
     }
-    void Pause()
+    void SetListenerVelocity(float x, float y, float z)
     {
-        als.Pause();
+        listenerTurned = true;
+        listener[3] = x;
+        listener[4] = y;
+        listener[5] = z;
     }
-
-    void FillBuffer()
+    // Where the listener will be after Commit, false when it does not move.
+    bool GetListenerPosition(float& x, float& y, float& z)
     {
-        if(isEnd) return;
-        if(als.IsStopped()) als.Play();
-        int fillcount = als.GetBufferProcessedCounts();
-        while(fillcount--)
-        {
-            // assert(fillcount <= 1);
-            als.UnQueueBuffers(1);
-            if(isNeedMoreData)
-            {
-                // printf("MoreData\n");
-                if(!wavf.ReadMore())
-                {
-                    isEnd = true;
-                    return;
-                }
-                playCursor = wavf.cursor;
-                isNeedMoreData = false;
-            }
-            int oneTime = ceil(wavf.bufferSize / bufferCounts);
-            current = min((wavf.bufferSize - current), oneTime);
-            //Fill Data
-            albv[currentBuffer].loadSound(AL_FORMAT_STEREO16, &wavf.data[threeTime], current, wavf.SampleRate);
-            als.SetBuffers(1, albv[currentBuffer].bid);
-            // printf("oneTime: %d, current:%d, playCursor:%d, wavf.bufferSize:%d\n", oneTime, current, playCursor, wavf.bufferSize);
-            printf("Normal Play--> Counter: %d, total:%d, current:%d threeTime:%d\n", counter++, total, current, threeTime);
-            threeTime += current;
-            total += current;
-            
-            if(++currentBuffer >= albv.size())
-            {
-                assert(threeTime == wavf.bufferSize);
-                currentBuffer = 0;
-                current = 0;
-                isNeedMoreData = true; // moredata
-                threeTime = 0;
-            }
+        if(!listenerMoved) return false;
+        x = listener[0];
+        y = listener[1];
+        z = listener[2];
+        return true;
+    }
+    // Holds back whatever AL calls follow until Commit.
+    void Begin()
+    {
+        if(began) return;
+        began = true;
+        if(useDeferred) alDeferUpdatesSOFT();
+        else alcSuspendContext(alcGetCurrentContext());
+    }
+    // Applies what was staged since the last Commit in one go.
+    void Commit()
+    {
+        Begin();
+        positions.Apply(AL_POSITION);
+        velocities.Apply(AL_VELOCITY);
+        if(listenerMoved) alListener3f(AL_POSITION, listener[0], listener[1], listener[2]);
+        if(listenerTurned) alListener3f(AL_VELOCITY, listener[3], listener[4], listener[5]);
+        changes += positions.sids.size() + velocities.sids.size() + listenerMoved + listenerTurned;
+        positions.Clear();
+        velocities.Clear();
+        listenerMoved = false;
+        listenerTurned = false;
+        if(useDeferred) alProcessUpdatesSOFT();
+        else alcProcessContext(alcGetCurrentContext());
+        began = false;
+        commits++;
+    }
+    void PrintStats()
+    {
+        printf("AL update batches (%s): %d commits, %.1f changes per commit\n",
+            useDeferred ? "AL_SOFT_deferred_updates" : "alcSuspendContext", commits, commits ? (double)changes / commits : 0.0);
+    }
+
+    bool useDeferred;
+    int commits;
+    uint64_t changes;
+
+private:
+    // A vector property per source, structure of arrays.
+    struct Staging
+    {
+        void Add(ALuint sid, float x, float y, float z)
+        {
+            sids.push_back(sid);
+            xs.push_back(x);
+            ys.push_back(y);
+            zs.push_back(z);
+        }
+        void Apply(ALenum param)
+        {
+            for(size_t i = 0; i < sids.size(); i++) alSource3f(sids[i], param, xs[i], ys[i], zs[i]);
+        }
+        // Keeps the capacity, after the first frames staging allocates nothing.
+        void Clear()
+        {
+            sids.clear();
+            xs.clear();
+            ys.clear();
+            zs.clear();
+        }
+        vector<ALuint> sids;
+        vector<float> xs;
+        vector<float> ys;
+        vector<float> zs;
+    };
+
+    LPALDEFERUPDATESSOFT alDeferUpdatesSOFT;
+    LPALPROCESSUPDATESSOFT alProcessUpdatesSOFT;
+    bool began;
+    Staging positions;
+    Staging velocities;
+    bool listenerMoved;
+    bool listenerTurned;
+    float listener[6]; // position, velocity
+};
+
+// Hands the device's voices to the emitters that matter most. Every voice the
+// device can mix is generated up front, in one call, and an emitter only
+// holds one while its priority times its audibility ranks among the best. The
+// others are virtual: their playback position keeps advancing with Update but
+// they hold no AL source, and they pick up from there when they rank again.
+// Update is a pass over the emitters and a partial sort, thousands of them
+// are cheap. Its AL calls and the moves of the frame go out as one
+// ALUpdateBatch.
+class SourcePool
+{
+public:
+    struct Emitter
+    {
+        ALuint buffer; // 0 for a free slot
+        float priority;
+        float gain;
+        float position[3];
+        bool moved;   // since the position last went to AL
+        bool looping;
+        bool playing;
+        bool started; // by Play since the last Update
+        float length; // seconds in the buffer
+        float offset; // seconds into the buffer, kept up to date while virtual
+        float score;  // priority times audibility at the last Update
+        bool ranked;  // among the emitters that get a voice
+        int voice;    // index into voices, -1 while virtual
+    };
+
+    // maxVoices 0 takes as many as the device says it can mix, less
+    // streamReserve left over for StreamPlayer and other sources of its own.
+    SourcePool(int maxVoices = 0, int streamReserve = 16) : audibleGain(0.001f), hysteresis(1.25f),
+        virtualized(0), resumed(0), peakVoices(0)
+    {
+        // The device limit counts sources made before the pool too, so back
+        // off until a batch fits.
+        size_t count = VoiceLimit(maxVoices, streamReserve);
+        while(count > 0 && !voices.Resize(count)) count /= 2;
+        if(voices.size() == 0) printf("SourcePool: no sources could be made\n");
+        for(size_t i = 0; i < voices.size(); i++) freeVoices.push_back((int)i);
+        voiceOwners.assign(voices.size(), -1);
+        ranking.reserve(voices.size());
+    }
+    SourcePool(const SourcePool&) = delete;
+
+    // Returns the emitter's id, it stays valid until Remove.
+    int Add(ALuint buffer, float priority = 1.0f, bool loop = false)
+    {
+        int id;
+        if(freeIds.empty())
+        {
+            id = (int)emitters.size();
+            emitters.push_back(Emitter());
+        }
+        else
+        {
+            id = freeIds.back();
+            freeIds.pop_back();
+        }
+        Emitter& e = emitters[id];
+        e.buffer = buffer;
+        e.priority = priority;
+        e.gain = 1.0f;
+        e.position[0] = e.position[1] = e.position[2] = 0.0f;
+        e.moved = false;
+        e.looping = loop;
+        e.playing = false;
+        e.started = false;
+        e.length = BufferSeconds(buffer);
+        e.offset = 0.0f;
+        e.score = 0.0f;
+        e.ranked = false;
+        e.voice = -1;
+        return id;
+    }
+    void Remove(int id)
+    {
+        Stop(id);
+        emitters[id].buffer = 0;
+        freeIds.push_back(id);
+    }
+    // Starts from the beginning. The emitter gets a voice, if it ranks for
+    // one, at the next Update.
+    void Play(int id)
+    {
+        Emitter& e = emitters[id];
+        if(e.voice >= 0) ReleaseVoice(e);
+        e.playing = true;
+        e.started = true;
+        e.offset = 0.0f;
+    }
+    void Stop(int id)
+    {
+        Emitter& e = emitters[id];
+        if(e.voice >= 0) ReleaseVoice(e);
+        e.playing = false;
+        e.offset = 0.0f;
+    }
+    void SetPosition(int id, float x, float y, float z)
+    {
+        Emitter& e = emitters[id];
+        e.position[0] = x;
+        e.position[1] = y;
+        e.position[2] = z;
+        e.moved = true; // goes to AL with the next Update
+    }
+    void SetGain(int id, float gain)
+    {
+        Emitter& e = emitters[id];
+        e.gain = gain;
+        if(e.voice >= 0) voices[e.voice].SetVolume(gain);
+    }
+    bool IsVirtual(int id)
+    {
+        return emitters[id].playing && emitters[id].voice < 0;
+    }
+
+    // Advances the virtual emitters by dt seconds, then gives the voices to
+    // the best ranked playing emitters. Call it once per game frame.
+    void Update(float dt)
+    {
+        ALfloat lx, ly, lz;
+        if(!updates.GetListenerPosition(lx, ly, lz)) alGetListener3f(AL_POSITION, &lx, &ly, &lz);
+        updates.Begin();
+        ranking.clear();
+        for(size_t i = 0; i < emitters.size(); i++)
+        {
+            Emitter& e = emitters[i];
+            e.ranked = false;
+            if(!e.playing) continue;
+            if(e.voice >= 0)
+            {
+                // A voice that stopped by itself played a one-shot to the end.
+                if(voices[e.voice].IsStopped())
+                {
+                    ReleaseVoice(e);
+                    e.playing = false;
+                    continue;
+                }
+            }
+            else if(e.started)
+            {
+                e.started = false;
+            }
+            else
+            {
+                e.offset += dt;
+                if(e.offset >= e.length)
+                {
+                    if(!e.looping || e.length <= 0.0f)
+                    {
+                        e.playing = false;
+                        continue;
+                    }
+                    e.offset = fmodf(e.offset, e.length);
+                }
+            }
+            float dx = e.position[0] - lx, dy = e.position[1] - ly, dz = e.position[2] - lz;
+            float audibility = e.gain * Attenuation(sqrtf(dx * dx + dy * dy + dz * dz));
+            if(audibility < audibleGain) continue;
+            // Holding on to a voice takes less than taking one, so two close
+            // emitters do not trade it back and forth every frame.
+            e.score = e.priority * audibility * (e.voice >= 0 ? hysteresis : 1.0f);
+            ranking.push_back((int)i);
+        }
+        if(ranking.size() > voices.size())
+        {
+            nth_element(ranking.begin(), ranking.begin() + voices.size(), ranking.end(),
+                [this](int a, int b) { return emitters[a].score > emitters[b].score; });
+            ranking.resize(voices.size());
+        }
+        for(int id : ranking) emitters[id].ranked = true;
+
+        // Voices of the emitters that dropped out first, so the new ones find them free.
+        for(size_t v = 0; v < voices.size(); v++)
+        {
+            int id = voiceOwners[v];
+            if(id < 0 || emitters[id].ranked) continue;
+            Emitter& e = emitters[id];
+            e.offset = voices[v].GetSecOffset();
+            ReleaseVoice(e);
+            virtualized++;
+        }
+        for(int id : ranking)
+        {
+            Emitter& e = emitters[id];
+            if(e.voice < 0) BindVoice(e, id);
+            else if(e.moved) updates.SetPosition(voices[e.voice].sid, e.position[0], e.position[1], e.position[2]);
+            e.moved = false;
+        }
+        peakVoices = max(peakVoices, (int)(voices.size() - freeVoices.size()));
+        updates.Commit();
+        ALErrorCheck::EndFrame();
+    }
+    void PrintStats()
+    {
+        int playing = 0, virtuals = 0;
+        for(const Emitter& e : emitters)
+        {
+            playing += e.buffer && e.playing;
+            virtuals += e.buffer && e.playing && e.voice < 0;
+        }
+        printf("Source pool: %zu voices, %d playing, %d virtual, peak %d voices, %d virtualized, %d resumed\n",
+            voices.size(), playing, virtuals, peakVoices, virtualized, resumed);
+    }
+
+    vector<Emitter> emitters;
+    ALSourceSet voices;
+    ALUpdateBatch updates; // set the listener through it to move it with the emitters
+    float audibleGain; // below it an emitter is inaudible and never gets a voice
+    float hysteresis;  // score bonus of an emitter that already has a voice
+
+    int virtualized; // voices taken from emitters still playing
+    int resumed;     // voices given to emitters part way through
+    int peakVoices;
+
+private:
+    // ALC_MONO_SOURCES is how many sources the device mixes, 3D emitters
+    // are mono. Devices that do not say get the 32 every implementation has.
+    static size_t VoiceLimit(int maxVoices, int streamReserve)
+    {
+        ALCint mono = 0;
+        ALCdevice* device = alcGetContextsDevice(alcGetCurrentContext());
+        if(device) alcGetIntegerv(device, ALC_MONO_SOURCES, 1, &mono);
+        if(mono <= 0) mono = 32;
+        int limit = max((int)mono - max(streamReserve, 0), 1);
+        return maxVoices > 0 ? (size_t)min(maxVoices, limit) : (size_t)limit;
+    }
+    static float BufferSeconds(ALuint buffer)
+    {
+        ALint size = 0, channels = 0, bits = 0, frequency = 0;
+        alGetBufferi(buffer, AL_SIZE, &size);
+        alGetBufferi(buffer, AL_CHANNELS, &channels);
+        alGetBufferi(buffer, AL_BITS, &bits);
+        alGetBufferi(buffer, AL_FREQUENCY, &frequency);
+        if(!channels || !bits || !frequency) return 0.0f;
+        return (float)size / (channels * bits / 8) / frequency;
+    }
+    // AL_INVERSE_DISTANCE_CLAMPED with the default reference distance and
+    // rolloff factor of 1, what the voices do once they play.
+    static float Attenuation(float distance)
+    {
+        return 1.0f / max(distance, 1.0f);
+    }
+    void BindVoice(Emitter& e, int id)
+    {
+        e.voice = freeVoices.back();
+        freeVoices.pop_back();
+        voiceOwners[e.voice] = id;
+        ALSource& source = voices[e.voice];
+        source.SetBuffer(e.buffer);
+        source.SetVolume(e.gain);
+        source.SetPosition(e.position[0], e.position[1], e.position[2]);
+        source.SetLooping(e.looping);
+        if(e.offset > 0.0f)
+        {
+            // Applied when the source starts, so it resumes where it would be.
+            source.SetSecOffset(e.offset);
+            resumed++;
+        }
+        source.Play();
+    }
+    void ReleaseVoice(Emitter& e)
+    {
+        ALSource& source = voices[e.voice];
+        source.Stop();
+        source.SetBuffer(0);
+        voiceOwners[e.voice] = -1;
+        freeVoices.push_back(e.voice);
+        e.voice = -1;
+    }
+
+    vector<int> freeIds;
+    vector<int> freeVoices;
+    vector<int> voiceOwners; // emitter id per voice, -1 when free
+    vector<int> ranking;
+};
+
+class WavFile
+{
+public:
+    WavFile() : data(nullptr), f(nullptr), isMapped(false) {}
+    explicit WavFile(const char* filename, bool mapped = false) : data(nullptr), f(nullptr), isMapped(false)
+    {
+        Setup(filename, mapped);
+    }
+    void Setup(const char* filename, bool mapped = false)
+    {
+        bool opened = Open(filename, mapped);
+        assert(opened);
+        (void)opened;
+    }
+    // With mapped set the data chunk is memory mapped and data points
+    // straight into it instead of a malloc'ed copy. False when the file
+    // cannot be read or has no usable fmt and data chunk.
+    bool Open(const char* filename, bool mapped = false)
+    {
+        f = fopen(filename, "r");
+        if(!f) return false;
+        NumChannels = 0;
+        SampleRate = 0;
+        BitsPerSample = 0;
+        fread(ChunkID, sizeof(char), 4, f);
+        fread(&ChunkSize, sizeof(int32_t), 1, f);
+        fread(format, sizeof(char), 4, f);
+        fread(SubChunk1ID, sizeof(char), 4, f);
+        fread(&SubChunk1Size, sizeof(int32_t), 1, f);
+        fread(&AudioFormat, sizeof(int16_t), 1, f);
+        fread(&NumChannels, sizeof(int16_t), 1, f);
+        fread(&SampleRate, sizeof(int32_t), 1, f);
+        fread(&ByteRate, sizeof(int32_t), 1, f);
+        fread(&BlockAlign, sizeof(int16_t), 1, f);
+        fread(&BitsPerSample, sizeof(int16_t), 1, f);
+        if((uint16_t)AudioFormat == WAVE_FORMAT_EXTENSIBLE && SubChunk1Size >= 40)
+        {
+            // Multichannel and 24 bit files: the real format code opens the
+            // SubFormat GUID after cbSize, valid bits and the channel mask.
+            fseek(f, 20 + 24, SEEK_SET);
+            fread(&AudioFormat, sizeof(int16_t), 1, f);
+        }
+        // Float files carry a longer fmt chunk and a fact chunk, skip to "data".
+        fseek(f, 20 + SubChunk1Size, SEEK_SET);
+        bool hasData = false;
+        while(fread(&SubChunk2ID, sizeof(char), 4, f) == 4 && fread(&SubChunk2Size, sizeof(int32_t), 1, f) == 1)
+        {
+            hasData = !memcmp(SubChunk2ID, "data", 4);
+            if(hasData) break;
+            fseek(f, SubChunk2Size + (SubChunk2Size & 1), SEEK_CUR);
+        }
+        if(!hasData || SubChunk2Size < 0 || NumChannels <= 0 || BitsPerSample <= 0 || SampleRate <= 0) return false;
+
+        if(ByteRate >= SubChunk2Size) //less than 1 second
+        {
+            isNoMoreData = true;
+            bufferSize = SubChunk2Size;
+        }
+        else
+        {
+            isNoMoreData = false;
+            bufferSize = ByteRate;
+        }
+        isMapped = mapped && mapping.Open(filename);
+        if(isMapped)
+        {
+            dataOffset = ftell(f);
+            SubChunk2Size = (int32_t)min((size_t)SubChunk2Size, mapping.size - dataOffset);
+            bufferSize = min(bufferSize, (int)SubChunk2Size);
+            isNoMoreData = bufferSize >= SubChunk2Size;
+            mapping.Advise(dataOffset, SubChunk2Size, MADV_SEQUENTIAL);
+            mapping.Advise(dataOffset, 2 * bufferSize, MADV_WILLNEED);
+            data = (char*)mapping.base + dataOffset;
+        }
+        else
+        {
+            data = (char*)malloc(bufferSize * sizeof(char));
+            fread(data, sizeof(char), bufferSize, f);
+        }
+        dataSize = bufferSize;
+        // data = (char*)malloc(SubChunk2Size * sizeof(char));
+        // fread(data, sizeof(char), SubChunk2Size, f);
+
+        duration = (float)SubChunk2Size / (float)ByteRate;
+        cursor = bufferSize;
+        ChunkID[4] = '\0';
+        format[4] = '\0';
+        SubChunk1ID[4] = '\0';
+        SubChunk2ID[4] = '\0';
+        return true;
+    }
+    bool ReadMore()
+    {
+        if(cursor >= SubChunk2Size) return false;
+        int leftDataSize = SubChunk2Size - cursor;
+        if(isMapped)
+        {
+            // No copy, just move the window and ask for the one after it.
+            data = (char*)mapping.base + dataOffset + cursor;
+            dataSize = min(leftDataSize, bufferSize);
+            cursor += dataSize;
+            isNoMoreData = cursor >= SubChunk2Size;
+            mapping.Advise(dataOffset + cursor, bufferSize, MADV_WILLNEED);
+            return true;
+        }
+        if(leftDataSize >= bufferSize)
+        {
+            fread(data, sizeof(char), bufferSize, f);
+            dataSize = bufferSize;
+            cursor += bufferSize;
+            assert(cursor <= SubChunk2Size);
+        }
+        else
+        {
+            //When leftData's size is less than ByteRate, we have to clear the memory
+            //Otherwise we may hear some starnge sound after the true buffer content is played.
+            
+            //NOTE: the buffer size is not always equal to ByteRate because when the 
+            //wav file's duration is less than 1 seconds, we will allocate the buffer with
+            //data size instead of ByteRate. However we we allocate data size buffer,
+            //the cursor is equal to SubChunk2Size which will never happen here.
+            
+            assert(ByteRate <  SubChunk2Size);
+            std::memset(data, 0x00, bufferSize);
+            fread(data, sizeof(char), leftDataSize, f);
+            dataSize = leftDataSize;
+            isNoMoreData = true;
+            cursor += leftDataSize;
+        }
+        printf("Fill Data --> Total cursor: %d  leftDataSize:%d DataSize:%d\n", cursor, leftDataSize, SubChunk2Size);
+        return true;
+    }
+    void SetPos(int Pos)
+    {
+        cursor = Pos;
+    }
+    bool IsFloat()
+    {
+        return AudioFormat == WAVE_FORMAT_IEEE_FLOAT && BitsPerSample == 32;
+    }
+    ~WavFile()
+    {
+        if(this->data && !isMapped)
+        {
+            free(this->data);
+        }
+        this->data = nullptr;
+        if(f) fclose(f);
+    }
+    void PrintInfo()
+    { 
+        printf("ChunkID = %s \nChunkSize = %d \nformat = %s \nSubChunk1ID = %s \nSubChunk1Size = %d \nAudioFormat = %d \nNumChannels = %d \nSampleRate = %d \nByteRate = %d \nBlockAlign = %d \nBitsPerSample = %d \nSubChunk2ID = %s \nSubChunk2Size = %d \nduration = %.2f \n",
+            ChunkID ,ChunkSize ,format ,SubChunk1ID ,SubChunk1Size ,AudioFormat ,NumChannels ,SampleRate ,ByteRate ,BlockAlign ,BitsPerSample ,SubChunk2ID ,SubChunk2Size, duration
+            );
+    }
+
+    // Chunk
+    char ChunkID[5]; // 0 terminate
+    int32_t ChunkSize;
+    char format[5];
+    
+    // Fmt Chunk
+    char SubChunk1ID[5];
+    int32_t SubChunk1Size;
+    int16_t AudioFormat;
+    int16_t NumChannels;
+    int32_t SampleRate;
+    int32_t ByteRate;
+    int16_t BlockAlign;
+    int16_t BitsPerSample;
+    
+    //Data Chunk
+    char SubChunk2ID[5];
+    int32_t SubChunk2Size;
+    char* data;
+    float duration;
+
+    FILE* f;
+    int cursor;
+    bool isNoMoreData;
+    int bufferSize;
+    int dataSize; // valid bytes in data
+
+    bool isMapped;
+    MappedFile mapping;
+    size_t dataOffset; // of the data chunk in the file
+
+    static const int WAVE_FORMAT_IEEE_FLOAT = 3;
+    static const int WAVE_FORMAT_EXTENSIBLE = 0xFFFE;
+};
+
+// struct AudioFile
+// {
+//     int frame_bytes;
+//     int channels;
+//     int frequence;
+//     int bitrate;
+// };
+
+// Picks the AL buffer format for a PCM stream. When the device has no format
+// for the source layout the blocks are converted to the closest one it has:
+// float when the source has more than 16 bits and the device takes float,
+// otherwise 16 bit, and more channels than the device takes are mixed down to
+// stereo. Convert runs on the decode thread only.
+class PcmConverter
+{
+public:
+    PcmConverter() : alFormat(AL_NONE), inChannels(0), inBits(0), inFloat(false),
+        outChannels(0), outBits(0), inBytesPerFrame(0), outBytesPerFrame(0), passThrough(true) {}
+
+    // bits is the container size, 8 bit samples are unsigned as in WAV files.
+    bool Setup(int channels, int bits, bool isFloat)
+    {
+        bool hasFloat = alIsExtensionPresent("AL_EXT_FLOAT32");
+        bool hasMulti = alIsExtensionPresent("AL_EXT_MCFORMATS");
+        bool known = isFloat ? bits == 32 : (bits == 8 || bits == 16 || bits == 24 || bits == 32);
+        if(channels < 1 || !known) return false;
+        inChannels = channels;
+        inBits = bits;
+        inFloat = isFloat;
+        outChannels = channels <= 2 || (hasMulti && Format(channels, 16, hasFloat) != AL_NONE) ? channels : 2;
+        if((isFloat || bits > 16) && Format(outChannels, 32, hasFloat || (hasMulti && outChannels > 2)) != AL_NONE) outBits = 32;
+        else if(bits == 8 && outChannels == channels) outBits = 8;
+        else outBits = 16;
+        alFormat = Format(outChannels, outBits, true);
+        inBytesPerFrame = channels * bits / 8;
+        outBytesPerFrame = outChannels * outBits / 8;
+        passThrough = outChannels == channels && outBits == bits && (bits != 32 || isFloat);
+        if(outChannels != channels) SetupDownmix();
+        return true;
+    }
+
+    // Converts the whole frames in size bytes, size becomes the output size.
+    // The result stays valid until the next call.
+    const char* Convert(const char* pcm, int& size)
+    {
+        if(passThrough) return pcm;
+        int frames = size / inBytesPerFrame;
+        int samples = frames * inChannels;
+        const float* f = (const float*)pcm;
+        if(!inFloat)
+        {
+            floats.resize(samples);
+            if(inBits == 8) U8ToFloat((const uint8_t*)pcm, floats.data(), samples);
+            else if(inBits == 16) S16ToFloat((const int16_t*)pcm, floats.data(), samples);
+            else if(inBits == 24) S24ToFloat((const uint8_t*)pcm, floats.data(), samples);
+            else S32ToFloat((const int32_t*)pcm, floats.data(), samples);
+            f = floats.data();
+        }
+        if(outChannels != inChannels)
+        {
+            mixed.resize(frames * 2);
+            Downmix(f, mixed.data(), frames);
+            f = mixed.data();
+        }
+        samples = frames * outChannels;
+        size = samples * outBits / 8;
+        if(outBits == 32) return (const char*)f;
+        shorts.resize(samples);
+        mp3dec_f32_to_s16(f, shorts.data(), samples);
+        return (const char*)shorts.data();
+    }
+
+    // AL format for channels and bits (32 = float), AL_NONE if there is none.
+    static ALenum Format(int channels, int bits, bool withFloat)
+    {
+        static const ALenum formats[8][3] = {
+            { AL_FORMAT_MONO8,   AL_FORMAT_MONO16,   AL_FORMAT_MONO_FLOAT32 },
+            { AL_FORMAT_STEREO8, AL_FORMAT_STEREO16, AL_FORMAT_STEREO_FLOAT32 },
+            { AL_NONE,           AL_NONE,            AL_NONE },
+            { AL_FORMAT_QUAD8,   AL_FORMAT_QUAD16,   AL_FORMAT_QUAD32 },
+            { AL_NONE,           AL_NONE,            AL_NONE },
+            { AL_FORMAT_51CHN8,  AL_FORMAT_51CHN16,  AL_FORMAT_51CHN32 },
+            { AL_FORMAT_61CHN8,  AL_FORMAT_61CHN16,  AL_FORMAT_61CHN32 },
+            { AL_FORMAT_71CHN8,  AL_FORMAT_71CHN16,  AL_FORMAT_71CHN32 },
+        };
+        if(channels < 1 || channels > 8 || (bits == 32 && !withFloat)) return AL_NONE;
+        return formats[channels - 1][bits == 8 ? 0 : bits == 16 ? 1 : 2];
+    }
+
+    ALenum alFormat;
+    int inChannels, inBits;
+    bool inFloat;
+    int outChannels, outBits;
+    int inBytesPerFrame, outBytesPerFrame;
+    bool passThrough; // the source is uploaded as it is
+
+private:
+    // Left/right gains per source channel for the usual WAV channel orders,
+    // scaled so a full scale signal on every channel does not clip.
+    void SetupDownmix()
+    {
+        const float c = 0.7071f;
+        static const float layouts[8][8][2] = {
+            {},
+            {},
+            { {1, 0}, {0, 1}, {c, c} },                                         // L R C
+            { {1, 0}, {0, 1}, {c, 0}, {0, c} },                                 // L R BL BR
+            { {1, 0}, {0, 1}, {c, c}, {c, 0}, {0, c} },                         // L R C BL BR
+            { {1, 0}, {0, 1}, {c, c}, {0, 0}, {c, 0}, {0, c} },                 // 5.1
+            { {1, 0}, {0, 1}, {c, c}, {0, 0}, {0.5f, 0.5f}, {c, 0}, {0, c} },   // 6.1
+            { {1, 0}, {0, 1}, {c, c}, {0, 0}, {c, 0}, {0, c}, {c, 0}, {0, c} }, // 7.1
+        };
+        mix.assign(inChannels * 2, 0.0f);
+        float sum = 1.0f;
+        if(inChannels <= 8)
+        {
+            sum = 0.0f;
+            for(int ch = 0; ch < inChannels; ch++)
+            {
+                mix[ch * 2] = layouts[inChannels - 1][ch][0];
+                mix[ch * 2 + 1] = layouts[inChannels - 1][ch][1];
+                sum += mix[ch * 2];
+            }
+        }
+        else
+        {
+            // Unknown layout, keep the front pair.
+            mix[0] = mix[3] = 1.0f;
+        }
+        for(float& g : mix) g /= sum;
+    }
+    void Downmix(const float* in, float* out, int frames)
+    {
+        for(int i = 0; i < frames; i++, in += inChannels)
+        {
+            float l = 0.0f, r = 0.0f;
+            for(int ch = 0; ch < inChannels; ch++)
+            {
+                l += in[ch] * mix[ch * 2];
+                r += in[ch] * mix[ch * 2 + 1];
+            }
+            out[i * 2] = l;
+            out[i * 2 + 1] = r;
+        }
+    }
+
+    static void U8ToFloat(const uint8_t* in, float* out, int n)
+    {
+        for(int i = 0; i < n; i++) out[i] = (in[i] - 128) * (1.0f / 128.0f);
+    }
+    static void S16ToFloat(const int16_t* in, float* out, int n)
+    {
+        int i = 0;
+#if HAVE_SSE
+        const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+        for(; i + 8 <= n; i += 8)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+            __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+            __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+            _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+            _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+        }
+#elif HAVE_SIMD
+        for(; i + 8 <= n; i += 8)
+        {
+            int16x8_t v = vld1q_s16(in + i);
+            vst1q_f32(out + i, vcvtq_n_f32_s32(vmovl_s16(vget_low_s16(v)), 15));
+            vst1q_f32(out + i + 4, vcvtq_n_f32_s32(vmovl_s16(vget_high_s16(v)), 15));
+        }
+#endif
+        for(; i < n; i++) out[i] = in[i] * (1.0f / 32768.0f);
+    }
+    // Packed little endian 24 bit, each sample is moved to the top of an
+    // int32 so the sign comes along.
+    static void S24ToFloat(const uint8_t* in, float* out, int n)
+    {
+        int i = 0;
+#if HAVE_SSE && defined(__SSSE3__)
+        const __m128i spread = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+        const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+        for(; i + 6 <= n; i += 4) // loads 16 bytes for 12
+        {
+            __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + i * 3)), spread);
+            _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(v), scale));
+        }
+#elif HAVE_SIMD && !HAVE_SSE
+        for(; i + 8 <= n; i += 8)
+        {
+            uint8x8x3_t b = vld3_u8(in + i * 3);
+            uint16x8_t low = vorrq_u16(vmovl_u8(b.val[0]), vshlq_n_u16(vmovl_u8(b.val[1]), 8));
+            int16x8_t high = vmovl_s8(vreinterpret_s8_u8(b.val[2]));
+            int32x4_t s0 = vorrq_s32(vshll_n_s16(vget_low_s16(high), 16), vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(low))));
+            int32x4_t s1 = vorrq_s32(vshll_n_s16(vget_high_s16(high), 16), vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(low))));
+            vst1q_f32(out + i, vcvtq_n_f32_s32(s0, 23));
+            vst1q_f32(out + i + 4, vcvtq_n_f32_s32(s1, 23));
+        }
+#endif
+        for(; i < n; i++)
+        {
+            int32_t v = (int32_t)((uint32_t)in[i * 3] << 8 | (uint32_t)in[i * 3 + 1] << 16 | (uint32_t)in[i * 3 + 2] << 24);
+            out[i] = v * (1.0f / 2147483648.0f);
+        }
+    }
+    static void S32ToFloat(const int32_t* in, float* out, int n)
+    {
+        int i = 0;
+#if HAVE_SSE
+        const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+        for(; i + 4 <= n; i += 4)
+        {
+            _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(in + i))), scale));
+        }
+#elif HAVE_SIMD
+        for(; i + 4 <= n; i += 4)
+        {
+            vst1q_f32(out + i, vcvtq_n_f32_s32(vld1q_s32(in + i), 31));
+        }
+#endif
+        for(; i < n; i++) out[i] = in[i] * (1.0f / 2147483648.0f);
+    }
+
+    vector<float> mix; // left/right gain per source channel
+    vector<float> floats, mixed;
+    vector<short> shorts;
+};
+
+// Lock-free single producer / single consumer ring of PCM bytes.
+// The decode thread is the only writer and the feeder the only reader.
+class PcmRing
+{
+public:
+    PcmRing() : mask(0), head(0), tail(0) {}
+    void Setup(int minCapacity)
+    {
+        size_t capacity = 1;
+        while(capacity < (size_t)minCapacity) capacity <<= 1;
+        buffer.assign(capacity, 0);
+        mask = capacity - 1;
+        Reset();
+    }
+    // Only safe while neither side is running.
+    void Reset()
+    {
+        head.store(0, memory_order_relaxed);
+        tail.store(0, memory_order_relaxed);
+    }
+    int Capacity()
+    {
+        return (int)buffer.size();
+    }
+    int FillLevel()
+    {
+        return (int)(head.load(memory_order_acquire) - tail.load(memory_order_acquire));
+    }
+    int Space()
+    {
+        return Capacity() - FillLevel();
+    }
+    // Producer side, returns how many bytes fit.
+    int Write(const char* src, int size)
+    {
+        size_t w = head.load(memory_order_relaxed);
+        size_t r = tail.load(memory_order_acquire);
+        size = min(size, (int)(buffer.size() - (w - r)));
+        size_t pos = w & mask;
+        int first = min(size, (int)(buffer.size() - pos));
+        memcpy(&buffer[pos], src, first);
+        memcpy(&buffer[0], src + first, size - first);
+        head.store(w + size, memory_order_release);
+        return size;
+    }
+    // Producer side without the copy: contiguous free bytes to decode into,
+    // published by Commit().
+    char* WriteSpan(int& size)
+    {
+        size_t w = head.load(memory_order_relaxed);
+        size_t r = tail.load(memory_order_acquire);
+        size_t pos = w & mask;
+        size = (int)min(buffer.size() - (w - r), buffer.size() - pos);
+        return &buffer[pos];
+    }
+    void Commit(int size)
+    {
+        head.store(head.load(memory_order_relaxed) + size, memory_order_release);
+    }
+    // Consumer side: contiguous readable bytes, valid until Consume().
+    const char* Peek(int& size)
+    {
+        size_t r = tail.load(memory_order_relaxed);
+        size_t w = head.load(memory_order_acquire);
+        size_t pos = r & mask;
+        size = (int)min(w - r, buffer.size() - pos);
+        return &buffer[pos];
+    }
+    void Consume(int size)
+    {
+        tail.store(tail.load(memory_order_relaxed) + size, memory_order_release);
+    }
+    int Read(char* dst, int size)
+    {
+        int done = 0;
+        while(done < size)
+        {
+            int avail;
+            const char* src = Peek(avail);
+            if(!avail) break;
+            avail = min(avail, size - done);
+            memcpy(dst + done, src, avail);
+            Consume(avail);
+            done += avail;
+        }
+        return done;
+    }
+
+private:
+    vector<char> buffer;
+    size_t mask;
+    atomic<size_t> head; // total bytes written
+    atomic<size_t> tail; // total bytes read
+};
+
+// Keeps an ALSource fed through a buffer queue. Decoding runs ahead on its
+// own thread into a PcmRing, FillBuffer only copies ready PCM into the
+// retired buffers. The StreamingService drives FillBuffer from its thread.
+class StreamPlayer
+{
+public:
+    StreamPlayer()
+    {
+        isEnd = true;
+        stopDecoding = false;
+        decodeDone = true;
+        queuedBytes = 0;
+    }
+    StreamPlayer(const StreamPlayer&) = delete;
+    virtual ~StreamPlayer()
+    {
+        StopDecoder();
+        // AL will not delete buffers still queued on a source, and albv goes
+        // before als.
+        als.Stop();
+        als.SetBuffer(0);
+    }
+    // Refill every retired buffer, returns how many buffers were queued again.
+    virtual int FillBuffer()
+    {
+        lock_guard<mutex> lock(streamMutex);
+        return Refill();
+    }
+    bool IsEnd()
+    {
+        return isEnd;
+    }
+    ALuint GetSourceID()
+    {
+        return als.sid;
+    }
+    // Seconds of audio held by one queued buffer.
+    float GetBufferDuration()
+    {
+        return (float)chunkSize / (float)bytesPerSecond;
+    }
+    int GetBufferCounts()
+    {
+        return bufferCounts;
+    }
+    bool IsPlaying()
+    {
+        return als.IsPlaying();
+    }
+    void Play()
+    {
+        als.Play();
+    }
+    void Pause()
+    {
+        als.Pause();
+    }
+
+    // Read-ahead tuning: the decoder pauses once the ring holds highWater
+    // bytes and resumes when it drains to lowWater.
+    int GetFillLevel()
+    {
+        return ring.FillLevel();
+    }
+    int GetLowWater()
+    {
+        return lowWater;
+    }
+    int GetHighWater()
+    {
+        return highWater;
+    }
+    void SetWaterMarks(int low, int high)
+    {
+        highWater = min(high, ring.Capacity());
+        lowWater = min(low, highWater);
+        decodeCv.notify_one();
+    }
+
+    ALSource als;
+    bool isEnd;
+
+protected:
+    // Decode the next piece of the stream and hand it to Produce().
+    // Runs on the decode thread, returns false at the end of the stream.
+    virtual bool Decode() = 0;
+
+    // Players whose PCM already sits in memory skip the decode thread and lend
+    // FillBuffer up to size bytes in place. Returns 0 at the end of the stream.
+    virtual int Borrow(const char*& /*src*/, int /*size*/)
+    {
+        return 0;
+    }
+
+    // Set up converter for the source layout, then start with what it picked.
+    void StartStreaming(int rate, int counts, bool decodeAhead = true)
+    {
+        StartStreaming(converter.alFormat, rate, rate * converter.outBytesPerFrame, converter.outBytesPerFrame, counts,
+            decodeAhead || !converter.passThrough);
+    }
+
+    // Takes PCM in the source layout. Blocks while the ring is full, returns
+    // false when the decoder is being stopped.
+    bool Produce(const char* pcm, int size)
+    {
+        pcm = converter.Convert(pcm, size);
+        while(size > 0)
+        {
+            int n = ring.Write(pcm, size);
+            pcm += n;
+            size -= n;
+            if(size > 0)
+            {
+                unique_lock<mutex> lock(decodeMutex);
+                if(stopDecoding) return false;
+                decodeCv.wait_for(lock, chrono::milliseconds(20));
+            }
+        }
+        return true;
+    }
+
+    // Produce() for decoders that can write the AL format themselves: waits
+    // until the ring has room for wanted bytes, then lends the contiguous free
+    // part, which is shorter where the ring wraps. Hand back what was written
+    // with CommitProduce(). Returns nullptr when the decoder is being stopped.
+    // Only valid when the converter passes through.
+    char* ProduceSpan(int wanted, int& size)
+    {
+        wanted = min(wanted, ring.Capacity());
+        while(ring.Space() < wanted)
+        {
+            unique_lock<mutex> lock(decodeMutex);
+            if(stopDecoding) return nullptr;
+            decodeCv.wait_for(lock, chrono::milliseconds(20));
+        }
+        return ring.WriteSpan(size);
+    }
+    void CommitProduce(int size)
+    {
+        ring.Commit(size);
+    }
+
+    // Starts the decode thread and queues the first buffers once they are ready.
+    // Derived classes call this at the end of Setup and StopDecoder() in their destructor.
+    void StartStreaming(ALenum alFormat, int rate, int byteRate, int blockAlign, int counts, bool decodeAhead = true)
+    {
+        format = alFormat;
+        sampleRate = rate;
+        bytesPerSecond = byteRate;
+        bufferCounts = counts;
+        chunkSize = max(blockAlign, (byteRate / counts) / blockAlign * blockAlign);
+        staging.resize(chunkSize);
+
+        ring.Setup(byteRate * 2);
+        lowWater = ring.Capacity() / 4;
+        highWater = ring.Capacity() * 3 / 4;
+
+        albv.Resize(bufferCounts);
+        freeBuffers.clear();
+        for(ALBuffer& b : albv) freeBuffers.push_back(b.bid);
+
+        isDirect = !decodeAhead;
+        lock_guard<mutex> lock(streamMutex);
+        ResumeStream(0, false);
+    }
+    // Throw away everything queued and decoded ahead and stop the decoder, so
+    // the derived class can reposition its file. Call with streamMutex held.
+    void FlushStream()
+    {
+        StopDecoder();
+        als.Stop();
+        int processed = als.GetBufferProcessedCounts();
+        while(processed--)
+        {
+            freeBuffers.push_back(als.UnQueueBuffer());
+        }
+        ring.Reset();
+    }
+    // Stream again from the current file position, byteOffset is where that is
+    // in the PCM stream. Without play the source is left in AL_INITIAL with
+    // the new buffers queued, ready for Play. Call with streamMutex held.
+    void ResumeStream(int64_t byteOffset, bool play)
+    {
+        queuedBytes = byteOffset;
+        isEnd = false;
+        directDone = false;
+        stopDecoding = false;
+        decodeDone = isDirect;
+        if(!isDirect) decoder = thread(&StreamPlayer::DecodeLoop, this);
+
+        int prime = min(chunkSize * bufferCounts, highWater);
+        while(!decodeDone && ring.FillLevel() < prime)
+        {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        Refill(false);
+        if(play) als.Play();
+        else als.Rewind();
+    }
+    void StopDecoder()
+    {
+        {
+            lock_guard<mutex> lock(decodeMutex);
+            stopDecoding = true;
+        }
+        decodeCv.notify_one();
+        if(decoder.joinable()) decoder.join();
+    }
+
+    ALenum format;
+    int sampleRate;
+    int bytesPerSecond;
+    int64_t queuedBytes;
+    mutex streamMutex; // FillBuffer against seeks
+
+private:
+    // restart picks a source that ran dry up again, not for a stopped one
+    // that is only being primed.
+    int Refill(bool restart = true)
+    {
+        if(isEnd) return 0;
+        int processed = als.GetBufferProcessedCounts();
+        while(processed--)
+        {
+            freeBuffers.push_back(als.UnQueueBuffer());
+        }
+        int filled = 0;
+        while(!freeBuffers.empty())
+        {
+            const char* src;
+            int size = isDirect ? Borrow(src, chunkSize) : TakeFromRing(src);
+            if(!size)
+            {
+                directDone = isDirect;
+                break;
+            }
+            ALuint bid = freeBuffers.back();
+            freeBuffers.pop_back();
+            ALCHECK(alBufferData(bid, format, src, size, sampleRate));
+            if(!isDirect && src != &staging[0]) ring.Consume(size);
+            als.SetBuffers(1, bid);
+            queuedBytes += size;
+            filled++;
+        }
+        if(!isDirect && ring.FillLevel() <= lowWater) decodeCv.notify_one();
+        if(restart && filled && als.IsStopped()) als.Play(); // we starved, pick up again
+        bool drained = isDirect ? directDone : (decodeDone && !ring.FillLevel());
+        if(drained && (int)freeBuffers.size() == bufferCounts)
+        {
+            isEnd = true;
+        }
+        return filled;
+    }
+    // Ring side of FillBuffer: a whole chunk, or what is left at the end.
+    int TakeFromRing(const char*& src)
+    {
+        // The decoder publishes its last bytes before raising decodeDone.
+        bool last = decodeDone.load(memory_order_acquire);
+        int ready = ring.FillLevel();
+        // Never queue a short buffer in the middle of the stream.
+        if(!ready || (ready < chunkSize && !last)) return 0;
+        int size = min(ready, chunkSize);
+        int avail;
+        src = ring.Peek(avail);
+        if(avail < size)
+        {
+            ring.Read(&staging[0], size);
+            src = &staging[0];
+        }
+        return size;
+    }
+    void DecodeLoop()
+    {
+        while(!stopDecoding)
+        {
+            if(ring.FillLevel() >= highWater)
+            {
+                unique_lock<mutex> lock(decodeMutex);
+                while(!stopDecoding && ring.FillLevel() > lowWater)
+                {
+                    decodeCv.wait_for(lock, chrono::milliseconds(20));
+                }
+                continue;
+            }
+            if(!Decode()) break;
+        }
+        decodeDone.store(true, memory_order_release);
+    }
+
+    ALBufferSet albv;
+    vector<ALuint> freeBuffers;
+    vector<char> staging;
+    int bufferCounts;
+    int chunkSize;
+    bool isDirect;
+    bool directDone;
+
+    PcmRing ring;
+    int lowWater;
+    int highWater;
+    thread decoder;
+    mutex decodeMutex;
+    condition_variable decodeCv;
+    atomic<bool> stopDecoding; // read by DecodeLoop without decodeMutex
+    atomic<bool> decodeDone;
+
+protected:
+    PcmConverter converter;
+};
+
+class MusicPlayer : public StreamPlayer
+{
+public:
+    MusicPlayer(){}
+    MusicPlayer(const char* file, bool mapped = false)
+    {
+        Setup(file, mapped);
+    }
+    ~MusicPlayer()
+    {
+        StopDecoder();
+    }
+    // A mapped file is uploaded straight from the page cache, without the decode
+    // thread, when the device takes its format as is.
+    void Setup(const char* filename, bool mapped = false)
+    {
+        wavf.Setup(filename, mapped);
+        // WavFile::Setup already read the first second.
+        isPending = true;
+        windowUsed = 0;
+        if(!converter.Setup(wavf.NumChannels, wavf.BitsPerSample, wavf.IsFloat()))
+        {
+            printf("%s: unsupported format %d, %d channels, %d bits\n", filename, wavf.AudioFormat, wavf.NumChannels, wavf.BitsPerSample);
+            assert(false);
+        }
+        StartStreaming(wavf.SampleRate, 3, !wavf.isMapped);
+    }
+    float GetProgress()
+    {
+        return (float)queuedBytes / (float)bytesPerSecond;
+    }
+    float GetDuration()
+    {
+        return wavf.duration;
+    }
+
+    WavFile wavf;
+
+protected:
+    bool Decode()
+    {
+        if(!isPending && !wavf.ReadMore()) return false;
+        isPending = false;
+        if(!Produce(wavf.data, wavf.dataSize)) return false;
+        return !wavf.isNoMoreData;
+    }
+    int Borrow(const char*& src, int size)
+    {
+        while(windowUsed >= wavf.dataSize)
+        {
+            if(!isPending && !wavf.ReadMore()) return 0;
+            isPending = false;
+            windowUsed = 0;
+        }
+        isPending = false;
+        size = min(size, wavf.dataSize - windowUsed);
+        src = wavf.data + windowUsed;
+        windowUsed += size;
+        return size;
+    }
+
+    bool isPending;
+    int windowUsed; // bytes of the mapped window already lent out
+};
+
+
+
+// Where the frames of an MP3 start and end once the tags around them are cut
+// off: ID3v2 (and APE) at the front, APE and ID3v1 at the back. Only the tag
+// headers are read, so a large cover picture costs nothing.
+class Mp3Tags
+{
+public:
+    Mp3Tags() : begin(0), end(0) {}
+
+    void Parse(const unsigned char* data, size_t size)
+    {
+        begin = 0;
+        end = size;
+        // Tags can be stacked, e.g. an ID3v2 tag written in front of an old one.
+        for(size_t tag; (tag = Id3v2Size(data + begin, end - begin)) || (tag = ApeSize(data + begin, end - begin, true)); )
+        {
+            begin += tag;
+        }
+        if(end - begin >= 128 && !memcmp(data + end - 128, "TAG", 3)) end -= 128;
+        end -= ApeSize(data + begin, end - begin, false);
+    }
+
+    size_t begin;
+    size_t end;
+
+private:
+    // "ID3", version, flags, then a 28 bit size in 7 bit bytes that leaves out
+    // the 10 byte header and the optional footer.
+    static size_t Id3v2Size(const unsigned char* h, size_t size)
+    {
+        if(size < 10 || memcmp(h, "ID3", 3) || h[3] == 0xFF || h[4] == 0xFF) return 0;
+        if((h[6] | h[7] | h[8] | h[9]) & 0x80) return 0;
+        size_t tag = 10 + ((size_t)h[6] << 21 | (size_t)h[7] << 14 | (size_t)h[8] << 7 | h[9]);
+        if(h[5] & 0x10) tag += 10;
+        return tag <= size ? tag : 0;
+    }
+    // APEv1/v2: a 32 byte "APETAGEX" header and/or footer. The size field
+    // counts the items and the footer, not the header.
+    static size_t ApeSize(const unsigned char* data, size_t size, bool atFront)
+    {
+        if(size < 32) return 0;
+        const unsigned char* h = atFront ? data : data + size - 32;
+        if(memcmp(h, "APETAGEX", 8)) return 0;
+        uint32_t tagSize = h[12] | h[13] << 8 | h[14] << 16 | (uint32_t)h[15] << 24;
+        uint32_t flags = h[20] | h[21] << 8 | h[22] << 16 | (uint32_t)h[23] << 24;
+        size_t tag = (size_t)tagSize + ((flags & 0x80000000u) ? 32 : 0);
+        if(atFront && !(flags & 0x20000000u)) return 0; // a footer can't lead
+        return tag <= size && tag >= 32 ? tag : 0;
+    }
+};
+
+#define MP3_INDEX_MAGIC "M3IX"
+
+// Byte offset and first sample of every frame in an MP3, found by walking the
+// frame headers with the minimp3 hdr_* helpers. Nothing is decoded, so the scan
+// is cheap enough to run in the background while playback starts.
+class Mp3FrameIndex
+{
+public:
+    struct Entry
+    {
+        uint32_t offset; // of the frame header in the file
+        uint32_t sample; // per channel samples before this frame
+    };
+
+    Mp3FrameIndex() : totalSamples(0), ready(false), cancel(false) {}
+
+    void Build(MappedFile& mapping, size_t start, size_t end)
+    {
+        const unsigned char* data = mapping.base;
+        size_t size = end;
+        unsigned char first[HDR_SIZE];
+        bool synced = false;
+        int freeFormatBytes = 0;
+        size_t pos = start;
+        size_t released = start;
+        uint64_t samples = 0;
+        frames.clear();
+        while(pos + HDR_SIZE <= size && !cancel)
+        {
+            const unsigned char* h = data + pos;
+            int frameBytes;
+            if(synced && hdr_compare(first, h))
+            {
+                frameBytes = hdr_frame_bytes(h, freeFormatBytes) + hdr_padding(h);
+            }
+            else
+            {
+                // Start of stream or lost sync, let minimp3 find a frame it trusts.
+                int left = (int)min(size - pos, (size_t)INT32_MAX);
+                pos += mp3d_find_frame(h, left, &freeFormatBytes, &frameBytes);
+                h = data + pos;
+                memcpy(first, h, HDR_SIZE);
+                synced = true;
+            }
+            if(!frameBytes || pos + frameBytes > size) break;
+            frames.push_back(Entry{ (uint32_t)pos, (uint32_t)samples });
+            samples += hdr_frame_samples(h);
+            pos += frameBytes;
+            // The scan touches every page once, do not let it pin the whole file.
+            if(pos - released >= ScanWindow)
+            {
+                mapping.Release(released, pos - released);
+                released = pos;
+            }
+        }
+        totalSamples = samples;
+        ready.store(true, memory_order_release);
+    }
+    // Index of the frame that holds sample, frames must not be empty.
+    size_t Find(uint64_t sample)
+    {
+        return Find(frames, sample);
+    }
+    // Last entry starting at or before sample.
+    static size_t Find(const vector<Entry>& entries, uint64_t sample)
+    {
+        size_t lo = 0, hi = entries.size();
+        while(hi - lo > 1)
+        {
+            size_t mid = (lo + hi) / 2;
+            if(entries[mid].sample <= sample) lo = mid;
+            else hi = mid;
+        }
+        return lo;
+    }
+    // First frame to feed the decoder so that frame k comes out exactly as in a
+    // straight decode: frame k - 1 must decode for the IMDCT overlap and
+    // synthesis state, and the frames before it must refill its bit reservoir.
+    // data is the file the index was built from.
+    size_t PrerollStart(const unsigned char* data, size_t k)
+    {
+        if(k == 0) return 0;
+        size_t p = k - 1;
+        int reservoir = 0;
+        while(p > 0 && reservoir < MAX_BITRESERVOIR_BYTES)
+        {
+            --p;
+            reservoir += MainDataBytes(data + frames[p].offset, (int)(frames[p + 1].offset - frames[p].offset));
+        }
+        return p;
+    }
+    // What a layer III frame adds to the bit reservoir: all of it but the
+    // header, the optional CRC and the side info.
+    static int MainDataBytes(const unsigned char* h, int frameBytes)
+    {
+        int sideInfo = HDR_TEST_MPEG1(h) ? (HDR_IS_MONO(h) ? 17 : 32) : (HDR_IS_MONO(h) ? 9 : 17);
+        return frameBytes - HDR_SIZE - (HDR_IS_CRC(h) ? 2 : 0) - sideInfo;
+    }
+
+    // Persisted indexes are only trusted for the same file size and mtime.
+    bool Save(const char* path, uint64_t fileSize, uint64_t mtime)
+    {
+        FILE* f = fopen(path, "wb");
+        if(!f) return false;
+        uint32_t count = (uint32_t)frames.size();
+        bool ok = fwrite(MP3_INDEX_MAGIC, 1, 4, f) == 4 &&
+            fwrite(&fileSize, sizeof(fileSize), 1, f) == 1 &&
+            fwrite(&mtime, sizeof(mtime), 1, f) == 1 &&
+            fwrite(&totalSamples, sizeof(totalSamples), 1, f) == 1 &&
+            fwrite(&count, sizeof(count), 1, f) == 1 &&
+            (!count || fwrite(&frames[0], sizeof(Entry), count, f) == count);
+        fclose(f);
+        return ok;
+    }
+    bool Load(const char* path, uint64_t fileSize, uint64_t mtime)
+    {
+        FILE* f = fopen(path, "rb");
+        if(!f) return false;
+        char magic[4];
+        uint64_t size, time, total;
+        uint32_t count;
+        bool ok = fread(magic, 1, 4, f) == 4 && !memcmp(magic, MP3_INDEX_MAGIC, 4) &&
+            fread(&size, sizeof(size), 1, f) == 1 && size == fileSize &&
+            fread(&time, sizeof(time), 1, f) == 1 && time == mtime &&
+            fread(&total, sizeof(total), 1, f) == 1 &&
+            fread(&count, sizeof(count), 1, f) == 1;
+        if(ok)
+        {
+            frames.resize(count);
+            ok = !count || fread(&frames[0], sizeof(Entry), count, f) == count;
+        }
+        fclose(f);
+        if(!ok)
+        {
+            frames.clear();
+            return false;
+        }
+        totalSamples = total;
+        ready.store(true, memory_order_release);
+        return true;
+    }
+
+    static const size_t ScanWindow = 1 << 20;
+
+    vector<Entry> frames;
+    uint64_t totalSamples;
+    atomic<bool> ready;
+    atomic<bool> cancel;
+};
+
+// Xing/Info or VBRI header that encoders leave in the first frame. It gives
+// the frame count and a coarse seek table without scanning the file, and the
+// LAME extension adds the encoder delay and padding for gapless playback.
+class Mp3VbrHeader
+{
+public:
+    Mp3VbrHeader() : valid(false), frames(0), bytes(0), encoderDelay(0), encoderPadding(0), isLame(false) {}
+
+    bool Parse(const unsigned char* frame, int frameBytes)
+    {
+        valid = false;
+        seekPoints.clear();
+        if(frameBytes < HDR_SIZE || !hdr_valid(frame)) return false;
+        int samplesPerFrame = hdr_frame_samples(frame);
+        int sideInfo = HDR_TEST_MPEG1(frame) ? (HDR_IS_MONO(frame) ? 17 : 32) : (HDR_IS_MONO(frame) ? 9 : 17);
+        const unsigned char* p = frame + HDR_SIZE + (HDR_IS_CRC(frame) ? 2 : 0) + sideInfo;
+        const unsigned char* end = frame + frameBytes;
+        if(p + 8 <= end && (!memcmp(p, "Xing", 4) || !memcmp(p, "Info", 4)))
+        {
+            const unsigned char* tag = p;
+            uint32_t flags = ReadBE(p + 4, 4);
+            p += 8;
+            if(flags & 1) { if(p + 4 > end) return false; frames = ReadBE(p, 4); p += 4; }
+            if(flags & 2) { if(p + 4 > end) return false; bytes = ReadBE(p, 4); p += 4; }
+            if(flags & 4)
+            {
+                if(p + 100 > end) return false;
+                // 100 points: percent of the duration -> byte position / 256.
+                for(int i = 0; i < 100 && frames && bytes; ++i)
+                {
+                    uint32_t sample = (uint32_t)((uint64_t)frames * i / 100 * samplesPerFrame);
+                    seekPoints.push_back(Mp3FrameIndex::Entry{ (uint32_t)((uint64_t)p[i] * bytes / 256), sample });
+                }
+                p += 100;
+            }
+            if(flags & 8) p += 4;
+            // The LAME extension sits at a fixed place after a full Xing tag.
+            const unsigned char* lame = tag + 120;
+            if(lame + 24 <= end && IsEncoderTag(lame))
+            {
+                isLame = true;
+                encoderDelay = (lame[21] << 4) | (lame[22] >> 4);
+                encoderPadding = ((lame[22] & 0x0F) << 8) | lame[23];
+            }
+            valid = frames != 0;
+        }
+        else if(frame + HDR_SIZE + 32 + 26 <= end && !memcmp(frame + HDR_SIZE + 32, "VBRI", 4))
+        {
+            p = frame + HDR_SIZE + 32;
+            bytes = ReadBE(p + 10, 4);
+            frames = ReadBE(p + 14, 4);
+            int entries = (int)ReadBE(p + 18, 2);
+            int scale = (int)ReadBE(p + 20, 2);
+            int entrySize = (int)ReadBE(p + 22, 2);
+            int framesPerEntry = (int)ReadBE(p + 24, 2);
+            p += 26;
+            // Each entry is the byte length of the next framesPerEntry frames.
+            uint64_t offset = frameBytes;
+            for(int i = 0; i < entries && p + entrySize <= end && entrySize <= 4; ++i, p += entrySize)
+            {
+                seekPoints.push_back(Mp3FrameIndex::Entry{ (uint32_t)offset, (uint32_t)((uint64_t)i * framesPerEntry * samplesPerFrame) });
+                offset += (uint64_t)ReadBE(p, entrySize) * scale;
+            }
+            valid = frames != 0;
+        }
+        return valid;
+    }
+    // Decoder output samples to drop at the start / end for gapless playback.
+    // 529 is the MDCT + synthesis filter delay of the decoder itself.
+    int StartTrim()
+    {
+        return isLame ? encoderDelay + 529 : 0;
+    }
+    int EndTrim()
+    {
+        return isLame ? max(encoderPadding - 529, 0) : 0;
+    }
+
+    bool valid;
+    uint32_t frames; // audio frames after the header frame
+    uint32_t bytes;  // stream bytes counted from the header frame
+    int encoderDelay;
+    int encoderPadding;
+    bool isLame;
+    vector<Mp3FrameIndex::Entry> seekPoints; // offsets are from the header frame
+
+private:
+    static uint32_t ReadBE(const unsigned char* p, int n)
+    {
+        uint32_t v = 0;
+        while(n--) v = (v << 8) | *p++;
+        return v;
+    }
+    static bool IsEncoderTag(const unsigned char* p)
+    {
+        return !memcmp(p, "LAME", 4) || !memcmp(p, "Lavf", 4) || !memcmp(p, "Lavc", 4) || !memcmp(p, "L3.9", 4);
+    }
+};
+
+class Mp3File
+{
+public:
+    Mp3File(){}
+    Mp3File(const char* filename, bool persistIndex = false, bool floatOutput = false)
+    {
+        Setup(filename, persistIndex, floatOutput);
+    }
+    // The frame index is scanned in the background. With persistIndex it is
+    // loaded from / saved to "<filename>.idx" next to the file. With
+    // floatOutput GetNextFrame fills pcmf with the synthesis output in
+    // [-1, 1) instead of rounding it to 16 bit in pcm.
+    void Setup(const char* filename, bool persistIndex = false, bool floatOutput = false)
+    {
+        this->floatOutput = floatOutput;
+        if(floatOutput) pcmf.resize(MINIMP3_MAX_SAMPLES_PER_FRAME * 40);
+        // The file is mapped rather than read, so opening costs the same for any
+        // length and only a window around playCursor stays resident.
+        bool opened = mapping.Open(filename);
+        assert(opened);
+        mp3dec_init(&mp3d);
+
+        filesize = mapping.size;
+        data = mapping.base;
+        mapping.Advise(0, filesize, MADV_SEQUENTIAL);
+        mapping.Advise(0, WindowSize, MADV_WILLNEED);
+        releasedCursor = 0;
+        memset(&info, 0, sizeof(info));
+
+        // Jump over the tags instead of letting the sync search crawl through them.
+        tags.Parse(data, filesize);
+        audioEnd = tags.end;
+        // A Xing/Info/VBRI frame carries no audio, start decoding after it.
+        int freeFormatBytes = 0, frameBytes = 0;
+        headerFrame = tags.begin + mp3d_find_frame(data + tags.begin, (int)min(audioEnd - tags.begin, (size_t)INT32_MAX), &freeFormatBytes, &frameBytes);
+        audioStart = headerFrame;
+        playableSamples = 0;
+        if(frameBytes && vbr.Parse(data + headerFrame, frameBytes))
+        {
+            audioStart += frameBytes;
+            uint64_t decoded = (uint64_t)vbr.frames * hdr_frame_samples(data + headerFrame);
+            playableSamples = decoded - min(decoded, (uint64_t)(vbr.encoderDelay + vbr.encoderPadding) * vbr.isLame);
+        }
+        playCursor = (int)audioStart;
+        leftfilesize = audioEnd - audioStart;
+        pcmCursor = 0;
+        skipSamples = vbr.StartTrim();
+        remainingSamples = playableSamples ? (int64_t)playableSamples : -1;
+        bufferSize = MINIMP3_MAX_SAMPLES_PER_FRAME * 40 * 2;
+        GetNextFrame();
+        SampleRate = info.hz;
+        if(playableSamples) duration = (float)playableSamples / (float)SampleRate;
+        else duration = (float)(audioEnd - audioStart) / (4 + ((float)info.frame_bytes / info.hz) * (info.bitrate_kbps * 1000 / 8)) * ((float)info.frame_bytes / info.hz);
+
+        struct stat st;
+        uint64_t mtime = stat(filename, &st) == 0 ? (uint64_t)st.st_mtime : 0;
+        string indexPath = string(filename) + ".idx";
+        if(!persistIndex || !index.Load(indexPath.c_str(), filesize, mtime))
+        {
+            indexThread = thread([this, persistIndex, indexPath, mtime]()
+            {
+                index.Build(mapping, audioStart, audioEnd);
+                if(persistIndex && !index.cancel) index.Save(indexPath.c_str(), filesize, mtime);
+            });
+        }
+    }
+    void WaitIndex()
+    {
+        if(indexThread.joinable()) indexThread.join();
+    }
+    // Known up front from a VBR header, exact once the frame index is done,
+    // an estimate from the first frame until then.
+    float GetDuration()
+    {
+        if(playableSamples || !index.ready || !SampleRate) return duration;
+        return (float)index.totalSamples / (float)SampleRate;
+    }
+    uint64_t GetTotalSamples()
+    {
+        if(playableSamples) return playableSamples;
+        WaitIndex();
+        return index.totalSamples;
+    }
+    // Binary search in the frame index, then decode just enough earlier frames
+    // to rebuild the bit reservoir and synthesis state before sample. While the
+    // index is still being built the VBR header's seek table is used instead,
+    // or without one the first frame's bitrate, so a seek does not wait for
+    // the scan. Samples count from the first one left after gapless trimming.
+    bool SeekToSample(uint64_t sample)
+    {
+        remainingSamples = playableSamples ? (int64_t)(playableSamples - min(sample, playableSamples)) : -1;
+        sample += vbr.StartTrim();
+        if(!index.ready && (vbr.seekPoints.empty() ? SeekWithBitrate(sample) : SeekWithToc(sample))) return true;
+        // Only an estimate that lands past the end waits for the scan.
+        WaitIndex();
+        if(index.frames.empty()) return false;
+        size_t k = index.Find(sample);
+        size_t p = index.PrerollStart(data, k);
+        mp3dec_init(&mp3d);
+        playCursor = index.frames[p].offset;
+        leftfilesize = audioEnd - playCursor;
+        mapping.Advise(playCursor, WindowSize, MADV_WILLNEED);
+        releasedCursor = playCursor;
+        for(; p < k; ++p)
+        {
+            mp3dec_decode_frame(&mp3d, &data[playCursor], leftfilesize, pcm, &info);
+            if(!info.frame_bytes) break;
+            playCursor += info.frame_bytes;
+            leftfilesize -= info.frame_bytes;
+        }
+        skipSamples = (int)(min(sample, index.totalSamples) - index.frames[k].sample);
+        total_samples = (int64_t)sample * max(info.channels, 1);
+        pcmCursor = 0;
+        pcmSamples = 0;
+        isNoMoreData = false;
+        return true;
+    }
+    // Coarse seek: interpolate the position from the encoder's table and resync
+    // on the next frame header. The decoder sits out the first frames until its
+    // bit reservoir fills, so the landing point is approximate.
+    bool SeekWithToc(uint64_t sample)
+    {
+        const Mp3FrameIndex::Entry& point = vbr.seekPoints[Mp3FrameIndex::Find(vbr.seekPoints, sample)];
+        return SeekNear(max(audioStart, headerFrame + point.offset), point.sample, sample);
+    }
+    // Same for files with no table at all, CBR ones mostly: the first frame's
+    // bitrate puts the frame holding sample at its number times the average
+    // frame size. Free format frames have no bitrate, their size is used.
+    bool SeekWithBitrate(uint64_t sample)
+    {
+        if(audioStart + HDR_SIZE >= audioEnd) return false;
+        const unsigned char* h = data + audioStart;
+        uint64_t frameSamples = hdr_frame_samples(h);
+        double frameBytes = (double)frameSamples * hdr_bitrate_kbps(h) * 125 / hdr_sample_rate_hz(h);
+        if(!hdr_bitrate_kbps(h))
+        {
+            int freeFormatBytes = 0, bytes = 0;
+            mp3d_find_frame(h, (int)min(audioEnd - audioStart, (size_t)INT32_MAX), &freeFormatBytes, &bytes);
+            frameBytes = bytes;
+        }
+        if(frameBytes <= 0) return false;
+        int mainData = Mp3FrameIndex::MainDataBytes(h, (int)frameBytes);
+        if(mainData <= 0) return false;
+        // Enough frames earlier that the bit reservoir is full again by the
+        // one wanted, as in PrerollStart. Padding moves real frames a byte off
+        // the average, so the resync starts half a frame early to land on the
+        // first of them.
+        uint64_t frame = sample / frameSamples;
+        frame -= min(frame, (uint64_t)(MAX_BITRESERVOIR_BYTES / mainData) + 2);
+        size_t offset = audioStart + (size_t)max(frame * frameBytes - frameBytes / 2, 0.0);
+        return SeekNear(offset, frame * frameSamples, sample);
+    }
+    // Resyncs on the first frame header from offset, taken to start at
+    // pointSample, and skips from there to sample.
+    bool SeekNear(size_t offset, uint64_t pointSample, uint64_t sample)
+    {
+        if(offset + HDR_SIZE >= audioEnd) return false;
+        int freeFormatBytes = 0, frameBytes = 0;
+        offset += mp3d_find_frame(&data[offset], (int)min(audioEnd - offset, (size_t)INT32_MAX), &freeFormatBytes, &frameBytes);
+        if(!frameBytes) return false;
+        mp3dec_init(&mp3d);
+        playCursor = (int)offset;
+        leftfilesize = audioEnd - offset;
+        mapping.Advise(playCursor, WindowSize, MADV_WILLNEED);
+        releasedCursor = playCursor;
+        skipSamples = (int)(sample - pointSample);
+        total_samples = (int64_t)sample * max(info.channels, 1);
+        pcmCursor = 0;
+        pcmSamples = 0;
+        isNoMoreData = false;
+        return true;
+    }
+    bool GetNextFrame()
+    {
+        while(1)
+        {
+            if(floatOutput) samples = mp3dec_decode_frame_float(&mp3d, &data[playCursor], leftfilesize, &pcmf[pcmCursor], &info);
+            else samples = mp3dec_decode_frame(&mp3d, &data[playCursor], leftfilesize, &pcm[pcmCursor], &info);
+            if(samples && skipSamples)
+            {
+                // Left over from a seek, drop the head of the frame.
+                int drop = min(samples, skipSamples);
+                if(floatOutput) memmove(&pcmf[pcmCursor], &pcmf[pcmCursor + drop * info.channels], (samples - drop) * info.channels * sizeof(float));
+                else memmove(&pcm[pcmCursor], &pcm[pcmCursor + drop * info.channels], (samples - drop) * info.channels * sizeof(short));
+                samples -= drop;
+                skipSamples -= drop;
+            }
+            else if(!samples && info.frame_bytes && skipSamples)
+            {
+                // Sat out for want of bit reservoir after a coarse seek, the
+                // frame still takes its place in time.
+                skipSamples -= min(skipSamples, (int)hdr_frame_samples(&data[playCursor]));
+            }
+            if(samples && remainingSamples >= 0)
+            {
+                // Gapless: the encoder padding at the end is not played.
+                samples = (int)min((int64_t)samples, remainingSamples);
+                remainingSamples -= samples;
+            }
+            if(samples)
+            { 
+                pcmCursor += samples * info.channels;
+                total_samples += samples * info.channels;
+            }
+            playCursor  += info.frame_bytes;
+            leftfilesize -= info.frame_bytes;
+            // printf("samples=%d, total_samples=%d, hz:%d, bitrate_kbps:%d  frame_bytes:%d playCursor:%d, leftfilesize:%ld \n"
+                // , samples, total_samples, info.hz, info.bitrate_kbps, info.frame_bytes, playCursor, leftfilesize);
+            if(pcmCursor + MINIMP3_MAX_SAMPLES_PER_FRAME > MINIMP3_MAX_SAMPLES_PER_FRAME * 40) break;
+            if(!info.frame_bytes || !remainingSamples) break;
+        }
+        pcmSamples = pcmCursor;
+        pcmCursor = 0;
+        isNoMoreData = !info.frame_bytes || !remainingSamples;
+        if(playCursor - releasedCursor >= WindowSize)
+        {
+            mapping.Release(releasedCursor, playCursor - releasedCursor);
+            mapping.Advise(playCursor, WindowSize, MADV_WILLNEED);
+            releasedCursor = playCursor;
+        }
+        return !isNoMoreData;
+    }
+    // What the last GetNextFrame produced, in either output format.
+    const char* GetPcm()
+    {
+        return floatOutput ? (const char*)pcmf.data() : (const char*)pcm;
+    }
+    int GetPcmBytes()
+    {
+        return pcmSamples * (floatOutput ? sizeof(float) : sizeof(short));
+    }
+    ~Mp3File()
+    {
+        index.cancel = true;
+        WaitIndex();
+        data = nullptr;
+    }
+
+    // Bytes of the file kept resident ahead of the decoder.
+    static const int WindowSize = 1 << 20;
+
+    mp3dec_t mp3d;
+
+    MappedFile mapping;
+    size_t filesize;
+    size_t leftfilesize; // up to audioEnd
+    Mp3Tags tags;
+    size_t audioEnd;     // first byte of the trailing tags
+    int playCursor;
+    int releasedCursor; // pages before this have been handed back
+    const unsigned char* data;
+    mp3dec_frame_info_t info;
+    int samples;
+    int64_t total_samples = 0; // interleaved, passes INT_MAX after ~6.7 h of 44.1 kHz stereo
+
+    short pcm[MINIMP3_MAX_SAMPLES_PER_FRAME * 40];
+    bool floatOutput;
+    vector<float> pcmf; // used instead of pcm with floatOutput
+    int  pcmCursor;
+    int  pcmSamples; // valid samples in pcm after GetNextFrame
+    bool isNoMoreData;
+    int  skipSamples; // still to drop, after a seek or for the encoder delay
+    int64_t remainingSamples; // still to play, -1 when the length is unknown
+
+    Mp3VbrHeader vbr;
+    size_t headerFrame; // first frame in the file
+    size_t audioStart;  // first frame with audio
+    uint64_t playableSamples; // from the VBR header after trimming, 0 if unknown
+
+    Mp3FrameIndex index;
+    thread indexThread;
+    int bufferSize;
+
+    int SampleRate;
+    float duration;
+};
+
+const char* showTime(float seconds,int num, char* buff)
+{
+    assert(buff);
+    memset(buff, 0x00, num);
+    int minutes = seconds / 60;
+    int sec = seconds - minutes * 60;
+    sprintf(buff, "%02d:%02d", minutes, sec);
+    return buff;
+}
+
+class Mp3Player : public StreamPlayer
+{
+public:
+    Mp3Player(){}
+    Mp3Player(const char* file, bool persistIndex = false, bool floatOutput = false)
+    {
+        Setup(file, persistIndex, floatOutput);
+    }
+    ~Mp3Player()
+    {
+        StopDecoder();
+    }
+    // floatOutput skips the rounding to 16 bit when the device takes
+    // AL_EXT_FLOAT32 buffers, otherwise the float PCM is converted for upload.
+    void Setup(const char* filename, bool persistIndex = false, bool floatOutput = false)
+    {
+        mp3f.Setup(filename, persistIndex, floatOutput);
+        // Mp3File::Setup already decoded the first batch to learn the format.
+        isPending = true;
+        bool ok = converter.Setup(max(mp3f.info.channels, 1), floatOutput ? 32 : 16, floatOutput);
+        assert(ok);
+        StartStreaming(mp3f.SampleRate, 3);
+    }
+    int FillBuffer()
+    {
+        int filled = StreamPlayer::FillBuffer();
+        if(filled)
+        {
+            char buf1[32], buf2[32];
+            printf("current progress: %s/%s\n", showTime(GetProgress(), 32, buf1), showTime(GetDuration(), 32, buf2));
+        }
+        return filled;
+    }
+    float GetProgress()
+    {
+        return (float)queuedBytes / (float)bytesPerSecond;
+    }
+    float GetDuration()
+    {
+        return mp3f.GetDuration();
+    }
+    bool Seek(float seconds)
+    {
+        lock_guard<mutex> lock(streamMutex);
+        bool wasPlaying = als.IsPlaying();
+        FlushStream();
+        uint64_t sample = (uint64_t)(max(seconds, 0.0f) * mp3f.SampleRate);
+        bool ok = mp3f.SeekToSample(sample);
+        if(ok) isPending = false;
+        else sample = queuedBytes / (bytesPerSecond / mp3f.SampleRate);
+        ResumeStream(sample * (bytesPerSecond / mp3f.SampleRate), wasPlaying);
+        return ok;
+    }
+
+    Mp3File mp3f;
+
+protected:
+    bool Decode()
+    {
+        if(!isPending) mp3f.GetNextFrame();
+        isPending = false;
+        if(!Produce(mp3f.GetPcm(), mp3f.GetPcmBytes())) return false;
+        return !mp3f.isNoMoreData;
+    }
+
+    bool isPending;
+};
+
+// Decodes a whole MP3 to interleaved PCM on several cores, for offline jobs.
+// The file is cut at frame boundaries from Mp3FrameIndex. Each worker first
+// decodes the frames before its segment that the bit reservoir and IMDCT
+// overlap depend on and drops that output, so the stitched result is
+// bit-identical to the serial mp3dec_decode_frame loop of minimp3_test.c.
+class Mp3BatchDecoder
+{
+public:
+    Mp3BatchDecoder() : channels(0), sampleRate(0) {}
+
+    bool Decode(const char* filename, int threads)
+    {
+        pcm.clear();
+        MappedFile mapping;
+        if(!mapping.Open(filename)) return false;
+        mapping.Advise(0, mapping.size, MADV_WILLNEED);
+        Mp3Tags tags;
+        tags.Parse(mapping.base, mapping.size);
+        if(threads <= 1) return DecodeSerial(mapping.base, tags.begin, tags.end);
+        Mp3FrameIndex index;
+        index.Build(mapping, tags.begin, tags.end);
+        size_t frames = index.frames.size();
+        if(!frames) return false;
+
+        threads = max(1, min(threads, (int)(frames / MinSegmentFrames)));
+        vector<vector<short>> parts(threads);
+        vector<Segment> segments(threads);
+        vector<thread> workers;
+        vector<size_t> cuts(threads + 1, frames);
+        for(int t = 0; t < threads; t++)
+        {
+            size_t k = max(frames * t / threads, t ? cuts[t - 1] + 1 : 0);
+            while(k < frames && !FollowsDirectly(mapping.base, index, k)) ++k;
+            cuts[t] = min(k, frames);
+        }
+        for(int t = 0; t < threads; t++)
+        {
+            Segment& seg = segments[t];
+            seg.first = cuts[t];
+            seg.last = cuts[t + 1];
+            if(t) workers.emplace_back([&, t]{ DecodeSegment(mapping, tags.end, index, segments[t], parts[t]); });
+        }
+        DecodeSegment(mapping, tags.end, index, segments[0], parts[0]);
+        for(auto& w : workers) w.join();
+
+        bool stitched = true;
+        size_t total = 0;
+        for(int t = 0; t < threads; t++)
+        {
+            stitched = stitched && segments[t].ok;
+            total += parts[t].size();
+        }
+        if(!stitched)
+        {
+            // A segment did not land on its frame boundaries (garbage between
+            // frames fooled the index) or started with its bit reservoir
+            // short, only a serial pass is safe.
+            return DecodeSerial(mapping.base, tags.begin, tags.end);
+        }
+        pcm.reserve(total);
+        for(int t = 0; t < threads; t++)
+        {
+            pcm.insert(pcm.end(), parts[t].begin(), parts[t].end());
+            vector<short>().swap(parts[t]);
+        }
+        channels = segments[0].channels;
+        sampleRate = segments[0].sampleRate;
+        return true;
+    }
+
+    // Fewer frames than this per thread are not worth the pre-roll.
+    static const size_t MinSegmentFrames = 64;
+
+    vector<short> pcm;
+    int channels;
+    int sampleRate;
+
+private:
+    struct Segment
+    {
+        Segment() : first(0), last(0), ok(false), channels(0), sampleRate(0) {}
+        size_t first, last; // frames whose output is kept
+        bool ok;
+        int channels;
+        int sampleRate;
+    };
+
+    // The serial loop only passes a frame's start when nothing was skipped
+    // right before it, so segments start at such frames.
+    static bool FollowsDirectly(const unsigned char* data, Mp3FrameIndex& index, size_t k)
+    {
+        if(!k) return true;
+        const unsigned char* h = data + index.frames[k - 1].offset;
+        int frameBytes = hdr_frame_bytes(h, 0);
+        return !frameBytes || index.frames[k - 1].offset + frameBytes + hdr_padding(h) == index.frames[k].offset;
+    }
+    bool DecodeSerial(const unsigned char* data, size_t pos, size_t end)
+    {
+        mp3dec_t dec;
+        mp3dec_frame_info_t info;
+        short frame[MINIMP3_MAX_SAMPLES_PER_FRAME];
+        mp3dec_init(&dec);
+        while(pos < end)
+        {
+            int samples = mp3dec_decode_frame(&dec, data + pos, (int)min(end - pos, (size_t)INT32_MAX), frame, &info);
+            if(!info.frame_bytes) break;
+            pos += info.frame_bytes;
+            if(!samples) continue;
+            channels = info.channels;
+            sampleRate = info.hz;
+            pcm.insert(pcm.end(), frame, frame + samples * info.channels);
+        }
+        return !pcm.empty();
+    }
+    static void DecodeSegment(MappedFile& mapping, size_t end, Mp3FrameIndex& index, Segment& seg, vector<short>& out)
+    {
+        seg.ok = seg.first >= seg.last;
+        if(seg.ok) return;
+        const unsigned char* data = mapping.base;
+        size_t keepFrom = index.frames[seg.first].offset;
+        size_t stop = seg.last < index.frames.size() ? index.frames[seg.last].offset : end;
+        size_t pos = index.frames[index.PrerollStart(data, seg.first)].offset;
+        mp3dec_t dec;
+        mp3dec_frame_info_t info;
+        short frame[MINIMP3_MAX_SAMPLES_PER_FRAME];
+        mp3dec_init(&dec);
+        out.reserve((seg.last - seg.first) * MINIMP3_MAX_SAMPLES_PER_FRAME);
+        bool landed = false;
+        // A layer III frame whose bit reservoir is short decodes to nothing.
+        // Past the first segment the frame before the kept ones and the first
+        // kept one must both decode, or the pre-roll was too short.
+        bool primed = !seg.first;
+        int lastSamples = 0;
+        while(pos < stop)
+        {
+            // The serial loop steps from frame to frame the same way, so this
+            // segment lines up with its neighbours only if it hits their edges.
+            if(!landed && pos == keepFrom)
+            {
+                landed = true;
+                primed = primed || lastSamples;
+            }
+            if(!landed && pos > keepFrom) break;
+            int samples = mp3dec_decode_frame(&dec, data + pos, (int)min(end - pos, (size_t)INT32_MAX), frame, &info);
+            if(!info.frame_bytes) break;
+            if(landed && pos == keepFrom) primed = primed && samples;
+            pos += info.frame_bytes;
+            lastSamples = samples;
+            if(!landed || !samples) continue;
+            if(!seg.channels)
+            {
+                seg.channels = info.channels;
+                seg.sampleRate = info.hz;
+            }
+            out.insert(out.end(), frame, frame + samples * info.channels);
+        }
+        seg.ok = landed && primed && (pos == stop || (pos >= end && stop == end));
+    }
+};
+
+// Batch decode timings for 1, 2, 4... threads against the serial loop. The
+// threaded runs include building the frame index.
+int benchMp3Decode(const char* filename)
+{
+    int cores = max(1, (int)thread::hardware_concurrency());
+    Mp3BatchDecoder serial;
+    auto t0 = chrono::steady_clock::now();
+    if(!serial.Decode(filename, 1))
+    {
+        printf("cannot decode %s\n", filename);
+        return 1;
+    }
+    double base = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    double audio = serial.sampleRate ? (double)serial.pcm.size() / serial.channels / serial.sampleRate : 0;
+    printf("%s: %.1f s of audio, %d cores\n", filename, audio, cores);
+    printf("threads  seconds  x realtime  speedup  identical\n");
+    printf("%7d  %7.3f  %10.1f  %7.2f  %9s\n", 1, base, audio / base, 1.0, "-");
+    bool allSame = true;
+    for(int threads = 2; threads <= max(16, cores); threads *= 2)
+    {
+        Mp3BatchDecoder batch;
+        t0 = chrono::steady_clock::now();
+        batch.Decode(filename, threads);
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        bool same = batch.pcm == serial.pcm;
+        allSame = allSame && same;
+        printf("%7d  %7.3f  %10.1f  %7.2f  %9s\n", threads, secs, audio / secs, base / secs, same ? "yes" : "NO");
+    }
+    return allSame ? 0 : 1;
+}
+
+
+// A FLAC file decoded by dr_flac straight out of a read-only mapping. The
+// callbacks hand back the pages behind the decoder the same way Mp3File does,
+// so only the compressed window around the read position stays resident.
+class FlacFile
+{
+public:
+    FlacFile() : flac(nullptr) {}
+    FlacFile(const char* filename) : flac(nullptr)
+    {
+        Setup(filename);
+    }
+    FlacFile(const FlacFile&) = delete;
+    void Setup(const char* filename)
+    {
+        bool opened = Open(filename);
+        assert(opened);
+    }
+    bool Open(const char* filename)
+    {
+        Close();
+        if(!mapping.Open(filename)) return false;
+        mapping.Advise(0, mapping.size, MADV_SEQUENTIAL);
+        mapping.Advise(0, WindowSize, MADV_WILLNEED);
+        cursor = 0;
+        releasedCursor = 0;
+        flac = drflac_open(OnRead, OnSeek, this);
+        if(!flac) return false;
+        channels = flac->channels;
+        sampleRate = flac->sampleRate;
+        bitsPerSample = flac->bitsPerSample;
+        totalFrames = flac->totalSampleCount / max(channels, 1);
+        duration = sampleRate ? (float)totalFrames / (float)sampleRate : 0;
+        SetFloatOutput(false);
+        pcmBytes = 0;
+        isNoMoreData = false;
+        return true;
+    }
+    // Up to 16 bit the s16 reader is exact, deeper files keep all their bits
+    // in s32, or come out as float when that is what gets uploaded.
+    void SetFloatOutput(bool on)
+    {
+        isFloat = on;
+        bytesPerSample = isFloat || bitsPerSample > 16 ? 4 : 2;
+        pcm.resize(BlockFrames * channels * bytesPerSample);
+    }
+    // Decodes up to frames frames into out in the output format, returns how
+    // many there were. dr_flac decorrelates, converts and interleaves stereo
+    // in one pass, so out can be the upload memory itself.
+    int ReadFrames(void* out, int frames)
+    {
+        drflac_uint64 wanted = (drflac_uint64)frames * channels;
+        drflac_uint64 got;
+        if(isFloat) got = drflac_read_f32(flac, wanted, (float*)out);
+        else if(bytesPerSample == 4) got = drflac_read_s32(flac, wanted, (drflac_int32*)out);
+        else got = drflac_read_s16(flac, wanted, (drflac_int16*)out);
+        isNoMoreData = got < wanted;
+        return (int)(got / channels);
+    }
+    // Decodes the next BlockFrames frames, or what is left of them, into pcm.
+    bool GetNextBlock()
+    {
+        pcmBytes = ReadFrames(pcm.data(), BlockFrames) * channels * bytesPerSample;
+        return !isNoMoreData;
+    }
+    // dr_flac looks the frame up in the SEEKTABLE block and decodes forward
+    // from the closest seek point, without one it has to walk every frame
+    // header from the start.
+    bool SeekToFrame(uint64_t frame)
+    {
+        if(!totalFrames) return false;
+        frame = min(frame, totalFrames - 1);
+        if(!drflac_seek_to_sample(flac, frame * channels)) return false;
+        isNoMoreData = false;
+        return true;
+    }
+    // Decodes the first valid frame at or after byte offset, found by its
+    // sync code, and leaves its samples for the next drflac_read_*. Returns
+    // the first PCM frame it holds, -1 when there is none.
+    int64_t DecodeFrameAt(uint64_t offset)
+    {
+        if(!offset || !drflac__seek_to_byte(&flac->bs, offset)) return -1;
+        drflac_zero_memory(&flac->currentFrame, sizeof(flac->currentFrame));
+        if(!drflac__read_and_decode_next_frame(flac)) return -1;
+        drflac_uint64 first;
+        drflac__get_current_frame_sample_range(flac, &first, nullptr);
+        isNoMoreData = false;
+        return (int64_t)(first / channels);
+    }
+    void Close()
+    {
+        if(flac) drflac_close(flac);
+        flac = nullptr;
+        mapping.Close();
+    }
+    ~FlacFile()
+    {
+        Close();
+    }
+
+    // Bytes of the file kept resident ahead of the decoder.
+    static const int WindowSize = 1 << 20;
+    // Frames decoded per GetNextBlock.
+    static const int BlockFrames = 4096;
+
+    drflac* flac;
+    MappedFile mapping;
+    int channels;
+    int sampleRate;
+    int bitsPerSample;
+    int bytesPerSample; // in pcm, 2 or 4
+    bool isFloat; // pcm holds floats rather than s32
+    uint64_t totalFrames;
+    float duration;
+
+    vector<char> pcm;
+    int pcmBytes; // valid bytes in pcm after GetNextBlock
+    bool isNoMoreData;
+
+private:
+    static size_t OnRead(void* userData, void* bufferOut, size_t bytesToRead)
+    {
+        FlacFile* self = (FlacFile*)userData;
+        size_t n = min(bytesToRead, self->mapping.size - self->cursor);
+        memcpy(bufferOut, self->mapping.base + self->cursor, n);
+        self->cursor += n;
+        if(self->cursor - self->releasedCursor >= (size_t)WindowSize)
+        {
+            self->mapping.Release(self->releasedCursor, self->cursor - self->releasedCursor);
+            self->mapping.Advise(self->cursor, WindowSize, MADV_WILLNEED);
+            self->releasedCursor = self->cursor;
+        }
+        return n;
+    }
+    static drflac_bool32 OnSeek(void* userData, int offset, drflac_seek_origin origin)
+    {
+        FlacFile* self = (FlacFile*)userData;
+        size_t target = origin == drflac_seek_origin_start ? 0 : self->cursor;
+        if(offset < 0 ? (size_t)-(int64_t)offset > target : (size_t)offset > self->mapping.size - target) return DRFLAC_FALSE;
+        target += offset;
+        // Forward skips over metadata stay in the window, jumps start a new one.
+        if(target < self->releasedCursor || target - self->releasedCursor >= (size_t)WindowSize)
+        {
+            self->mapping.Advise(target, WindowSize, MADV_WILLNEED);
+            self->releasedCursor = target;
+        }
+        self->cursor = target;
+        return DRFLAC_TRUE;
+    }
+
+    size_t cursor;
+    size_t releasedCursor; // pages before this have been handed back
+};
+
+// Streams lossless music through the same queue as MusicPlayer, at roughly
+// half the disk and page cache footprint of the equivalent WAV.
+class FlacPlayer : public StreamPlayer
+{
+public:
+    FlacPlayer(){}
+    FlacPlayer(const char* file)
+    {
+        Setup(file);
+    }
+    ~FlacPlayer()
+    {
+        StopDecoder();
+    }
+    void Setup(const char* filename)
+    {
+        flacf.Setup(filename);
+        if(!converter.Setup(flacf.channels, flacf.bytesPerSample * 8, false))
+        {
+            printf("%s: unsupported format, %d channels, %d bits\n", filename, flacf.channels, flacf.bitsPerSample);
+            assert(false);
+        }
+        // Deep files going up as float are decoded to float directly, so
+        // every layout the device takes as it is skips the converter.
+        if(converter.outBits == 32 && converter.outChannels == flacf.channels)
+        {
+            flacf.SetFloatOutput(true);
+            converter.Setup(flacf.channels, 32, true);
+        }
+        StartStreaming(flacf.sampleRate, 3);
+    }
+    float GetProgress()
+    {
+        return (float)queuedBytes / (float)bytesPerSecond;
+    }
+    float GetDuration()
+    {
+        return flacf.duration;
+    }
+    bool Seek(float seconds)
+    {
+        lock_guard<mutex> lock(streamMutex);
+        bool wasPlaying = als.IsPlaying();
+        FlushStream();
+        uint64_t frame = (uint64_t)(max(seconds, 0.0f) * flacf.sampleRate);
+        bool ok = flacf.SeekToFrame(frame);
+        if(!ok) frame = queuedBytes / (bytesPerSecond / flacf.sampleRate);
+        ResumeStream(frame * (bytesPerSecond / flacf.sampleRate), wasPlaying);
+        return ok;
+    }
+
+    FlacFile flacf;
+
+protected:
+    bool Decode()
+    {
+        // Straight into the ring, unless the converter has work to do or the
+        // free space wraps in the middle of a frame.
+        if(converter.passThrough)
+        {
+            int frameBytes = flacf.channels * flacf.bytesPerSample;
+            int size;
+            char* dst = ProduceSpan(FlacFile::BlockFrames * frameBytes, size);
+            if(!dst) return false;
+            int frames = min(size / frameBytes, (int)FlacFile::BlockFrames);
+            if(frames > 0)
+            {
+                CommitProduce(flacf.ReadFrames(dst, frames) * frameBytes);
+                return !flacf.isNoMoreData;
+            }
+        }
+        flacf.GetNextBlock();
+        if(flacf.pcmBytes && !Produce(flacf.pcm.data(), flacf.pcmBytes)) return false;
+        return !flacf.isNoMoreData;
+    }
+};
+
+// Decodes a whole FLAC file to interleaved s32 PCM on several cores, for
+// offline jobs. FLAC frames carry no state from one to the next, so the file
+// is cut at frame boundaries (seek points when there is a SEEKTABLE, sync
+// codes found from evenly spaced bytes otherwise) and every worker decodes its
+// range straight into its slice of one preallocated output. The result is
+// identical to one drflac_read_s32 over the whole file.
+class FlacBatchDecoder
+{
+public:
+    FlacBatchDecoder() : channels(0), sampleRate(0), bitsPerSample(0) {}
+
+    bool Decode(const char* filename, int threads)
+    {
+        pcm.clear();
+        FlacFile head;
+        if(!head.Open(filename)) return false;
+        channels = head.channels;
+        sampleRate = head.sampleRate;
+        bitsPerSample = head.bitsPerSample;
+        uint64_t frames = head.totalFrames;
+        // Without the length in STREAMINFO there is nothing to slice.
+        if(threads <= 1 || !frames) return DecodeSerial(head);
+        head.mapping.Advise(0, head.mapping.size, MADV_WILLNEED);
+
+        threads = (int)max((uint64_t)1, min((uint64_t)threads, frames / head.flac->maxBlockSize / MinSegmentBlocks));
+        vector<Cut> cuts = FindCuts(head, threads);
+        pcm.resize(frames * channels);
+        vector<char> ok(cuts.size() - 1, 0);
+        vector<thread> workers;
+        for(size_t t = 1; t + 1 < cuts.size(); t++)
+        {
+            workers.emplace_back([&, t]{ ok[t] = DecodeSegment(filename, cuts[t], cuts[t + 1].frame); });
+        }
+        ok[0] = DecodeSegment(filename, cuts[0], cuts[1].frame);
+        for(auto& w : workers) w.join();
+
+        if(find(ok.begin(), ok.end(), 0) != ok.end())
+        {
+            // A segment did not end on its neighbour's first frame, so frames
+            // were lost to CRC errors and only a serial pass gives the same output.
+            pcm.clear();
+            return DecodeSerial(head);
+        }
+        return true;
+    }
+
+    // Fewer blocks than this per thread are not worth a thread.
+    static const uint64_t MinSegmentBlocks = 16;
+
+    vector<int32_t> pcm;
+    int channels;
+    int sampleRate;
+    int bitsPerSample;
+
+private:
+    struct Cut
+    {
+        uint64_t offset; // byte the sync search starts from
+        uint64_t frame;  // first PCM frame of the FLAC frame found there
+    };
+
+    // Cuts spread over the file, each checked by decoding the frame it lands
+    // on. The last entry only marks the end of the stream.
+    vector<Cut> FindCuts(FlacFile& head, int threads)
+    {
+        drflac* flac = head.flac;
+        uint64_t frames = head.totalFrames;
+        vector<Cut> points;
+        if(flac->seektablePos && flac->seektablePos + flac->seektableSize <= head.mapping.size)
+        {
+            const unsigned char* p = head.mapping.base + flac->seektablePos;
+            for(uint32_t i = 0; i + 18 <= flac->seektableSize; i += 18)
+            {
+                uint64_t sample = ReadBE64(p + i), offset = ReadBE64(p + i + 8);
+                if(sample == ~0ULL) continue; // placeholder
+                points.push_back({ flac->firstFramePos + offset, sample });
+            }
+        }
+        vector<Cut> cuts(1, { flac->firstFramePos, 0 });
+        for(int t = 1; t < threads; t++)
+        {
+            uint64_t target = frames * t / threads;
+            Cut cut = { flac->firstFramePos + (head.mapping.size - flac->firstFramePos) * t / threads, target };
+            for(const Cut& point : points)
+            {
+                if(point.frame > target) break;
+                if(point.frame > cuts.back().frame) cut = point;
+            }
+            int64_t found = head.DecodeFrameAt(cut.offset);
+            if(found > (int64_t)cuts.back().frame && (uint64_t)found < frames) cuts.push_back({ cut.offset, (uint64_t)found });
+        }
+        cuts.push_back({ head.mapping.size, frames });
+        return cuts;
+    }
+    static uint64_t ReadBE64(const unsigned char* p)
+    {
+        uint64_t v = 0;
+        for(int i = 0; i < 8; i++) v = (v << 8) | p[i];
+        return v;
+    }
+    bool DecodeSerial(FlacFile& f)
+    {
+        const drflac_uint64 chunk = (drflac_uint64)FlacFile::BlockFrames * channels;
+        drflac_seek_to_sample(f.flac, 0);
+        if(f.totalFrames) pcm.resize(f.totalFrames * channels);
+        size_t filled = 0;
+        for(;;)
+        {
+            if(pcm.size() < filled + chunk) pcm.resize(filled + chunk);
+            drflac_uint64 got = drflac_read_s32(f.flac, pcm.size() - filled, &pcm[filled]);
+            filled += (size_t)got;
+            if(!got || filled < pcm.size()) break;
+        }
+        pcm.resize(filled);
+        return filled > 0;
+    }
+    // Each worker has its own decoder and mapping of the file, the pages are
+    // shared through the page cache.
+    bool DecodeSegment(const char* filename, const Cut& from, uint64_t end)
+    {
+        FlacFile f;
+        if(!f.Open(filename) || f.DecodeFrameAt(from.offset) != (int64_t)from.frame) return false;
+        drflac_uint64 wanted = (end - from.frame) * channels;
+        if(drflac_read_s32(f.flac, wanted, &pcm[from.frame * channels]) != wanted) return false;
+        // A frame skipped for a bad CRC would have pulled in samples of the next segment.
+        drflac_uint64 last;
+        drflac__get_current_frame_sample_range(f.flac, nullptr, &last);
+        return !f.flac->currentFrame.samplesRemaining && last + 1 == end * channels;
+    }
+};
+
+// Same table as benchMp3Decode for FlacBatchDecoder, then the SIMD levels
+// checked against the scalar decode.
+int benchFlacDecode(const char* filename)
+{
+    int cores = max(1, (int)thread::hardware_concurrency());
+    FlacBatchDecoder serial;
+    auto t0 = chrono::steady_clock::now();
+    if(!serial.Decode(filename, 1))
+    {
+        printf("cannot decode %s\n", filename);
+        return 1;
+    }
+    double base = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    double audio = serial.sampleRate ? (double)serial.pcm.size() / serial.channels / serial.sampleRate : 0;
+    printf("%s: %.1f s of audio, %d cores\n", filename, audio, cores);
+    printf("threads  seconds  x realtime  speedup  identical\n");
+    printf("%7d  %7.3f  %10.1f  %7.2f  %9s\n", 1, base, audio / base, 1.0, "-");
+    bool allSame = true;
+    for(int threads = 2; threads <= max(16, cores); threads *= 2)
+    {
+        FlacBatchDecoder batch;
+        t0 = chrono::steady_clock::now();
+        batch.Decode(filename, threads);
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        bool same = batch.pcm == serial.pcm;
+        allSame = allSame && same;
+        printf("%7d  %7.3f  %10.1f  %7.2f  %9s\n", threads, secs, audio / secs, base / secs, same ? "yes" : "NO");
+    }
+#ifdef DRFLAC_SUPPORT_SSE41
+    // Then each LPC and interleave level the CPU has, forced on a decoder of
+    // its own. They do the same integer math, so every level has to give the
+    // samples above exactly. drflac_open sets the caps again, so they are
+    // forced after it and put back at the end.
+    static const char* names[] = { "scalar", "sse4.1", "avx2" };
+    drflac_bool32 hasSSE41 = drflac__gIsSSE41Supported;
+    drflac_bool32 hasAVX2 = drflac__gIsAVX2Supported;
+    int levels = hasAVX2 ? 3 : hasSSE41 ? 2 : 1;
+    double scalarSecs = 0;
+    printf("%d bits per sample\n", serial.bitsPerSample);
+    printf("level   seconds  speedup  identical\n");
+    for(int level = 0; level < levels; level++)
+    {
+        FlacFile f;
+        if(!f.Open(filename))
+        {
+            allSame = false;
+            break;
+        }
+        drflac__gIsSSE41Supported = level >= 1;
+        drflac__gIsAVX2Supported = level >= 2;
+        vector<int32_t> pcm(serial.pcm.size() + serial.channels);
+        t0 = chrono::steady_clock::now();
+        pcm.resize((size_t)drflac_read_s32(f.flac, pcm.size(), pcm.data()));
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        if(level == 0) scalarSecs = secs;
+        bool same = pcm == serial.pcm;
+        allSame = allSame && same;
+        printf("%-6s  %7.3f  %7.2f  %9s\n", names[level], secs, scalarSecs / secs, same ? "yes" : "NO");
+    }
+    drflac__gIsSSE41Supported = hasSSE41;
+    drflac__gIsAVX2Supported = hasAVX2;
+#endif
+    return allSame ? 0 : 1;
+}
+
+// Reads a file front to back on its own thread, in large blocks, into a ring
+// the consumer copies from, so a slow disk or network mount holds up the
+// reader instead of the decoder. With looping set the reader goes on at
+// loopFrom once it reaches the end, lap after lap.
+class ReadAheadFile
+{
+public:
+    ReadAheadFile() : size(0), stalls(0), looping(false), loopFrom(0), fd(-1), cursor(0), readCursor(0), stopReading(true), readDone(true) {}
+    ReadAheadFile(const ReadAheadFile&) = delete;
+    ~ReadAheadFile()
+    {
+        Close();
+    }
+    bool Open(const char* filename)
+    {
+        Close();
+        fd = open(filename, O_RDONLY);
+        if(fd < 0) return false;
+        struct stat st;
+        if(fstat(fd, &st) != 0 || st.st_size <= 0)
+        {
+            Close();
+            return false;
+        }
+        size = (uint64_t)st.st_size;
+        ring.Setup(Capacity);
+        return true;
+    }
+    void Close()
+    {
+        Stop();
+        if(fd >= 0) close(fd);
+        fd = -1;
+        size = 0;
+    }
+    // Reads from offset on, whatever was read ahead is thrown away.
+    void Start(uint64_t offset)
+    {
+        Stop();
+        ring.Reset();
+        cursor = offset;
+        readCursor = offset;
+        stopReading = false;
+        readDone = false;
+        reader = thread(&ReadAheadFile::ReadLoop, this);
+    }
+    void Stop()
+    {
+        {
+            lock_guard<mutex> lock(readMutex);
+            stopReading = true;
+        }
+        readCv.notify_all();
+        if(reader.joinable()) reader.join();
+    }
+    void SetLooping(bool loop, uint64_t from)
+    {
+        loopFrom = from;
+        looping = loop && from < size;
+    }
+    bool IsLooping()
+    {
+        return looping;
+    }
+    // Consumer side: up to size bytes, waits for the reader only when nothing
+    // has been read ahead. Stops at the end of the file and returns 0 there,
+    // NextLap() goes on from loopFrom.
+    int Read(char* dst, int n)
+    {
+        n = (int)min((uint64_t)n, size - cursor);
+        if(n <= 0) return 0;
+        if(!ring.FillLevel() && !readDone)
+        {
+            stalls++;
+            unique_lock<mutex> lock(readMutex);
+            while(!ring.FillLevel() && !readDone) readCv.wait_for(lock, chrono::milliseconds(20));
+        }
+        int got = ring.Read(dst, n);
+        cursor += got;
+        readCv.notify_all();
+        return got;
+    }
+    // At the end of the file: carry on at loopFrom, where the reader usually
+    // is already.
+    void NextLap()
+    {
+        {
+            unique_lock<mutex> lock(readMutex);
+            while(!ring.FillLevel() && !readDone) readCv.wait_for(lock, chrono::milliseconds(20));
+        }
+        if(!ring.FillLevel()) Start(loopFrom);
+        cursor = loopFrom;
+    }
+    // Straight from the file, for the few reads of a seek.
+    int ReadAt(void* dst, int n, uint64_t offset)
+    {
+        int done = 0;
+        while(done < n)
+        {
+            ssize_t got = pread(fd, (char*)dst + done, n - done, (off_t)(offset + done));
+            if(got < 0 && errno == EINTR) continue;
+            if(got <= 0) break;
+            done += (int)got;
+        }
+        return done;
+    }
+
+    // Read ahead, and the size of one read.
+    static const int Capacity = 1 << 19;
+    static const int BlockSize = 1 << 16;
+
+    uint64_t size;
+    int stalls; // times Read had to wait for the disk
+
+private:
+    void ReadLoop()
+    {
+        while(!stopReading)
+        {
+            if(readCursor == size)
+            {
+                if(!looping) break;
+                readCursor = loopFrom;
+            }
+            if(ring.Space() < BlockSize)
+            {
+                unique_lock<mutex> lock(readMutex);
+                while(!stopReading && ring.Space() < BlockSize) readCv.wait_for(lock, chrono::milliseconds(20));
+                continue;
+            }
+            int span;
+            char* dst = ring.WriteSpan(span);
+            int n = (int)min((uint64_t)min(span, (int)BlockSize), size - readCursor);
+            ssize_t got = pread(fd, dst, n, (off_t)readCursor);
+            if(got < 0 && errno == EINTR) continue;
+            if(got <= 0)
+            {
+                printf("read error at %llu\n", (unsigned long long)readCursor);
+                break;
+            }
+            ring.Commit((int)got);
+            readCursor += got;
+            readCv.notify_all();
+        }
+        {
+            lock_guard<mutex> lock(readMutex);
+            readDone = true;
+        }
+        readCv.notify_all();
+    }
+
+    atomic<bool> looping;
+    atomic<uint64_t> loopFrom;
+    int fd;
+    uint64_t cursor; // file offset of the next byte Read returns
+    uint64_t readCursor; // of the next byte the reader reads
+    PcmRing ring;
+    thread reader;
+    mutex readMutex;
+    condition_variable readCv;
+    atomic<bool> stopReading;
+    atomic<bool> readDone;
+};
+
+// Arenas for stb_vorbis's alloc_buffer, handed from stream to stream. In an
+// arena stb_vorbis keeps a stream's buffers at the front and a decode's temp
+// buffers at the back instead of calling malloc and alloca, so once the pool
+// has enough arenas of the right size opening a stream allocates nothing.
+class VorbisArenaPool
+{
+public:
+    VorbisArenaPool() : arenas(0), arenaBytes(0), acquired(0), inUse(0), peakInUse(0), highWater(0) {}
+    VorbisArenaPool(const VorbisArenaPool&) = delete;
+    ~VorbisArenaPool()
+    {
+        assert(inUse == 0);
+        for(auto& arena : freeArenas) delete[] arena.alloc_buffer;
+    }
+    // Makes sure count free arenas of bytes are ready ahead of time, e.g.
+    // while a level loads. They go straight onto the free list, so the use
+    // counters only ever count streams.
+    void Reserve(int count, int bytes)
+    {
+        lock_guard<mutex> lock(poolMutex);
+        for(auto& arena : freeArenas)
+        {
+            if(arena.alloc_buffer_length_in_bytes >= bytes) count--;
+        }
+        for(; count > 0; count--) freeArenas.push_back(NewArena(bytes));
+    }
+    // The smallest free arena of at least bytes, a new one when none fits.
+    stb_vorbis_alloc Acquire(int bytes)
+    {
+        lock_guard<mutex> lock(poolMutex);
+        size_t best = freeArenas.size();
+        for(size_t i = 0; i < freeArenas.size(); i++)
+        {
+            int size = freeArenas[i].alloc_buffer_length_in_bytes;
+            if(size >= bytes && (best == freeArenas.size() || size < freeArenas[best].alloc_buffer_length_in_bytes)) best = i;
+        }
+        stb_vorbis_alloc arena;
+        if(best < freeArenas.size())
+        {
+            arena = freeArenas[best];
+            freeArenas[best] = freeArenas.back();
+            freeArenas.pop_back();
+        }
+        else arena = NewArena(bytes);
+        acquired++;
+        peakInUse = max(peakInUse, ++inUse);
+        return arena;
+    }
+    // Takes an arena back, used is the most of it the stream ever held.
+    void Recycle(stb_vorbis_alloc arena, int used)
+    {
+        if(!arena.alloc_buffer) return;
+        lock_guard<mutex> lock(poolMutex);
+        freeArenas.push_back(arena);
+        inUse--;
+        highWater = max(highWater, used);
+    }
+    void PrintStats()
+    {
+        lock_guard<mutex> lock(poolMutex);
+        printf("Vorbis arenas: %d (%zu KB), %d acquired, %d in use, peak %d, high-water %d bytes\n",
+            arenas, arenaBytes / 1024, acquired, inUse, peakInUse, highWater);
+    }
+
+    static const int Granularity = 4096;
+
+    int arenas;        // allocated so far, the only heap allocations
+    size_t arenaBytes;
+    int acquired;
+    int inUse;
+    int peakInUse;
+    int highWater;     // most bytes a stream used of its arena
+
+private:
+    // Called with poolMutex held.
+    stb_vorbis_alloc NewArena(int bytes)
+    {
+        // stb_vorbis rounds the length up to 4 bytes, keep it a multiple.
+        int size = (bytes + Granularity - 1) & ~(Granularity - 1);
+        stb_vorbis_alloc arena;
+        arena.alloc_buffer = new char[size];
+        arena.alloc_buffer_length_in_bytes = size;
+        arenas++;
+        arenaBytes += size;
+        // Room to take every arena back without allocating.
+        freeArenas.reserve(arenas);
+        return arena;
+    }
+
+    mutex poolMutex;
+    vector<stb_vorbis_alloc> freeArenas;
+};
+
+// Vorbis setup headers by file name, parsed once and shared by every later
+// stream of the file. Parsing the codebooks and building the twiddle tables
+// is most of an open and most of a stream's memory, so forty voices of one
+// footstep only pay for their own decode buffers. A setup stays until
+// Release or Clear, and after that until the last stream using it closes.
+// With a VorbisArenaPool those buffers come from an arena sized for the
+// file: setup_memory_required and temp_memory_required of a sharing stream.
+class VorbisSetupCache
+{
+public:
+    VorbisSetupCache(VorbisArenaPool* arenas = nullptr) : hits(0), misses(0), arenas(arenas) {}
+    VorbisSetupCache(const VorbisSetupCache&) = delete;
+    ~VorbisSetupCache()
+    {
+        Clear();
+    }
+    // stb_vorbis_open_pushdata with the setup of filename when it is known.
+    // Setups are kept with the file's size and mtime, as the .idx files are,
+    // and one for a file changed since is parsed again. Streams opened here
+    // are closed with Close.
+    stb_vorbis* OpenPushdata(const char* filename, const unsigned char* data, int size, int* used, int* error)
+    {
+        struct stat st;
+        bool known = stat(filename, &st) == 0;
+        uint64_t fileSize = known ? (uint64_t)st.st_size : 0;
+        uint64_t mtime = known ? (uint64_t)st.st_mtime : 0;
+        {
+            lock_guard<mutex> lock(cacheMutex);
+            auto it = setups.find(filename);
+            if(it != setups.end() && known && it->second.fileSize == fileSize && it->second.mtime == mtime)
+            {
+                stb_vorbis_alloc arena = stb_vorbis_alloc();
+                if(arenas) arena = arenas->Acquire(it->second.streamBytes);
+                stb_vorbis* vorbis = stb_vorbis_open_pushdata_shared(data, size, used, error, arena.alloc_buffer ? &arena : nullptr, it->second.setup);
+                if(vorbis)
+                {
+                    hits++;
+                    return vorbis;
+                }
+                if(arenas) arenas->Recycle(arena, 0);
+            }
+        }
+        // Parsed outside the lock, a stream opening meanwhile parses too and
+        // the last one in stays. The setup outlives the stream, so it is
+        // malloc()ed rather than put in an arena.
+        stb_vorbis* vorbis = stb_vorbis_open_pushdata(data, size, used, error, nullptr);
+        if(!vorbis) return nullptr;
+        Entry entry = { stb_vorbis_share_setup(vorbis), 0, fileSize, mtime };
+        if(arenas)
+        {
+            // A throwaway sharing stream tells what the arenas need.
+            int probeUsed, probeError;
+            stb_vorbis* probe = stb_vorbis_open_pushdata_shared(data, size, &probeUsed, &probeError, nullptr, entry.setup);
+            if(probe)
+            {
+                stb_vorbis_info probeInfo = stb_vorbis_get_info(probe);
+                entry.streamBytes = (int)(probeInfo.setup_memory_required + probeInfo.temp_memory_required);
+                stb_vorbis_close(probe);
+            }
+        }
+        lock_guard<mutex> lock(cacheMutex);
+        misses++;
+        auto it = setups.find(filename);
+        if(it != setups.end())
+        {
+            stb_vorbis_release_setup(it->second.setup);
+            it->second = entry;
+        }
+        else setups[filename] = entry;
+        return vorbis;
+    }
+    // Closes a stream from OpenPushdata and gives its arena back.
+    void Close(stb_vorbis* vorbis)
+    {
+        stb_vorbis_alloc arena = vorbis->alloc;
+        int used = arena.alloc_buffer ? vorbis->setup_offset + arena.alloc_buffer_length_in_bytes - vorbis->temp_offset_low : 0;
+        stb_vorbis_close(vorbis);
+        if(arenas) arenas->Recycle(arena, used);
+    }
+    // Has the pool make arenas for that many more streams of filename, which
+    // has to have been opened once.
+    void ReserveArenas(const char* filename, int streams)
+    {
+        lock_guard<mutex> lock(cacheMutex);
+        auto it = setups.find(filename);
+        if(arenas && it != setups.end()) arenas->Reserve(streams, it->second.streamBytes);
+    }
+    void Release(const char* filename)
+    {
+        lock_guard<mutex> lock(cacheMutex);
+        auto it = setups.find(filename);
+        if(it == setups.end()) return;
+        stb_vorbis_release_setup(it->second.setup);
+        setups.erase(it);
+    }
+    void Clear()
+    {
+        lock_guard<mutex> lock(cacheMutex);
+        for(auto& entry : setups) stb_vorbis_release_setup(entry.second.setup);
+        setups.clear();
+    }
+
+    int hits;   // opens that used a cached setup
+    int misses; // opens that parsed one
+
+private:
+    struct Entry
+    {
+        stb_vorbis_setup* setup;
+        int streamBytes; // arena a sharing stream needs
+        uint64_t fileSize; // of the file the setup was parsed from
+        uint64_t mtime;
+    };
+
+    mutex cacheMutex;
+    map<string, Entry> setups;
+    VorbisArenaPool* arenas;
+};
+
+#define OGG_INDEX_MAGIC "OGIX"
+
+// Offset and granule position of every Ogg page stb_vorbis can resync on,
+// one that no packet runs on from, which comes to a page per 4-8 KB. The
+// scan reads the file in large blocks and only checks page headers, so it
+// runs in the background while playback starts. Seeking with it is one
+// lookup and one read, where bisecting on page headers takes a dozen reads.
+class OggPageIndex
+{
+public:
+    struct Entry
+    {
+        uint64_t offset;  // of the page in the file
+        uint64_t granule; // frames decoded once the page's packets are
+    };
+    struct Page
+    {
+        int64_t granule; // -1 when no packet ends on the page
+        int packetsEnded;
+        bool lastContinues; // the page's last packet goes on in the next page
+    };
+    // Length of the page at p, 0 when it does not all fit in size, -1 when p
+    // is no page: capture pattern, version 0 and a matching CRC.
+    static int ParsePage(const unsigned char* p, size_t size, Page& page)
+    {
+        if(size < 4) return 0;
+        if(memcmp(p, "OggS", 4)) return -1;
+        if(size < 27) return 0;
+        if(p[4] != 0) return -1;
+        int segments = p[26];
+        if(size < (size_t)27 + segments) return 0;
+        int length = 27 + segments;
+        page.packetsEnded = 0;
+        for(int i = 0; i < segments; i++)
+        {
+            length += p[27 + i];
+            page.packetsEnded += p[27 + i] < 255;
+        }
+        if(size < (size_t)length) return 0;
+        uint32_t crc = 0;
+        for(int i = 0; i < length; i++) crc = crc32_update(crc, i >= 22 && i < 26 ? 0 : p[i]);
+        if(crc != (p[22] | p[23] << 8 | p[24] << 16 | (uint32_t)p[25] << 24)) return -1;
+        uint64_t granule = 0;
+        for(int i = 7; i >= 0; i--) granule = (granule << 8) | p[6 + i];
+        page.granule = (int64_t)granule;
+        page.lastContinues = !segments || p[26 + segments] == 255;
+        return length;
+    }
+
+    OggPageIndex() : ready(false), cancel(false) {}
+
+    void Build(ReadAheadFile& file, uint64_t start)
+    {
+        vector<unsigned char> block(ScanBlock);
+        uint64_t pos = start; // file offset of block[0]
+        int have = 0;
+        Page page;
+        pages.clear();
+        while(!cancel)
+        {
+            int got = file.ReadAt(&block[have], ScanBlock - have, pos + have);
+            if(got <= 0) break;
+            have += got;
+            int i = 0;
+            while(i < have)
+            {
+                int length = ParsePage(&block[i], have - i, page);
+                if(length == 0) break;
+                if(length < 0)
+                {
+                    // Lost sync, look for the next capture pattern.
+                    i++;
+                    continue;
+                }
+                if(!page.lastContinues && page.granule >= 0) pages.push_back(Entry{ pos + i, (uint64_t)page.granule });
+                i += length;
+            }
+            // A page cut off by the end of the block goes to the front.
+            memmove(&block[0], &block[i], have - i);
+            pos += i;
+            have -= i;
+        }
+        ready.store(true, memory_order_release);
+    }
+    // Offset of the last page that ends before frame limit, -1 when none does.
+    int64_t PageBefore(uint64_t limit)
+    {
+        if(pages.empty() || pages[0].granule >= limit) return -1;
+        size_t lo = 0, hi = pages.size();
+        while(hi - lo > 1)
+        {
+            size_t mid = (lo + hi) / 2;
+            if(pages[mid].granule < limit) lo = mid;
+            else hi = mid;
+        }
+        return (int64_t)pages[lo].offset;
+    }
+
+    // Persisted indexes are only trusted for the same file size and mtime.
+    bool Save(const char* path, uint64_t fileSize, uint64_t mtime)
+    {
+        FILE* f = fopen(path, "wb");
+        if(!f) return false;
+        uint32_t count = (uint32_t)pages.size();
+        bool ok = fwrite(OGG_INDEX_MAGIC, 1, 4, f) == 4 &&
+            fwrite(&fileSize, sizeof(fileSize), 1, f) == 1 &&
+            fwrite(&mtime, sizeof(mtime), 1, f) == 1 &&
+            fwrite(&count, sizeof(count), 1, f) == 1 &&
+            (!count || fwrite(&pages[0], sizeof(Entry), count, f) == count);
+        fclose(f);
+        return ok;
+    }
+    bool Load(const char* path, uint64_t fileSize, uint64_t mtime)
+    {
+        FILE* f = fopen(path, "rb");
+        if(!f) return false;
+        char magic[4];
+        uint64_t size, time;
+        uint32_t count;
+        bool ok = fread(magic, 1, 4, f) == 4 && !memcmp(magic, OGG_INDEX_MAGIC, 4) &&
+            fread(&size, sizeof(size), 1, f) == 1 && size == fileSize &&
+            fread(&time, sizeof(time), 1, f) == 1 && time == mtime &&
+            fread(&count, sizeof(count), 1, f) == 1;
+        if(ok)
+        {
+            pages.resize(count);
+            ok = !count || fread(&pages[0], sizeof(Entry), count, f) == count;
+        }
+        fclose(f);
+        if(!ok)
+        {
+            pages.clear();
+            return false;
+        }
+        ready.store(true, memory_order_release);
+        return true;
+    }
+
+    // Larger than the largest Ogg page, 64 KB.
+    static const int ScanBlock = 1 << 20;
+
+    vector<Entry> pages;
+    atomic<bool> ready;
+    atomic<bool> cancel;
+};
+
+// Decodes Ogg Vorbis with stb_vorbis's pushdata API, which only ever sees
+// memory: the pages come out of a ReadAheadFile. Seeks look the page up in an
+// OggPageIndex, or bisect the file on page headers until that is scanned, and
+// let stb_vorbis resync on the page found. Looping puts the decoder back to
+// the state it had right after the headers, which costs nothing next to
+// parsing them again. With a VorbisSetupCache the headers are only parsed by
+// the first stream of a file.
+class OggFile
+{
+public:
+    OggFile() : vorbis(nullptr), setups(nullptr) {}
+    OggFile(const char* filename, VorbisSetupCache* setups = nullptr, bool persistIndex = false) : vorbis(nullptr), setups(nullptr)
+    {
+        Setup(filename, setups, persistIndex);
+    }
+    OggFile(const OggFile&) = delete;
+    ~OggFile()
+    {
+        Close();
+    }
+    void Setup(const char* filename, VorbisSetupCache* setups = nullptr, bool persistIndex = false)
+    {
+        bool opened = Open(filename, setups, persistIndex);
+        assert(opened);
+    }
+    // The page index is scanned in the background. With persistIndex it is
+    // loaded from / saved to "<filename>.idx" next to the file.
+    bool Open(const char* filename, VorbisSetupCache* setups = nullptr, bool persistIndex = false)
+    {
+        Close();
+        this->setups = setups;
+        if(!file.Open(filename)) return false;
+        file.Start(0);
+        window.resize(ReadAheadFile::BlockSize);
+        windowBegin = 0;
+        windowEnd = 0;
+        // Hand stb_vorbis the three header packets in one go, a short block
+        // makes it fail half way through the codebooks and leak them.
+        crc32_init();
+        int headerBytes;
+        while(!(headerBytes = HeaderBytes()))
+        {
+            if(!FillWindow()) break;
+        }
+        int used = 0, error = 0;
+        if(headerBytes > 0 && setups) vorbis = setups->OpenPushdata(filename, &window[0], headerBytes, &used, &error);
+        else if(headerBytes > 0) vorbis = stb_vorbis_open_pushdata(&window[0], headerBytes, &used, &error, nullptr);
+        if(!vorbis)
+        {
+            Close();
+            return false;
         }
-        // printf("current progress: %2.2f/%2.2f\n", GetProgress(), GetDuration());
+        windowBegin = used;
+        dataStart = used;
+        headerState = *vorbis;
+        info = stb_vorbis_get_info(vorbis);
+        channels = info.channels;
+        sampleRate = info.sample_rate;
+        totalFrames = LastGranule();
+        duration = sampleRate ? (float)totalFrames / (float)sampleRate : 0;
+        // A frame returns up to a long block, max_frame_size is half of one.
+        pcm.resize((BlockFrames + 2 * info.max_frame_size) * channels);
+        pcmBytes = 0;
+        isNoMoreData = false;
+        skipFrames = 0;
+        resyncFrame = -1;
+        loops = 0;
 
-        // printf("slc current buffer id: %d\n", als.GetBufferID());
-        // printf("slc buffers counts: %d\n", als.GetBufferCounts());
-        // printf("slc processed buffers counts: %d\n", als.GetBufferProcessedCounts());
+        struct stat st;
+        uint64_t mtime = stat(filename, &st) == 0 ? (uint64_t)st.st_mtime : 0;
+        string indexPath = string(filename) + ".idx";
+        if(!persistIndex || !index.Load(indexPath.c_str(), file.size, mtime))
+        {
+            indexThread = thread([this, persistIndex, indexPath, mtime]()
+            {
+                index.Build(file, dataStart);
+                if(persistIndex && !index.cancel) index.Save(indexPath.c_str(), file.size, mtime);
+            });
+        }
+        return true;
+    }
+    void WaitIndex()
+    {
+        if(indexThread.joinable()) indexThread.join();
+    }
+    void Close()
+    {
+        index.cancel = true;
+        WaitIndex();
+        index.cancel = false;
+        index.ready = false;
+        file.Close();
+        if(vorbis && setups) setups->Close(vorbis);
+        else if(vorbis) stb_vorbis_close(vorbis);
+        vorbis = nullptr;
     }
-    float GetProgress()
+    // Takes effect when the decoder next gets to the end of the file.
+    void SetLooping(bool loop)
     {
-        return (float)playCursor / (float)wavf.ByteRate;
+        file.SetLooping(loop, dataStart);
     }
-    float GetDuration()
+    // Decodes about BlockFrames frames into pcm, interleaved float. When
+    // looping the block goes on with the start of the file, so the seam is
+    // sample accurate.
+    bool GetNextBlock()
     {
-        return wavf.duration;
+        int frames = 0;
+        while(frames < BlockFrames)
+        {
+            float** out;
+            int samples = 0;
+            int used = stb_vorbis_decode_frame_pushdata(vorbis, &window[windowBegin], windowEnd - windowBegin, nullptr, &out, &samples);
+            windowBegin += used;
+            if(samples)
+            {
+                frames += Emit(out, samples, &pcm[frames * channels]);
+                continue;
+            }
+            if(used || FillWindow()) continue;
+            // End of the file.
+            if(!file.IsLooping())
+            {
+                isNoMoreData = true;
+                break;
+            }
+            file.NextLap();
+            Rewind();
+            loops++;
+        }
+        pcmBytes = frames * channels * sizeof(float);
+        return !isNoMoreData;
+    }
+    bool SeekToFrame(uint64_t frame)
+    {
+        if(totalFrames) frame = min(frame, totalFrames);
+        // Decoding starts after the page found and drops the first packet
+        // there, what comes out first is at most one packet, max_frame_size,
+        // past the page's granule position. That is all the pre-roll a seek
+        // decodes before frame.
+        uint64_t margin = (uint64_t)info.max_frame_size;
+        int64_t page = -1;
+        if(frame > margin && index.ready.load(memory_order_acquire)) page = index.PageBefore(frame - margin);
+        else if(frame > margin) page = FindPageBefore(frame - margin);
+        if(page < 0)
+        {
+            Rewind();
+            file.Start(dataStart);
+            skipFrames = frame;
+        }
+        else
+        {
+            stb_vorbis_flush_pushdata(vorbis);
+            windowBegin = 0;
+            windowEnd = 0;
+            file.Start(page);
+            resyncFrame = (int64_t)frame;
+        }
+        isNoMoreData = false;
+        return true;
     }
 
-    int32_t playCursor; // progress
-    vector<ALBuffer> albv;
-    int currentBuffer;
-    ALSource als;
-    WavFile wavf;
-    int current;
-
-    bool isNeedMoreData;
-    int bufferCounts;
-    bool isEnd;
-    int threeTime;
-
-    int counter;
-    int total;
-};
+    // Frames decoded per GetNextBlock, give or take one Vorbis frame.
+    static const int BlockFrames = 4096;
 
+    stb_vorbis* vorbis;
+    stb_vorbis_info info;
+    ReadAheadFile file;
+    int channels;
+    int sampleRate;
+    uint64_t totalFrames; // from the granule position of the last page
+    float duration;
 
+    vector<float> pcm;
+    int pcmBytes; // valid bytes in pcm after GetNextBlock
+    bool isNoMoreData;
+    int loops; // times the file has started over
+    OggPageIndex index;
 
-class Mp3File
-{
-public:
-    Mp3File(){}
-    Mp3File(const char* filename)
+private:
+    // Bytes up to the end of the page that finishes the third header packet,
+    // 0 while the window does not hold it yet, -1 when this is no Ogg file.
+    int HeaderBytes()
     {
-        Setup(filename);
+        int offset = 0, packets = 0;
+        OggPageIndex::Page page;
+        while(packets < 3)
+        {
+            int length = OggPageIndex::ParsePage(&window[offset], windowEnd - offset, page);
+            if(length <= 0) return length;
+            offset += length;
+            packets += page.packetsEnded;
+        }
+        return offset;
     }
-    void Setup(const char* filename)
+    // Moves what stb_vorbis has not used yet to the front and appends what
+    // the reader has, growing the window for a packet that does not fit.
+    // Returns false at the end of the file.
+    bool FillWindow()
     {
-        //TODO(Wax): Deal with IDv3 tag in the mp3 file if it has one.
-        f = fopen(filename, "rb");
-        assert(f);
-        mp3dec_init(&mp3d);
-
-        filesize = fileSize(f);
-        data = (unsigned char*)malloc(filesize * sizeof(char));
-        fread(data, sizeof(char), filesize, f);
-        memset(&info, 0, sizeof(info));
-        playCursor = 0;
-        leftfilesize = filesize;
-        pcmCursor = 0;
-        bufferSize = MINIMP3_MAX_SAMPLES_PER_FRAME * 40 * 2;
-        GetNextFrame();
-        SampleRate = info.hz;
-        duration = (float)filesize / (4 + ((float)info.frame_bytes / info.hz) * (info.bitrate_kbps * 1000 / 8)) * ((float)info.frame_bytes / info.hz);
+        if(windowBegin)
+        {
+            memmove(&window[0], &window[windowBegin], windowEnd - windowBegin);
+            windowEnd -= windowBegin;
+            windowBegin = 0;
+        }
+        if(windowEnd == (int)window.size()) window.resize(window.size() * 2);
+        int got = file.Read((char*)&window[windowEnd], (int)window.size() - windowEnd);
+        windowEnd += got;
+        return got > 0;
     }
-    bool GetNextFrame()
+    // Back to the first audio page, decoding exactly as after Open.
+    void Rewind()
     {
-        while(1)
+        int tempLow = vorbis->temp_offset_low;
+        *vorbis = headerState;
+        vorbis->temp_offset_low = tempLow; // keeps the arena's high-water mark
+        windowBegin = 0;
+        windowEnd = 0;
+        skipFrames = 0;
+        resyncFrame = -1;
+    }
+    // Interleaves a decoded frame into dst, less what a seek still skips.
+    // Returns the frames written.
+    int Emit(float** out, int samples, float* dst)
+    {
+        if(resyncFrame >= 0)
         {
-            samples = mp3dec_decode_frame(&mp3d, &data[playCursor], leftfilesize, &pcm[pcmCursor], &info);
-            if(samples)
-            { 
-                pcmCursor += samples * info.channels;
-                total_samples += samples * info.channels;
+            // The first frame after a resync says where the decoder landed.
+            int64_t first = (int64_t)stb_vorbis_get_sample_offset(vorbis) - samples;
+            int64_t target = resyncFrame;
+            if(stb_vorbis_get_sample_offset(vorbis) < 0 || first > target)
+            {
+                // Past the target or lost, decode up to it from the start instead.
+                Rewind();
+                file.Start(dataStart);
+                skipFrames = target;
+                return 0;
             }
-            playCursor  += info.frame_bytes;
-            leftfilesize -= info.frame_bytes;
-            // printf("samples=%d, total_samples=%d, hz:%d, bitrate_kbps:%d  frame_bytes:%d playCursor:%d, leftfilesize:%ld \n"
-                // , samples, total_samples, info.hz, info.bitrate_kbps, info.frame_bytes, playCursor, leftfilesize);
-            if(pcmCursor >= MINIMP3_MAX_SAMPLES_PER_FRAME * 40)
+            skipFrames = target - first;
+            resyncFrame = -1;
+        }
+        int drop = (int)min(skipFrames, (uint64_t)samples);
+        skipFrames -= drop;
+        int frames = samples - drop;
+        for(int i = 0; i < frames; i++)
+        {
+            for(int c = 0; c < channels; c++) *dst++ = out[c][drop + i];
+        }
+        return frames;
+    }
+    // Offset of the last page before frame limit whose packets all end on
+    // it, the page stb_vorbis can resync on. Bisects on page headers read
+    // straight from the file, -1 when the first audio page is already past.
+    int64_t FindPageBefore(uint64_t limit)
+    {
+        probe.resize(2 * ProbeSize);
+        uint64_t lo = dataStart, hi = file.size;
+        int64_t best = -1;
+        OggPageIndex::Page page;
+        while(hi - lo > ProbeSize)
+        {
+            uint64_t mid = lo + (hi - lo) / 2;
+            int n = file.ReadAt(&probe[0], ProbeSize, mid);
+            int64_t found = -1;
+            for(int i = 0; i < n;)
             {
-                pcmCursor = 0;
-                break;
+                int length = OggPageIndex::ParsePage(&probe[i], n - i, page);
+                if(length == 0) break;
+                if(length < 0)
+                {
+                    i++;
+                    continue;
+                }
+                if(!page.lastContinues)
+                {
+                    found = i;
+                    break;
+                }
+                i += length;
             }
-            if(!info.frame_bytes) break;
+            if(found < 0 || (uint64_t)page.granule >= limit)
+            {
+                hi = mid;
+                continue;
+            }
+            best = mid + found;
+            lo = mid + found + OggPageIndex::ParsePage(&probe[found], n - found, page);
+        }
+        // Page by page through what is left, lo is on a page boundary.
+        int n = file.ReadAt(&probe[0], (int)probe.size(), lo);
+        for(int i = 0; i < n;)
+        {
+            int length = OggPageIndex::ParsePage(&probe[i], n - i, page);
+            if(length <= 0) break;
+            if(!page.lastContinues)
+            {
+                if((uint64_t)page.granule >= limit) break;
+                best = lo + i;
+            }
+            i += length;
         }
-        if(info.frame_bytes)  return true;
-            else     return false;
+        return best;
     }
-    ~Mp3File()
+    // The granule position of the last page is the length of the stream.
+    uint64_t LastGranule()
     {
-        if(data) free(data);
-        data = nullptr;
-        fclose(f);
+        int n = (int)min(file.size - dataStart, (uint64_t)ProbeSize);
+        probe.resize(n);
+        n = file.ReadAt(&probe[0], n, file.size - n);
+        OggPageIndex::Page page;
+        for(int i = n - 27; i >= 0; i--)
+        {
+            if(OggPageIndex::ParsePage(&probe[i], n - i, page) > 0 && page.granule >= 0) return (uint64_t)page.granule;
+        }
+        return 0;
     }
 
+    // Twice the largest Ogg page, so a probe always holds a whole one.
+    static const int ProbeSize = 1 << 17;
 
-    mp3dec_t mp3d;
+    stb_vorbis headerState; // the decoder right after the headers
+    VorbisSetupCache* setups; // opened the decoder, when set
+    uint64_t dataStart; // first audio page
+    vector<unsigned char> window; // what stb_vorbis decodes from
+    int windowBegin;
+    int windowEnd;
+    vector<unsigned char> probe;
+    uint64_t skipFrames; // still to drop after a seek
+    int64_t resyncFrame; // seek target while stb_vorbis resyncs, -1 otherwise
+    thread indexThread;
+};
 
-    FILE* f;
-    size_t filesize;
-    size_t leftfilesize;
-    int playCursor;
-    unsigned char* data;
-    mp3dec_frame_info_t info;
-    int samples, total_samples = 0;
+// Streams Ogg Vorbis through the same queue as MusicPlayer, the file reads
+// happen on OggFile's reader thread ahead of the decoder.
+class OggPlayer : public StreamPlayer
+{
+public:
+    OggPlayer(){}
+    OggPlayer(const char* file, bool loop = false, VorbisSetupCache* setups = nullptr, bool persistIndex = false)
+    {
+        Setup(file, loop, setups, persistIndex);
+    }
+    ~OggPlayer()
+    {
+        StopDecoder();
+    }
+    void Setup(const char* filename, bool loop = false, VorbisSetupCache* setups = nullptr, bool persistIndex = false)
+    {
+        oggf.Setup(filename, setups, persistIndex);
+        oggf.SetLooping(loop);
+        if(!converter.Setup(oggf.channels, 32, true))
+        {
+            printf("%s: unsupported format, %d channels\n", filename, oggf.channels);
+            assert(false);
+        }
+        StartStreaming(oggf.sampleRate, 3);
+    }
+    // The decoder runs a couple of seconds ahead, the end it is at may
+    // already be decided.
+    void SetLooping(bool loop)
+    {
+        oggf.SetLooping(loop);
+    }
+    float GetProgress()
+    {
+        float seconds = (float)queuedBytes / (float)bytesPerSecond;
+        return oggf.duration > 0 ? fmodf(seconds, oggf.duration) : seconds;
+    }
+    float GetDuration()
+    {
+        return oggf.duration;
+    }
+    bool Seek(float seconds)
+    {
+        lock_guard<mutex> lock(streamMutex);
+        bool wasPlaying = als.IsPlaying();
+        FlushStream();
+        uint64_t frame = (uint64_t)(max(seconds, 0.0f) * oggf.sampleRate);
+        if(oggf.totalFrames) frame = min(frame, oggf.totalFrames);
+        bool ok = oggf.SeekToFrame(frame);
+        ResumeStream(frame * (bytesPerSecond / oggf.sampleRate), wasPlaying);
+        return ok;
+    }
 
-    short pcm[MINIMP3_MAX_SAMPLES_PER_FRAME * 40];
-    int  pcmCursor;
-    int bufferSize;
+    OggFile oggf;
 
-    int SampleRate;
-    float duration;
+protected:
+    bool Decode()
+    {
+        oggf.GetNextBlock();
+        if(oggf.pcmBytes && !Produce((const char*)oggf.pcm.data(), oggf.pcmBytes)) return false;
+        return !oggf.isNoMoreData;
+    }
 };
 
-const char* showTime(float seconds,int num, char* buff)
+// Decodes a Vorbis file with the scalar, SSE2 and AVX2 inverse MDCT the CPU
+// has and times inverse_mdct alone on the file's long blocks. Every SIMD level
+// has to match the scalar samples within tolerance, which is 0 as they do the
+// same float operations.
+int benchVorbisDecode(const char* filename, float tolerance = 0.0f)
 {
-    assert(buff);
-    memset(buff, 0x00, num);
-    int minutes = seconds / 60;
-    int sec = seconds - minutes * 60;
-    sprintf(buff, "%02d:%02d", minutes, sec);
-    return buff;
+    static const char* names[] = { "scalar", "sse2", "avx2" };
+    int err = 0;
+    stb_vorbis* v = stb_vorbis_open_filename(filename, &err, nullptr);
+    if(!v)
+    {
+        printf("cannot decode %s (error %d)\n", filename, err);
+        return 1;
+    }
+    int channels = v->channels;
+    int sampleRate = v->sample_rate;
+    int blockType = v->blocksize_1 > v->blocksize_0 ? 1 : 0;
+    int n = v->blocksize[blockType];
+    int levels = 1;
+#ifdef STBV_SIMD
+    levels = stbv__simd_level + 1;
+#endif
+
+    // The levels take turns so a busy machine slows them all alike, the best
+    // run of each counts.
+    vector<float> scalar;
+    vector<float> pcm;
+    vector<float> block(n);
+    vector<float> spectrum(n);
+    for(int i = 0; i < n; i++) spectrum[i] = (float)((i * 7919) % 2001 - 1000) / 1000.0f;
+    double decode[3] = { 1e9, 1e9, 1e9 };
+    double imdct[3] = { 1e9, 1e9, 1e9 };
+    float diff[3] = { 0, 0, 0 };
+    for(int run = 0; run < 5; run++)
+    {
+        for(int level = 0; level < levels; level++)
+        {
+#ifdef STBV_SIMD
+            stbv__simd_level = level;
+#endif
+            stb_vorbis_seek_start(v);
+            pcm.clear();
+            float chunk[4096];
+            auto t0 = chrono::steady_clock::now();
+            int frames;
+            while((frames = stb_vorbis_get_samples_float_interleaved(v, channels, chunk, 4096)) > 0) pcm.insert(pcm.end(), chunk, chunk + frames * channels);
+            decode[level] = min(decode[level], chrono::duration<double>(chrono::steady_clock::now() - t0).count());
+            if(scalar.empty()) scalar = pcm;
+            if(pcm.size() != scalar.size()) diff[level] = INFINITY;
+            for(size_t i = 0; i < pcm.size() && i < scalar.size(); i++) diff[level] = max(diff[level], fabsf(pcm[i] - scalar[i]));
+
+            for(int rep = 0; rep < 10; rep++)
+            {
+                t0 = chrono::steady_clock::now();
+                for(int i = 0; i < 100; i++)
+                {
+                    memcpy(block.data(), spectrum.data(), n * sizeof(float));
+                    inverse_mdct(block.data(), n, v, blockType);
+                }
+                imdct[level] = min(imdct[level], chrono::duration<double>(chrono::steady_clock::now() - t0).count() / 100);
+            }
+        }
+    }
+    bool allWithin = true;
+    printf("%s: %d channels, %d Hz, %d-sample long blocks\n", filename, channels, sampleRate, n);
+    printf("level   decode s  speedup  imdct ns  speedup  max diff\n");
+    for(int level = 0; level < levels; level++)
+    {
+        allWithin = allWithin && diff[level] <= tolerance;
+        printf("%-6s  %8.3f  %7.2f  %8.0f  %7.2f  %8g\n", names[level], decode[level], decode[0] / decode[level], imdct[level] * 1e9, imdct[0] / imdct[level], diff[level]);
+    }
+#ifdef STBV_SIMD
+    stbv__simd_level = levels - 1;
+#endif
+    stb_vorbis_close(v);
+    return allWithin ? 0 : 1;
 }
 
-class Mp3Player
+// Whole sounds decoded once into ALBuffers, for one-shots that play over and
+// over. Acquire decodes WAV, MP3, FLAC or Ogg Vorbis on the first use of a
+// path and hands out the same buffer after that; every source playing it
+// holds a reference until Release. Samples nobody holds stay cached and are
+// evicted least recently used first once the bank is over its byte budget,
+// so with a budget that fits a level its second run never decodes.
+class SampleBank
 {
 public:
-    Mp3Player(){}
-    Mp3Player(const Mp3Player&) = delete;
-    Mp3Player(const char* file)
+    struct Sample
     {
-        Setup(file);
+        ALBuffer buffer;
+        string path;
+        size_t bytes; // in the AL buffer
+        float seconds;
+        int refs;
+        bool loading; // decoding outside the lock, Acquire waits for it
+        bool failed;
+        list<Sample*>::iterator idle; // place in the LRU list while refs is 0
+    };
+
+    SampleBank(size_t budgetBytes = 64 << 20) : budget(budgetBytes), bytes(0), peakBytes(0), hits(0), misses(0), evictions(0), failures(0) {}
+    SampleBank(const SampleBank&) = delete;
+    ~SampleBank()
+    {
+        for(auto& entry : samples)
+        {
+            if(entry.second.refs) printf("SampleBank: %s still has %d references\n", entry.first.c_str(), entry.second.refs);
+        }
     }
-    void Setup(const char* filename)
+
+    // The sample for path with one more reference, nullptr when it does not
+    // decode. The decode runs without the lock, so other samples are handed
+    // out meanwhile; Acquires of the same path wait for it.
+    Sample* Acquire(const char* path)
+    {
+        unique_lock<mutex> lock(bankMutex);
+        auto found = samples.find(path);
+        if(found != samples.end())
+        {
+            Sample& s = found->second;
+            if(!s.refs++) idle.erase(s.idle);
+            hits++;
+            loaded.wait(lock, [&s]{ return !s.loading; });
+            if(s.failed)
+            {
+                Drop(s);
+                return nullptr;
+            }
+            return &s;
+        }
+        misses++;
+        // Map nodes stay put, so s is safe to fill in without the lock while
+        // the reference keeps it out of Evict.
+        Sample& s = samples[path];
+        s.path = path;
+        s.bytes = 0;
+        s.seconds = 0;
+        s.refs = 1;
+        s.loading = true;
+        s.failed = false;
+        lock.unlock();
+        bool ok = Load(path, s);
+        lock.lock();
+        s.loading = false;
+        loaded.notify_all();
+        if(!ok)
+        {
+            printf("SampleBank: cannot decode %s\n", path);
+            s.failed = true;
+            failures++;
+            Drop(s);
+            return nullptr;
+        }
+        bytes += s.bytes;
+        peakBytes = max(peakBytes, bytes);
+        Evict();
+        return &s;
+    }
+    // Call once the source no longer has the buffer attached, AL cannot
+    // delete it before.
+    void Release(Sample* s)
+    {
+        if(!s) return;
+        lock_guard<mutex> lock(bankMutex);
+        assert(s->refs > 0);
+        if(--s->refs) return;
+        s->idle = idle.insert(idle.end(), s);
+        Evict();
+    }
+    // Decodes ahead of time, e.g. while a level loads, and leaves it cached.
+    bool Preload(const char* path)
     {
-        mp3f.Setup(filename);
+        Sample* s = Acquire(path);
+        Release(s);
+        return s != nullptr;
+    }
+    void SetBudget(size_t budgetBytes)
+    {
+        lock_guard<mutex> lock(bankMutex);
+        budget = budgetBytes;
+        Evict();
+    }
+    void PrintStats()
+    {
+        lock_guard<mutex> lock(bankMutex);
+        printf("Sample bank: %zu samples, %zu KB of %zu KB, peak %zu KB, %d hits, %d misses, %d evictions, %d failures\n",
+            samples.size(), bytes / 1024, budget / 1024, peakBytes / 1024, hits, misses, evictions, failures);
+    }
 
-        bufferCounts = 3;
-        albv.resize(bufferCounts);
+    size_t budget;
+    size_t bytes;
+    size_t peakBytes;
+    int hits;
+    int misses;
+    int evictions;
+    int failures;
 
-        int cursor = 0;
-        oneTime = ceil(mp3f.bufferSize / bufferCounts);
-        for(ALBuffer& b : albv)
+private:
+    // Oldest unreferenced first, samples in use stay even over the budget.
+    void Evict()
+    {
+        while(bytes > budget && !idle.empty())
         {
-            char* databuf = (char*)mp3f.pcm;
-            int left = (mp3f.bufferSize - cursor);
-            int size = min(left, oneTime);
-            b.loadSound(AL_FORMAT_STEREO16, &databuf[cursor], size, mp3f.SampleRate);
-            als.SetBuffers(1, b.bid);
-            cursor += size;
+            Sample* s = idle.front();
+            idle.pop_front();
+            bytes -= s->bytes;
+            evictions++;
+            // By iterator, erasing by key would use the path it destroys.
+            samples.erase(samples.find(s->path));
         }
-        assert(cursor == mp3f.bufferSize);
-        playCursor += mp3f.bufferSize;
-        printf("Fill buffer: %d", cursor);
-        current = 0;
-        isNeedMoreData = true;
-        isEnd = false;
+    }
+    // Lets go of a sample that failed to decode, the last one out removes it.
+    void Drop(Sample& s)
+    {
+        if(--s.refs == 0) samples.erase(samples.find(s.path));
+    }
+    bool Load(const char* path, Sample& s)
+    {
+        const char* ext = strrchr(path, '.');
+        ext = ext ? ext + 1 : "";
+        if(!strcasecmp(ext, "wav"))
+        {
+            WavFile wav;
+            if(!wav.Open(path, true)) return false;
+            if(wav.isMapped) return Upload(s, (const char*)wav.mapping.base + wav.dataOffset, wav.SubChunk2Size, wav.NumChannels, wav.BitsPerSample, wav.IsFloat(), wav.SampleRate);
+            vector<char> pcm(wav.data, wav.data + wav.dataSize);
+            while(!wav.isNoMoreData && wav.ReadMore()) pcm.insert(pcm.end(), wav.data, wav.data + wav.dataSize);
+            return Upload(s, pcm.data(), pcm.size(), wav.NumChannels, wav.BitsPerSample, wav.IsFloat(), wav.SampleRate);
+        }
+        if(!strcasecmp(ext, "mp3"))
+        {
+            Mp3BatchDecoder mp3;
+            if(!mp3.Decode(path, 1)) return false;
+            return Upload(s, (const char*)mp3.pcm.data(), mp3.pcm.size() * sizeof(short), mp3.channels, 16, false, mp3.sampleRate);
+        }
+        if(!strcasecmp(ext, "flac"))
+        {
+            FlacBatchDecoder flac;
+            if(!flac.Decode(path, 1)) return false;
+            return Upload(s, (const char*)flac.pcm.data(), flac.pcm.size() * sizeof(int32_t), flac.channels, 32, false, flac.sampleRate);
+        }
+        if(!strcasecmp(ext, "ogg"))
+        {
+            int channels, rate;
+            short* pcm;
+            int frames = stb_vorbis_decode_filename(path, &channels, &rate, &pcm);
+            if(frames < 0) return false;
+            bool ok = Upload(s, (const char*)pcm, (size_t)frames * channels * sizeof(short), channels, 16, false, rate);
+            free(pcm);
+            return ok;
+        }
+        return false;
+    }
+    bool Upload(Sample& s, const char* pcm, size_t size, int channels, int bits, bool isFloat, int rate)
+    {
+        PcmConverter converter;
+        if(!rate || !converter.Setup(channels, bits, isFloat)) return false;
+        int converted = (int)(size / converter.inBytesPerFrame * converter.inBytesPerFrame);
+        pcm = converter.Convert(pcm, converted);
+        {
+            // Asked whatever the ALCHECK policy, a rejected upload must not be
+            // cached as an empty buffer.
+            lock_guard<mutex> lock(uploadMutex);
+            alGetError();
+            alBufferData(s.buffer.bid, converter.alFormat, pcm, converted, rate);
+            ALenum error = alGetError();
+            if(error != AL_NO_ERROR)
+            {
+                printf("SampleBank: alBufferData: %s\n", GetOpenALErrorString(error));
+                return false;
+            }
+        }
+        s.bytes = converted;
+        s.seconds = (float)(converted / converter.outBytesPerFrame) / rate;
+        return true;
+    }
 
-        threeTime = 0;
-        currentBuffer = 0;
+    mutex bankMutex;
+    mutex uploadMutex; // the AL error state is per context, one upload asks at a time
+    condition_variable loaded; // a Sample's loading went false
+    map<string, Sample> samples;
+    list<Sample*> idle; // unreferenced samples, least recently released first
+};
+
+// Keeps every registered StreamPlayer fed from one background thread.
+// With AL_SOFT_events the thread sleeps until the device reports a retired
+// buffer, otherwise it wakes on a timer derived from the shortest queue.
+class StreamingService
+{
+public:
+    StreamingService()
+    {
+        running = false;
+        filling = false;
+        pendingEvents = 0;
+        wakeups = 0;
+        totalLatency = 0;
+        maxLatency = 0;
+        alEventControlSOFT = nullptr;
+        alEventCallbackSOFT = nullptr;
+        if(alIsExtensionPresent("AL_SOFT_events"))
+        {
+            alEventControlSOFT = (LPALEVENTCONTROLSOFT)alGetProcAddress("alEventControlSOFT");
+            alEventCallbackSOFT = (LPALEVENTCALLBACKSOFT)alGetProcAddress("alEventCallbackSOFT");
+        }
+        useEvents = alEventControlSOFT && alEventCallbackSOFT;
     }
-    bool IsPlaying()
+    StreamingService(const StreamingService&) = delete;
+    ~StreamingService()
     {
-        return als.IsPlaying();
+        Stop();
     }
-    void Play()
+    void Start()
     {
-        printf("audio play\n");
-        als.Play();
+        {
+            lock_guard<mutex> lock(mtx);
+            if(running) return;
+            running = true;
+        }
+        if(useEvents)
+        {
+            const ALenum types[] = { AL_EVENT_TYPE_BUFFER_COMPLETED_SOFT, AL_EVENT_TYPE_SOURCE_STATE_CHANGED_SOFT };
+            ALCHECK(alEventCallbackSOFT(EventCallback, this));
+            ALCHECK(alEventControlSOFT(2, types, AL_TRUE));
+        }
+        worker = thread(&StreamingService::Run, this);
+        printf("Streaming service started (%s)\n", useEvents ? "AL_SOFT_events" : "adaptive timer");
     }
-    void Pause()
+    void Stop()
     {
-        als.Pause();
+        {
+            lock_guard<mutex> lock(mtx);
+            if(!running) return;
+            running = false;
+        }
+        cv.notify_all();
+        worker.join();
+        if(useEvents)
+        {
+            const ALenum types[] = { AL_EVENT_TYPE_BUFFER_COMPLETED_SOFT, AL_EVENT_TYPE_SOURCE_STATE_CHANGED_SOFT };
+            ALCHECK(alEventControlSOFT(2, types, AL_FALSE));
+            ALCHECK(alEventCallbackSOFT(nullptr, nullptr));
+        }
     }
-    void FillBuffer()
+    void Add(StreamPlayer* player)
     {
-        if(isEnd) return;
-        // if(als.IsStopped()) als.Play();
-        int fillcount = als.GetBufferProcessedCounts();
-        printf("Fill %d buffers\n", fillcount);
-        while(fillcount--)
         {
-            // assert(fillcount <= 1);
-            als.UnQueueBuffers(1);
-            if(isNeedMoreData)
-            {
-                printf("MoreData\n");
-                if(!mp3f.GetNextFrame())
-                {
-                    isEnd = true;
-                }
-                playCursor = mp3f.total_samples;
-                isNeedMoreData = false;
-            }
-            current = min((mp3f.bufferSize - current), oneTime);
-            //Fill Data
-            playCursor += current;
-            char * bufdata = (char*)mp3f.pcm;
-            albv[currentBuffer].loadSound(AL_FORMAT_STEREO16, &bufdata[threeTime], current, mp3f.SampleRate);
-            threeTime += current;
-            als.SetBuffers(1, albv[currentBuffer].bid);
-            // printf("oneTime: %d, current:%d, playCursor:%d, mp3f.bufferSize:%d\n", oneTime, current, playCursor, mp3f.bufferSize);
-            if(++currentBuffer >= albv.size())
+            lock_guard<mutex> lock(mtx);
+            players.push_back(player);
+        }
+        cv.notify_all();
+    }
+    // Once it returns the worker is done with player, it may be deleted.
+    void Remove(StreamPlayer* player)
+    {
+        unique_lock<mutex> lock(mtx);
+        for(size_t i = 0; i < players.size(); ++i)
+        {
+            if(players[i] == player)
             {
-                assert(threeTime == mp3f.bufferSize);
-                currentBuffer = 0;
-                current = 0;
-                isNeedMoreData = true; // moredata
-                threeTime = 0;
+                players.erase(players.begin() + i);
+                break;
             }
         }
-        char buf1[32], buf2[32];
-        printf("current progress: %s/%s\n", showTime(GetProgress(), 32, buf1), showTime(GetDuration(), 32, buf2));
+        if(players.empty()) cv.notify_all();
+        // The pass under way may still hold player. Not from the worker itself,
+        // e.g. a FillBuffer removing its own player, that would never return.
+        if(this_thread::get_id() != worker.get_id()) cv.wait(lock, [this]{ return !filling; });
     }
-    float GetProgress()
+    // Blocks until every player has reached the end of its stream.
+    void WaitUntilDone()
     {
-        return playCursor / 88200.0f;
+        unique_lock<mutex> lock(mtx);
+        cv.wait(lock, [this]{ return players.empty(); });
     }
-    float GetDuration()
+    void PrintStats()
     {
-        return mp3f.duration;
+        lock_guard<mutex> lock(mtx);
+        printf("Streaming wakeups: %d, latency avg: %.2f ms, max: %.2f ms\n",
+            wakeups, wakeups ? totalLatency / wakeups : 0.0, maxLatency);
     }
 
+private:
+    static void AL_APIENTRY EventCallback(ALenum, ALuint, ALuint, ALsizei, const ALchar*, void* userParam)
+    {
+        StreamingService* self = (StreamingService*)userParam;
+        {
+            lock_guard<mutex> lock(self->mtx);
+            if(self->pendingEvents++ == 0) self->eventTime = chrono::steady_clock::now();
+        }
+        self->cv.notify_all();
+    }
+    // Half of the shortest buffer, so no queue can run dry between two wakeups.
+    chrono::microseconds TimerPeriod()
+    {
+        float period = 0.05f;
+        for(StreamPlayer* p : players)
+        {
+            float queued = p->GetBufferDuration() * p->GetBufferCounts();
+            period = min(period, queued / (2 * p->GetBufferCounts()));
+        }
+        period = max(period, 0.002f);
+        return chrono::microseconds((int64_t)(period * 1000000));
+    }
+    void Run()
+    {
+        typedef chrono::steady_clock clock;
+        unique_lock<mutex> lock(mtx);
+        clock::time_point lastWake = clock::now();
+        while(running)
+        {
+            if(players.empty())
+            {
+                cv.wait(lock, [this]{ return !running || !players.empty(); });
+                lastWake = clock::now();
+                continue;
+            }
+            // Events may be dropped (e.g. on a device reset), so keep a slow poll behind them.
+            if(useEvents) cv.wait_for(lock, chrono::milliseconds(250), [this]{ return !running || pendingEvents > 0; });
+            else          cv.wait_for(lock, TimerPeriod(), [this]{ return !running; });
+            if(!running) break;
 
-    Mp3File mp3f;
+            // In timer mode a buffer retired some time after the previous wakeup,
+            // so that is the worst case we report.
+            clock::time_point retired = (useEvents && pendingEvents) ? eventTime : lastWake;
+            pendingEvents = 0;
+            lastWake = clock::now();
+            vector<StreamPlayer*> active = players;
+            filling = true;
+            lock.unlock();
 
-    int32_t playCursor; // progress
-    vector<ALBuffer> albv;
-    int currentBuffer;
-    ALSource als;
-    int current;
+            int filled = 0;
+            for(StreamPlayer* p : active)
+            {
+                filled += p->FillBuffer();
+            }
+            ALErrorCheck::EndFrame();
+            double latency = chrono::duration<double, milli>(clock::now() - retired).count();
 
-    int oneTime;
+            lock.lock();
+            if(filled)
+            {
+                wakeups++;
+                totalLatency += latency;
+                maxLatency = max(maxLatency, latency);
+                printf("Stream wakeup --> refilled %d buffers, latency: %.2f ms\n", filled, latency);
+            }
+            for(StreamPlayer* p : active)
+            {
+                if(p->IsEnd()) players.erase(std::remove(players.begin(), players.end(), p), players.end());
+            }
+            filling = false;
+            cv.notify_all(); // Remove waits for the pass, WaitUntilDone for no players
+        }
+    }
 
-    bool isNeedMoreData;
-    int bufferCounts;
-    bool isEnd;
-    int threeTime;
-};
+    LPALEVENTCONTROLSOFT alEventControlSOFT;
+    LPALEVENTCALLBACKSOFT alEventCallbackSOFT;
+    bool useEvents;
 
+    thread worker;
+    mutex mtx;
+    condition_variable cv;
+    bool running;
+    bool filling; // the worker is using a copy of players without mtx
+    vector<StreamPlayer*> players;
+    int pendingEvents;
+    chrono::steady_clock::time_point eventTime;
 
+    int wakeups;
+    double totalLatency;
+    double maxLatency;
+};
 
 
 int main(int argc, char const *argv[])
 {
+    if(argc > 2 && !strcmp(argv[1], "--mp3-bench")) return benchMp3Decode(argv[2]);
+    if(argc > 2 && !strcmp(argv[1], "--flac-bench")) return benchFlacDecode(argv[2]);
+    if(argc > 2 && !strcmp(argv[1], "--vorbis-bench")) return benchVorbisDecode(argv[2], argc > 3 ? (float)atof(argv[3]) : 0.0f);
+
     // WavFile wavf2("bounce.wav");
     AL al;
     // ALBuffer alb;
@@ -785,19 +4734,46 @@ int main(int argc, char const *argv[])
     // als2.SetBuffer(alb.bid);
     // als2.SetLooping(true);
 
+    // SourcePool voices; // all the sources the device mixes, shared by every emitter
+    // int hum = voices.Add(alb.bid, 2.0f, true);
+    // voices.SetPosition(hum, 10.0f, 0.0f, 0.0f);
+    // voices.Play(hum);
+    // SampleBank sfx(32 << 20); // decoded one-shots, 32 MB of them stay cached
+    // SampleBank::Sample* step = sfx.Acquire("step.ogg");
+    // int stepEmitter = voices.Add(step->buffer.bid);
+    // voices.Play(stepEmitter);
+    // ... voices.Remove(stepEmitter); sfx.Release(step);
+    // voices.updates.SetListenerPosition(0.0f, 0.0f, 1.0f);
+    // voices.Update(1.0f / 60); // once per frame, every move of the frame lands at once
+
+    StreamingService streaming;
+    streaming.Start();
+
     MusicPlayer als("3.wav");
     als.Play();
+    streaming.Add(&als);
 
     // Mp3Player mp3p("4.mp3");
     // mp3p.Play();
-    while(1)
-    {
-        this_thread::sleep_for(chrono::milliseconds(100));
-        als.FillBuffer();
-        if(als.isEnd) break;
-        // mp3p.FillBuffer();
-        // if(mp3p.isEnd) break;
-    }
+    // streaming.Add(&mp3p);
+
+    // FlacPlayer flacp("5.flac");
+    // flacp.Play();
+    // streaming.Add(&flacp);
+
+    // OggPlayer oggp("6.ogg", true);
+    // oggp.Play();
+    // streaming.Add(&oggp);
+
+    // VorbisArenaPool vorbisArenas;
+    // VorbisSetupCache vorbisSetups(&vorbisArenas);
+    // OggPlayer step1("7.ogg", false, &vorbisSetups);
+    // vorbisSetups.ReserveArenas("7.ogg", 8);
+    // OggPlayer step2("7.ogg", false, &vorbisSetups); // shares step1's codebooks, mallocs nothing
+    streaming.WaitUntilDone();
+    streaming.Stop();
+    streaming.PrintStats();
+    ALErrorCheck::PrintSites();
     // while(1){if(!mp3p.GeTNext()) break;}
     // char c;
     // while(scanf("%c", &c) && c != 'q')
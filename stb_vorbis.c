@@ -147,6 +147,19 @@ extern int stb_vorbis_get_sample_offset(stb_vorbis *f);
 // of the memory buffer. In pushdata mode it returns 0.
 extern unsigned int stb_vorbis_get_file_offset(stb_vorbis *f);
 
+// the setup header (codebooks, floors, residues, mappings, modes) and the
+// twiddle factors, windows and bit-reverse tables built from it take most of
+// an open's time and memory, and never change while decoding. streams of the
+// same file can share them: stb_vorbis_share_setup() returns a reference to
+// f's setup, and the *_shared open functions take it instead of parsing the
+// setup header again, allocating only the new stream's decode buffers. the
+// setup is freed when the last stream using it is closed and every reference
+// is released; streams sharing it may decode on different threads. returns
+// NULL if f was opened with an alloc_buffer, which the setup can't outlive.
+typedef struct stb_vorbis_setup stb_vorbis_setup;
+extern stb_vorbis_setup *stb_vorbis_share_setup(stb_vorbis *f);
+extern void stb_vorbis_release_setup(stb_vorbis_setup *setup);
+
 ///////////   PUSHDATA API
 
 #ifndef STB_VORBIS_NO_PUSHDATA_API
@@ -172,6 +185,17 @@ extern stb_vorbis *stb_vorbis_open_pushdata(
 // if returns NULL and *error is VORBIS_need_more_data, then the input block was
 //       incomplete and you need to pass in a larger block from the start of the file
 
+extern stb_vorbis *stb_vorbis_open_pushdata_shared(
+         const unsigned char * datablock, int datablock_length_in_bytes,
+         int *datablock_memory_consumed_in_bytes,
+         int *error,
+         const stb_vorbis_alloc *alloc_buffer,
+         stb_vorbis_setup *setup);
+// same as stb_vorbis_open_pushdata(), but skips the setup header and uses
+// 'setup' from stb_vorbis_share_setup() instead. the datablock must start the
+// same file; if its identification header doesn't match the setup's, fails
+// with VORBIS_invalid_setup.
+
 extern int stb_vorbis_decode_frame_pushdata(
          stb_vorbis *f,
          const unsigned char *datablock, int datablock_length_in_bytes,
@@ -242,6 +266,12 @@ extern stb_vorbis * stb_vorbis_open_memory(const unsigned char *data, int len,
 // create an ogg vorbis decoder from an ogg vorbis stream in memory (note
 // this must be the entire stream!). on failure, returns NULL and sets *error
 
+extern stb_vorbis * stb_vorbis_open_memory_shared(const unsigned char *data, int len,
+                                  int *error, const stb_vorbis_alloc *alloc_buffer,
+                                  stb_vorbis_setup *setup);
+// same as stb_vorbis_open_memory(), with the setup of another stream of the
+// same file, see stb_vorbis_share_setup().
+
 #ifndef STB_VORBIS_NO_STDIO
 extern stb_vorbis * stb_vorbis_open_filename(const char *filename,
                                   int *error, const stb_vorbis_alloc *alloc_buffer);
@@ -419,6 +449,11 @@ enum STBVorbisError
 //      most platforms which requires endianness be defined correctly.
 //#define STB_VORBIS_NO_FAST_SCALED_FLOAT
 
+// STB_VORBIS_NO_SIMD
+//      does not compile the SSE2/AVX2 inverse MDCT loops, which are
+//      otherwise picked at run time on x86 when the CPU has them.
+//#define STB_VORBIS_NO_SIMD
+
 
 // STB_VORBIS_MAX_CHANNELS [number]
 //     globally define this to the maximum number of channels you need.
@@ -598,6 +633,27 @@ enum STBVorbisError
 #error "Value of STB_VORBIS_FAST_HUFFMAN_LENGTH outside of allowed range"
 #endif
 
+// SSE2 and AVX2 versions of the inverse MDCT loops, picked at run time. GCC
+// and Clang compile them through target attributes, so the rest of the file
+// needs no -msse2/-mavx2. They do the scalar loops' float operations in the
+// same order, the output is identical.
+#if !defined(STB_VORBIS_NO_SIMD) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+   #if defined(_MSC_VER) && _MSC_VER >= 1700
+      #define STBV_SIMD
+      #define STBV_TARGET_SSE2
+      #define STBV_TARGET_AVX2
+      #include <intrin.h>
+   #elif (defined(__GNUC__) && !defined(__clang__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))) || \
+         (defined(__clang__) && (__clang_major__ > 3 || (__clang_major__ == 3 && __clang_minor__ >= 8)))
+      #define STBV_SIMD
+      #define STBV_TARGET_SSE2 __attribute__((target("sse2")))
+      #define STBV_TARGET_AVX2 __attribute__((target("avx2")))
+   #endif
+   #ifdef STBV_SIMD
+      #include <immintrin.h>
+   #endif
+#endif
+
 
 #if 0
 #include <crtdbg.h>
@@ -778,6 +834,8 @@ struct stb_vorbis
    stb_vorbis_alloc alloc;
    int setup_offset;
    int temp_offset;
+   int temp_offset_low; // lowest temp_offset yet, setup_offset plus the rest is alloc_buffer's high-water mark
+   stb_vorbis_setup *shared; // if set, owns the header info and twiddle factors below
 
   // run-time results
    int eof;
@@ -866,6 +924,21 @@ struct stb_vorbis
 
 typedef struct stb_vorbis vorb;
 
+struct stb_vorbis_setup
+{
+   long refs;
+   stb_vorbis setup; // owns the shared allocations, malloc()ed
+};
+
+#if defined(_MSC_VER)
+   #include <intrin.h>
+   #define stbv__atomic_add(p,v)   (_InterlockedExchangeAdd((volatile long *) (p), (v)) + (v))
+#elif defined(__GNUC__)
+   #define stbv__atomic_add(p,v)   __sync_add_and_fetch((p), (v))
+#else
+   #define stbv__atomic_add(p,v)   (*(p) += (v)) // not thread-safe
+#endif
+
 static int error(vorb *f, enum STBVorbisError e)
 {
    f->error = e;
@@ -928,6 +1001,7 @@ static void *setup_temp_malloc(vorb *f, int sz)
    if (f->alloc.alloc_buffer) {
       if (f->temp_offset - sz < f->setup_offset) return NULL;
       f->temp_offset -= sz;
+      if (f->temp_offset < f->temp_offset_low) f->temp_offset_low = f->temp_offset;
       return (char *) f->alloc.alloc_buffer + f->temp_offset;
    }
    return malloc(sz);
@@ -961,6 +1035,31 @@ static __forceinline uint32 crc32_update(uint32 crc, uint8 byte)
    return (crc << 8) ^ crc_table[byte ^ (crc >> 24)];
 }
 
+#ifdef STBV_SIMD
+// 0 scalar, 1 SSE2, 2 AVX2
+static int stbv__simd_level;
+
+static void stbv__init_simd(void)
+{
+#ifdef _MSC_VER
+   int info[4];
+   stbv__simd_level = 0;
+   __cpuid(info, 1);
+   if (!(info[3] & (1 << 26))) return;
+   stbv__simd_level = 1;
+   // AVX2 also needs the OS to save the YMM registers
+   if ((info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6) {
+      __cpuidex(info, 7, 0);
+      if (info[1] & (1 << 5))
+         stbv__simd_level = 2;
+   }
+#else
+   __builtin_cpu_init();
+   stbv__simd_level = __builtin_cpu_supports("avx2") ? 2 : __builtin_cpu_supports("sse2") ? 1 : 0;
+#endif
+}
+#endif
+
 
 // used in setup, and for huffman that doesn't go fast path
 static unsigned int bit_reverse(unsigned int n)
@@ -2385,6 +2484,231 @@ void inverse_mdct(float *buffer, int n, vorb *f, int blocktype)
 #endif
 
 
+#ifdef STBV_SIMD
+// Lanes hold ascending addresses, so a butterfly pair (e[-1], e[0]) sits in
+// lanes (2j, 2j+1) and comes out as d*re + swap(d)*(im, -im). That is the
+// scalar (k01*A[0] + k00*A[1], k00*A[0] - k01*A[1]) to the last bit.
+static STBV_TARGET_SSE2 __forceinline __m128 stbv__cmul_sse2(__m128 d, __m128 w, __m128 neg)
+{
+   __m128 re = _mm_shuffle_ps(w, w, _MM_SHUFFLE(2,2,0,0));
+   __m128 im = _mm_xor_ps(_mm_shuffle_ps(w, w, _MM_SHUFFLE(3,3,1,1)), neg);
+   __m128 sw = _mm_shuffle_ps(d, d, _MM_SHUFFLE(2,3,0,1));
+   return _mm_add_ps(_mm_mul_ps(d, re), _mm_mul_ps(sw, im));
+}
+
+// Twiddles (A[0], A[1]) for the upper pair of the lanes and (B[0], B[1]) for the lower one.
+static STBV_TARGET_SSE2 __forceinline __m128 stbv__twiddles_sse2(float *A, float *B)
+{
+   return _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64 *) B), (const __m64 *) A);
+}
+
+// The step 3 butterflies of imdct_step3_iter0_loop, imdct_step3_inner_r_loop
+// and imdct_step3_inner_s_loop: count groups of four pairs running down from
+// e0[0] and e2[0]. Pair j of a group takes the twiddle at A + j*a_step, each
+// group moves A on by a_next and e0, e2 down by e_next.
+static STBV_TARGET_SSE2 void imdct_step3_loop_sse2(int count, float *e0, float *e2, float *A, int a_step, int a_next, int e_next)
+{
+   const __m128 neg = _mm_castsi128_ps(_mm_set_epi32((int) 0x80000000, 0, (int) 0x80000000, 0));
+   for (; count > 0; --count) {
+      __m128 a = _mm_loadu_ps(e0-3);
+      __m128 b = _mm_loadu_ps(e2-3);
+      _mm_storeu_ps(e0-3, _mm_add_ps(a, b));
+      _mm_storeu_ps(e2-3, stbv__cmul_sse2(_mm_sub_ps(a, b), stbv__twiddles_sse2(A, A+a_step), neg));
+
+      a = _mm_loadu_ps(e0-7);
+      b = _mm_loadu_ps(e2-7);
+      _mm_storeu_ps(e0-7, _mm_add_ps(a, b));
+      _mm_storeu_ps(e2-7, stbv__cmul_sse2(_mm_sub_ps(a, b), stbv__twiddles_sse2(A+a_step*2, A+a_step*3), neg));
+
+      A  += a_next;
+      e0 -= e_next;
+      e2 -= e_next;
+   }
+}
+
+static STBV_TARGET_AVX2 void imdct_step3_loop_avx2(int count, float *e0, float *e2, float *A, int a_step, int a_next, int e_next)
+{
+   const __m256 neg = _mm256_castsi256_ps(_mm256_set_epi32((int) 0x80000000, 0, (int) 0x80000000, 0, (int) 0x80000000, 0, (int) 0x80000000, 0));
+   for (; count > 0; --count) {
+      __m128 hi = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64 *) (A+a_step)), (const __m64 *) A);
+      __m128 lo = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64 *) (A+a_step*3)), (const __m64 *) (A+a_step*2));
+      __m256 w  = _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+      __m256 a  = _mm256_loadu_ps(e0-7);
+      __m256 b  = _mm256_loadu_ps(e2-7);
+      __m256 d  = _mm256_sub_ps(a, b);
+      __m256 re = _mm256_moveldup_ps(w);
+      __m256 im = _mm256_xor_ps(_mm256_movehdup_ps(w), neg);
+      __m256 sw = _mm256_permute_ps(d, _MM_SHUFFLE(2,3,0,1));
+      _mm256_storeu_ps(e0-7, _mm256_add_ps(a, b));
+      _mm256_storeu_ps(e2-7, _mm256_add_ps(_mm256_mul_ps(d, re), _mm256_mul_ps(sw, im)));
+
+      A  += a_next;
+      e0 -= e_next;
+      e2 -= e_next;
+   }
+}
+
+// iter_54 on z[-7..0], hi holds z[-3..0] and lo z[-7..-4].
+static STBV_TARGET_SSE2 __forceinline void stbv__iter_54_sse2(__m128 *hi, __m128 *lo)
+{
+   const __m128 neg01 = _mm_castsi128_ps(_mm_set_epi32(0, 0, (int) 0x80000000, (int) 0x80000000));
+   const __m128 neg12 = _mm_castsi128_ps(_mm_set_epi32(0, (int) 0x80000000, (int) 0x80000000, 0));
+   __m128 y = _mm_add_ps(*hi, *lo); // y3 y2 y1 y0
+   __m128 k = _mm_sub_ps(*hi, *lo); // k33 k22 k11 k00
+   *hi = _mm_add_ps(_mm_shuffle_ps(y, y, _MM_SHUFFLE(1,0,3,2)), _mm_xor_ps(y, neg01));
+   *lo = _mm_add_ps(_mm_shuffle_ps(k, k, _MM_SHUFFLE(3,2,3,2)), _mm_xor_ps(_mm_shuffle_ps(k, k, _MM_SHUFFLE(0,1,0,1)), neg12));
+}
+
+static STBV_TARGET_SSE2 void imdct_step3_inner_s_loop_ld654_sse2(int n, float *e, int i_off, float *A, int base_n)
+{
+   const __m128 neg0  = _mm_castsi128_ps(_mm_set_epi32(0, 0, 0, (int) 0x80000000));
+   const __m128 neg01 = _mm_castsi128_ps(_mm_set_epi32(0, 0, (int) 0x80000000, (int) 0x80000000));
+   const __m128 neg2  = _mm_castsi128_ps(_mm_set_epi32(0, (int) 0x80000000, 0, 0));
+   __m128 A2 = _mm_set1_ps(A[base_n >> 3]);
+   float *z = e + i_off;
+   float *base = z - 16 * n;
+
+   while (z > base) {
+      __m128 h1 = _mm_loadu_ps(z- 3);
+      __m128 h0 = _mm_loadu_ps(z- 7);
+      __m128 l1 = _mm_loadu_ps(z-11);
+      __m128 l0 = _mm_loadu_ps(z-15);
+      __m128 d1 = _mm_sub_ps(h1, l1); // z[-3..0] - z[-11..-8]
+      __m128 d0 = _mm_sub_ps(h0, l0); // z[-7..-4] - z[-15..-12]
+      __m128 s1, s0;
+      h1 = _mm_add_ps(h1, l1);
+      h0 = _mm_add_ps(h0, l0);
+
+      // the scalar loop's k00/k11 for z[-8..-11], k00+k11 and k11-k00 from one add
+      s1 = _mm_shuffle_ps(d1, d1, _MM_SHUFFLE(2,3,0,1));
+      l1 = _mm_shuffle_ps(_mm_mul_ps(_mm_add_ps(d1, _mm_xor_ps(s1, neg0)), A2), d1, _MM_SHUFFLE(3,2,1,0));
+      // and for z[-12..-15], where it reverses the operands to avoid a negation
+      s0 = _mm_shuffle_ps(d0, d0, _MM_SHUFFLE(2,3,0,1));
+      l0 = _mm_shuffle_ps(_mm_mul_ps(_mm_add_ps(_mm_xor_ps(d0, neg01), _mm_xor_ps(s0, neg0)), A2), _mm_xor_ps(s0, neg2), _MM_SHUFFLE(3,2,1,0));
+
+      stbv__iter_54_sse2(&h1, &h0);
+      stbv__iter_54_sse2(&l1, &l0);
+      _mm_storeu_ps(z- 3, h1);
+      _mm_storeu_ps(z- 7, h0);
+      _mm_storeu_ps(z-11, l1);
+      _mm_storeu_ps(z-15, l0);
+      z -= 16;
+   }
+}
+
+// Steps 0, 2, 7 and 8 of inverse_mdct, two to four scalar iterations per
+// vector. As above, each lane does the scalar expression's operations.
+
+// Step 0 for two iterations: (x*A[1] + y*A[0], x*A[0] - y*A[1]) for the
+// iteration in the upper lanes and the next one, at A+2, in the lower lanes.
+static STBV_TARGET_SSE2 __forceinline __m128 stbv__step0_pair_sse2(__m128 x, __m128 y, float *AA)
+{
+   const __m128 neg13 = _mm_castsi128_ps(_mm_set_epi32((int) 0x80000000, 0, (int) 0x80000000, 0));
+   __m128 a = _mm_loadu_ps(AA);
+   __m128 p = _mm_mul_ps(x, _mm_shuffle_ps(a, a, _MM_SHUFFLE(0,1,2,3)));
+   __m128 q = _mm_mul_ps(y, _mm_shuffle_ps(a, a, _MM_SHUFFLE(1,0,3,2)));
+   return _mm_add_ps(p, _mm_xor_ps(q, neg13));
+}
+
+static STBV_TARGET_SSE2 void imdct_step0_sse2(float *buffer, float *buf2, float *A, int n2)
+{
+   const __m128 neg = _mm_castsi128_ps(_mm_set1_epi32((int) 0x80000000));
+   float *d = &buf2[n2-4], *AA = A, *e = &buffer[0], *e_stop = &buffer[n2];
+   while (e != e_stop) {
+      __m128 lo = _mm_loadu_ps(e);
+      __m128 hi = _mm_loadu_ps(e+4);
+      _mm_storeu_ps(d, stbv__step0_pair_sse2(_mm_shuffle_ps(hi, lo, _MM_SHUFFLE(0,0,0,0)), _mm_shuffle_ps(hi, lo, _MM_SHUFFLE(2,2,2,2)), AA));
+      d  -= 4;
+      AA += 4;
+      e  += 8;
+   }
+
+   // the reflected half reads -e[2] and -e[0] going down
+   e = &buffer[n2-4];
+   while (d >= buf2) {
+      __m128 hi = _mm_xor_ps(_mm_loadu_ps(e), neg);
+      __m128 lo = _mm_xor_ps(_mm_loadu_ps(e-4), neg);
+      _mm_storeu_ps(d, stbv__step0_pair_sse2(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3,3,3,3)), _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(1,1,1,1)), AA));
+      d  -= 4;
+      AA += 4;
+      e  -= 8;
+   }
+}
+
+static STBV_TARGET_SSE2 void imdct_step2_sse2(float *u, float *v, float *A, int n2)
+{
+   const __m128 neg = _mm_castsi128_ps(_mm_set_epi32((int) 0x80000000, 0, (int) 0x80000000, 0));
+   int n4 = n2 >> 1;
+   float *AA = &A[n2-8];
+   float *e0 = &v[n4], *e1 = &v[0];
+   float *d0 = &u[n4], *d1 = &u[0];
+
+   while (AA >= A) {
+      __m128 a = _mm_loadu_ps(e0);
+      __m128 b = _mm_loadu_ps(e1);
+      _mm_storeu_ps(d0, _mm_add_ps(a, b));
+      _mm_storeu_ps(d1, stbv__cmul_sse2(_mm_sub_ps(a, b), stbv__twiddles_sse2(AA, AA+4), neg));
+      AA -= 8;
+      d0 += 4;
+      d1 += 4;
+      e0 += 4;
+      e1 += 4;
+   }
+}
+
+static STBV_TARGET_SSE2 void imdct_step7_sse2(float *v, float *C, int n2)
+{
+   const __m128 neg02 = _mm_castsi128_ps(_mm_set_epi32(0, (int) 0x80000000, 0, (int) 0x80000000));
+   const __m128 neg13 = _mm_castsi128_ps(_mm_set_epi32((int) 0x80000000, 0, (int) 0x80000000, 0));
+   float *d = v, *e = v + n2 - 4;
+
+   while (d < e) {
+      __m128 dd = _mm_loadu_ps(d);
+      __m128 ee = _mm_loadu_ps(e);
+      __m128 c  = _mm_loadu_ps(C);
+      __m128 er = _mm_shuffle_ps(ee, ee, _MM_SHUFFLE(1,0,3,2));   // e[2] e[3] e[0] e[1]
+      __m128 a  = _mm_add_ps(dd, _mm_xor_ps(er, neg02));         // a02 a11
+      __m128 b  = _mm_add_ps(_mm_mul_ps(a, _mm_shuffle_ps(c, c, _MM_SHUFFLE(3,3,1,1))),
+                             _mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(2,3,0,1)), _mm_xor_ps(_mm_shuffle_ps(c, c, _MM_SHUFFLE(2,2,0,0)), neg13))); // b0 b1
+      __m128 bb = _mm_add_ps(dd, _mm_xor_ps(er, neg13));         // b2 b3
+      __m128 r  = _mm_add_ps(_mm_xor_ps(bb, neg13), _mm_xor_ps(b, neg02));
+      _mm_storeu_ps(d, _mm_add_ps(bb, b));
+      _mm_storeu_ps(e, _mm_shuffle_ps(r, r, _MM_SHUFFLE(1,0,3,2)));
+      C += 4;
+      d += 4;
+      e -= 4;
+   }
+}
+
+static STBV_TARGET_SSE2 void imdct_step8_sse2(float *buffer, float *buf2, float *B, int n)
+{
+   const __m128 neg = _mm_castsi128_ps(_mm_set1_epi32((int) 0x80000000));
+   int n2 = n >> 1;
+   float *e = buf2 + n2 - 8;
+   float *d0 = &buffer[0], *d1 = &buffer[n2-4], *d2 = &buffer[n2], *d3 = &buffer[n-4];
+   B += n2 - 8;
+
+   while (e >= buf2) {
+      __m128 e0 = _mm_loadu_ps(e), e1 = _mm_loadu_ps(e+4);
+      __m128 b0 = _mm_loadu_ps(B), b1 = _mm_loadu_ps(B+4);
+      __m128 ev = _mm_shuffle_ps(e0, e1, _MM_SHUFFLE(2,0,2,0)), od = _mm_shuffle_ps(e0, e1, _MM_SHUFFLE(3,1,3,1));
+      __m128 bv = _mm_shuffle_ps(b0, b1, _MM_SHUFFLE(2,0,2,0)), bd = _mm_shuffle_ps(b0, b1, _MM_SHUFFLE(3,1,3,1));
+      __m128 p  = _mm_sub_ps(_mm_mul_ps(ev, bd), _mm_mul_ps(od, bv));                    // p1 p3 of each group of 8
+      __m128 q  = _mm_sub_ps(_mm_xor_ps(_mm_mul_ps(ev, bv), neg), _mm_mul_ps(od, bd));   // p0 p2
+      _mm_storeu_ps(d0, _mm_shuffle_ps(p, p, _MM_SHUFFLE(0,1,2,3)));
+      _mm_storeu_ps(d1, _mm_xor_ps(p, neg));
+      _mm_storeu_ps(d2, _mm_shuffle_ps(q, q, _MM_SHUFFLE(0,1,2,3)));
+      _mm_storeu_ps(d3, q);
+      B  -= 8;
+      e  -= 8;
+      d0 += 4;
+      d2 += 4;
+      d1 -= 4;
+      d3 -= 4;
+   }
+}
+#endif // STBV_SIMD
+
 // the following were split out into separate functions while optimizing;
 // they could be pushed back up but eh. __forceinline showed no change;
 // they're probably already being inlined.
@@ -2395,6 +2719,10 @@ static void imdct_step3_iter0_loop(int n, float *e, int i_off, int k_off, float
    int i;
 
    assert((n & 3) == 0);
+   #ifdef STBV_SIMD
+   if (stbv__simd_level == 2) { imdct_step3_loop_avx2(n >> 2, ee0, ee2, A, 8, 32, 8); return; }
+   if (stbv__simd_level == 1) { imdct_step3_loop_sse2(n >> 2, ee0, ee2, A, 8, 32, 8); return; }
+   #endif
    for (i=(n>>2); i > 0; --i) {
       float k00_20, k01_21;
       k00_20  = ee0[ 0] - ee2[ 0];
@@ -2441,6 +2769,11 @@ static void imdct_step3_inner_r_loop(int lim, float *e, int d0, int k_off, float
    float *e0 = e + d0;
    float *e2 = e0 + k_off;
 
+   #ifdef STBV_SIMD
+   if (stbv__simd_level == 2) { imdct_step3_loop_avx2(lim >> 2, e0, e2, A, k1, k1*4, 8); return; }
+   if (stbv__simd_level == 1) { imdct_step3_loop_sse2(lim >> 2, e0, e2, A, k1, k1*4, 8); return; }
+   #endif
+
    for (i=lim >> 2; i > 0; --i) {
       k00_20 = e0[-0] - e2[-0];
       k01_21 = e0[-1] - e2[-1];
@@ -2500,6 +2833,11 @@ static void imdct_step3_inner_s_loop(int n, float *e, int i_off, int k_off, floa
    float *ee0 = e  +i_off;
    float *ee2 = ee0+k_off;
 
+   #ifdef STBV_SIMD
+   if (stbv__simd_level == 2) { imdct_step3_loop_avx2(n, ee0, ee2, A, a_off, 0, k0); return; }
+   if (stbv__simd_level == 1) { imdct_step3_loop_sse2(n, ee0, ee2, A, a_off, 0, k0); return; }
+   #endif
+
    for (i=n; i > 0; --i) {
       k00     = ee0[ 0] - ee2[ 0];
       k11     = ee0[-1] - ee2[-1];
@@ -2573,6 +2911,10 @@ static void imdct_step3_inner_s_loop_ld654(int n, float *e, int i_off, float *A,
    float *z = e + i_off;
    float *base = z - 16 * n;
 
+   #ifdef STBV_SIMD
+   if (stbv__simd_level >= 1) { imdct_step3_inner_s_loop_ld654_sse2(n, e, i_off, A, base_n); return; }
+   #endif
+
    while (z > base) {
       float k00,k11;
 
@@ -2640,6 +2982,11 @@ static void inverse_mdct(float *buffer, int n, vorb *f, int blocktype)
    // this propogates through linearly to the end, where the numbers
    // are 1/2 too small, and need to be compensated for.
 
+   #ifdef STBV_SIMD
+   if (stbv__simd_level >= 1)
+      imdct_step0_sse2(buffer, buf2, A, n2);
+   else
+   #endif
    {
       float *d,*e, *AA, *e_stop;
       d = &buf2[n2-2];
@@ -2674,6 +3021,11 @@ static void inverse_mdct(float *buffer, int n, vorb *f, int blocktype)
    // step 2    (paper output is w, now u)
    // this could be in place, but the data ends up in the wrong
    // place... _somebody_'s got to swap it, so this is nominated
+   #ifdef STBV_SIMD
+   if (stbv__simd_level >= 1)
+      imdct_step2_sse2(u, v, A, n2);
+   else
+   #endif
    {
       float *AA = &A[n2-8];
       float *d0,*d1, *e0, *e1;
@@ -2801,6 +3153,11 @@ static void inverse_mdct(float *buffer, int n, vorb *f, int blocktype)
 
    // step 7   (paper output is v, now v)
    // this is now in place
+   #ifdef STBV_SIMD
+   if (stbv__simd_level >= 1)
+      imdct_step7_sse2(v, f->C[blocktype], n2);
+   else
+   #endif
    {
       float *C = f->C[blocktype];
       float *d, *e;
@@ -2855,6 +3212,11 @@ static void inverse_mdct(float *buffer, int n, vorb *f, int blocktype)
 
    // this cannot POSSIBLY be in place, so we refer to the buffers directly
 
+   #ifdef STBV_SIMD
+   if (stbv__simd_level >= 1)
+      imdct_step8_sse2(buffer, buf2, f->B[blocktype], n);
+   else
+   #endif
    {
       float *d0,*d1,*d2,*d3;
 
@@ -3563,6 +3925,9 @@ static int is_whole_packet_present(stb_vorbis *f, int end_page)
 }
 #endif // !STB_VORBIS_NO_PUSHDATA_API
 
+static int start_decoder_shared(vorb *f);
+static int start_decoder_stream(vorb *f, int longest_floorlist);
+
 static int start_decoder(vorb *f)
 {
    uint8 header[6], x,y;
@@ -3633,6 +3998,12 @@ static int start_decoder(vorb *f)
    #endif
 
    crc32_init(); // always init it, to avoid multithread race conditions
+   #ifdef STBV_SIMD
+   stbv__init_simd();
+   #endif
+
+   if (f->shared)
+      return start_decoder_shared(f);
 
    if (get8_packet(f) != VORBIS_packet_setup)       return error(f, VORBIS_invalid_setup);
    for (i=0; i < 6; ++i) header[i] = get8_packet(f);
@@ -4048,6 +4419,71 @@ static int start_decoder(vorb *f)
 
    flush_packet(f);
 
+   if (!init_blocksize(f, 0, f->blocksize_0)) return FALSE;
+   if (!init_blocksize(f, 1, f->blocksize_1)) return FALSE;
+
+   return start_decoder_stream(f, longest_floorlist);
+}
+
+// copies the setup header info and the per-blocksize tables
+static void copy_setup(vorb *d, vorb *s)
+{
+   int i;
+   d->codebook_count = s->codebook_count;
+   d->codebooks      = s->codebooks;
+   d->floor_count    = s->floor_count;
+   d->floor_config   = s->floor_config;
+   d->residue_count  = s->residue_count;
+   d->residue_config = s->residue_config;
+   d->mapping_count  = s->mapping_count;
+   d->mapping        = s->mapping;
+   d->mode_count     = s->mode_count;
+   memcpy(d->floor_types,   s->floor_types,   sizeof(s->floor_types));
+   memcpy(d->residue_types, s->residue_types, sizeof(s->residue_types));
+   memcpy(d->mode_config,   s->mode_config,   sizeof(s->mode_config));
+   for (i=0; i < 2; ++i) {
+      d->A[i] = s->A[i];
+      d->B[i] = s->B[i];
+      d->C[i] = s->C[i];
+      d->window[i] = s->window[i];
+      d->bit_reverse[i] = s->bit_reverse[i];
+   }
+}
+
+// the third packet of a stream opened with a shared setup; the stream that
+// shared it already parsed it, so only check it's the same kind of stream
+static int start_decoder_shared(vorb *f)
+{
+   vorb *s = &f->shared->setup;
+   int i, len, longest_floorlist=0;
+   if (f->channels != s->channels || f->sample_rate != s->sample_rate)            return error(f, VORBIS_invalid_setup);
+   if (f->blocksize_0 != s->blocksize_0 || f->blocksize_1 != s->blocksize_1)      return error(f, VORBIS_invalid_setup);
+   if (get8_packet(f) != VORBIS_packet_setup)       return error(f, VORBIS_invalid_setup);
+   skip(f, f->bytes_in_seg);
+   f->bytes_in_seg = 0;
+   do {
+      len = next_segment(f);
+      skip(f, len);
+      f->bytes_in_seg = 0;
+   } while (len);
+   #ifndef STB_VORBIS_NO_PUSHDATA_API
+   if (IS_PUSH_MODE(f))
+      f->eof = FALSE; // skip() stopping at the end of the datablock isn't the end of the stream
+   #endif
+
+   copy_setup(f, s);
+   for (i=0; i < f->floor_count; ++i)
+      if (f->floor_config[i].floor1.values > longest_floorlist)
+         longest_floorlist = f->floor_config[i].floor1.values;
+
+   return start_decoder_stream(f, longest_floorlist);
+}
+
+// allocates the per-stream decode buffers once the headers are in
+static int start_decoder_stream(vorb *f, int longest_floorlist)
+{
+   int i;
+
    f->previous_length = 0;
 
    for (i=0; i < f->channels; ++i) {
@@ -4062,16 +4498,16 @@ static int start_decoder(vorb *f)
       #endif
    }
 
-   if (!init_blocksize(f, 0, f->blocksize_0)) return FALSE;
-   if (!init_blocksize(f, 1, f->blocksize_1)) return FALSE;
    f->blocksize[0] = f->blocksize_0;
    f->blocksize[1] = f->blocksize_1;
 
 #ifdef STB_VORBIS_DIVIDE_TABLE
-   if (integer_divide_table[1][1]==0)
+   if (integer_divide_table[1][1]==0) {
+      int j;
       for (i=0; i < DIVTAB_NUMER; ++i)
          for (j=1; j < DIVTAB_DENOM; ++j)
             integer_divide_table[i][j] = i / j;
+   }
 #endif
 
    // compute how much temporary memory is needed
@@ -4118,7 +4554,7 @@ static int start_decoder(vorb *f)
    return TRUE;
 }
 
-static void vorbis_deinit(stb_vorbis *p)
+static void vorbis_free_setup(stb_vorbis *p)
 {
    int i,j;
    if (p->residue_config) {
@@ -4153,6 +4589,22 @@ static void vorbis_deinit(stb_vorbis *p)
          setup_free(p, p->mapping[i].chan);
       setup_free(p, p->mapping);
    }
+   for (i=0; i < 2; ++i) {
+      setup_free(p, p->A[i]);
+      setup_free(p, p->B[i]);
+      setup_free(p, p->C[i]);
+      setup_free(p, p->window[i]);
+      setup_free(p, p->bit_reverse[i]);
+   }
+}
+
+static void vorbis_deinit(stb_vorbis *p)
+{
+   int i;
+   if (p->shared)
+      stb_vorbis_release_setup(p->shared);
+   else
+      vorbis_free_setup(p);
    CHECK(p);
    for (i=0; i < p->channels && i < STB_VORBIS_MAX_CHANNELS; ++i) {
       setup_free(p, p->channel_buffers[i]);
@@ -4162,13 +4614,6 @@ static void vorbis_deinit(stb_vorbis *p)
       #endif
       setup_free(p, p->finalY[i]);
    }
-   for (i=0; i < 2; ++i) {
-      setup_free(p, p->A[i]);
-      setup_free(p, p->B[i]);
-      setup_free(p, p->C[i]);
-      setup_free(p, p->window[i]);
-      setup_free(p, p->bit_reverse[i]);
-   }
    #ifndef STB_VORBIS_NO_STDIO
    if (p->close_on_free) fclose(p->f);
    #endif
@@ -4181,6 +4626,36 @@ void stb_vorbis_close(stb_vorbis *p)
    setup_free(p,p);
 }
 
+stb_vorbis_setup *stb_vorbis_share_setup(stb_vorbis *f)
+{
+   stb_vorbis_setup *s;
+   if (f->shared) {
+      stbv__atomic_add(&f->shared->refs, 1);
+      return f->shared;
+   }
+   if (f->alloc.alloc_buffer) return NULL;
+   s = (stb_vorbis_setup *) malloc(sizeof(*s));
+   if (s == NULL) return NULL;
+   memset(s, 0, sizeof(*s));
+   s->refs = 2; // the caller's and f's
+   s->setup.channels    = f->channels;
+   s->setup.sample_rate = f->sample_rate;
+   s->setup.blocksize_0 = f->blocksize_0;
+   s->setup.blocksize_1 = f->blocksize_1;
+   copy_setup(&s->setup, f);
+   f->shared = s;
+   return s;
+}
+
+void stb_vorbis_release_setup(stb_vorbis_setup *s)
+{
+   if (s == NULL) return;
+   if (stbv__atomic_add(&s->refs, -1) == 0) {
+      vorbis_free_setup(&s->setup);
+      free(s);
+   }
+}
+
 static void vorbis_init(stb_vorbis *p, const stb_vorbis_alloc *z)
 {
    memset(p, 0, sizeof(*p)); // NULL out all malloc'd pointers to start
@@ -4188,6 +4663,7 @@ static void vorbis_init(stb_vorbis *p, const stb_vorbis_alloc *z)
       p->alloc = *z;
       p->alloc.alloc_buffer_length_in_bytes = (p->alloc.alloc_buffer_length_in_bytes+3) & ~3;
       p->temp_offset = p->alloc.alloc_buffer_length_in_bytes;
+      p->temp_offset_low = p->temp_offset;
    }
    p->eof = 0;
    p->error = VORBIS__no_error;
@@ -4412,17 +4888,31 @@ stb_vorbis *stb_vorbis_open_pushdata(
          const unsigned char *data, int data_len, // the memory available for decoding
          int *data_used,              // only defined if result is not NULL
          int *error, const stb_vorbis_alloc *alloc)
+{
+   return stb_vorbis_open_pushdata_shared(data, data_len, data_used, error, alloc, NULL);
+}
+
+stb_vorbis *stb_vorbis_open_pushdata_shared(
+         const unsigned char *data, int data_len, // the memory available for decoding
+         int *data_used,              // only defined if result is not NULL
+         int *error, const stb_vorbis_alloc *alloc,
+         stb_vorbis_setup *setup)
 {
    stb_vorbis *f, p;
    vorbis_init(&p, alloc);
    p.stream     = (uint8 *) data;
    p.stream_end = (uint8 *) data + data_len;
    p.push_mode  = TRUE;
+   if (setup) {
+      stbv__atomic_add(&setup->refs, 1);
+      p.shared = setup;
+   }
    if (!start_decoder(&p)) {
       if (p.eof)
          *error = VORBIS_need_more_data;
       else
          *error = p.error;
+      vorbis_deinit(&p);
       return NULL;
    }
    f = vorbis_alloc(&p);
@@ -4982,6 +5472,11 @@ stb_vorbis * stb_vorbis_open_filename(const char *filename, int *error, const st
 #endif // STB_VORBIS_NO_STDIO
 
 stb_vorbis * stb_vorbis_open_memory(const unsigned char *data, int len, int *error, const stb_vorbis_alloc *alloc)
+{
+   return stb_vorbis_open_memory_shared(data, len, error, alloc, NULL);
+}
+
+stb_vorbis * stb_vorbis_open_memory_shared(const unsigned char *data, int len, int *error, const stb_vorbis_alloc *alloc, stb_vorbis_setup *setup)
 {
    stb_vorbis *f, p;
    if (data == NULL) return NULL;
@@ -4991,6 +5486,10 @@ stb_vorbis * stb_vorbis_open_memory(const unsigned char *data, int len, int *err
    p.stream_start = (uint8 *) p.stream;
    p.stream_len = len;
    p.push_mode = FALSE;
+   if (setup) {
+      stbv__atomic_add(&setup->refs, 1);
+      p.shared = setup;
+   }
    if (start_decoder(&p)) {
       f = vorbis_alloc(&p);
       if (f) {